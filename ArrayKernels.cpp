@@ -0,0 +1,94 @@
+#include "ArrayKernels.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define LANG_HAS_AVX2_KERNELS 1
+#include <immintrin.h>
+#endif
+
+namespace lang {
+
+namespace {
+
+// Additions are done on unsigned values so overflow wraps the same way the
+// vector instructions do instead of being undefined.
+int64_t SumIntsScalar(const int64_t *src, size_t len) {
+  uint64_t sum = 0;
+  for (size_t i = 0; i < len; ++i) sum += static_cast<uint64_t>(src[i]);
+  return static_cast<int64_t>(sum);
+}
+
+void AddIntsScalar(const int64_t *lhs, const int64_t *rhs, int64_t *dst,
+                   size_t len) {
+  for (size_t i = 0; i < len; ++i) {
+    dst[i] = static_cast<int64_t>(static_cast<uint64_t>(lhs[i]) +
+                                  static_cast<uint64_t>(rhs[i]));
+  }
+}
+
+#ifdef LANG_HAS_AVX2_KERNELS
+
+__attribute__((target("avx2"))) int64_t SumIntsAVX2(const int64_t *src,
+                                                    size_t len) {
+  // Two independent accumulators to hide the latency of the adds.
+  __m256i acc0 = _mm256_setzero_si256();
+  __m256i acc1 = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    acc0 = _mm256_add_epi64(
+        acc0, _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i)));
+    acc1 = _mm256_add_epi64(
+        acc1,
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i + 4)));
+  }
+  for (; i + 4 <= len; i += 4) {
+    acc0 = _mm256_add_epi64(
+        acc0, _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i)));
+  }
+  acc0 = _mm256_add_epi64(acc0, acc1);
+
+  alignas(32) int64_t lanes[4];
+  _mm256_store_si256(reinterpret_cast<__m256i *>(lanes), acc0);
+  int64_t sum = SumIntsScalar(lanes, 4);
+  return static_cast<int64_t>(static_cast<uint64_t>(sum) +
+                              static_cast<uint64_t>(
+                                  SumIntsScalar(src + i, len - i)));
+}
+
+__attribute__((target("avx2"))) void AddIntsAVX2(const int64_t *lhs,
+                                                 const int64_t *rhs,
+                                                 int64_t *dst, size_t len) {
+  size_t i = 0;
+  for (; i + 4 <= len; i += 4) {
+    __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(lhs + i));
+    __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(rhs + i));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i),
+                        _mm256_add_epi64(a, b));
+  }
+  AddIntsScalar(lhs + i, rhs + i, dst + i, len - i);
+}
+
+bool HasAVX2() {
+  static const bool has_avx2 = __builtin_cpu_supports("avx2");
+  return has_avx2;
+}
+
+#endif  // LANG_HAS_AVX2_KERNELS
+
+}  // namespace
+
+int64_t SumInts(const int64_t *src, size_t len) {
+#ifdef LANG_HAS_AVX2_KERNELS
+  if (HasAVX2()) return SumIntsAVX2(src, len);
+#endif
+  return SumIntsScalar(src, len);
+}
+
+void AddInts(const int64_t *lhs, const int64_t *rhs, int64_t *dst,
+             size_t len) {
+#ifdef LANG_HAS_AVX2_KERNELS
+  if (HasAVX2()) return AddIntsAVX2(lhs, rhs, dst, len);
+#endif
+  AddIntsScalar(lhs, rhs, dst, len);
+}
+
+}  // namespace lang
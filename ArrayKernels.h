@@ -0,0 +1,20 @@
+#ifndef ARRAY_KERNELS_H
+#define ARRAY_KERNELS_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace lang {
+
+// Kernels backing the array builtins. These pick an AVX2 implementation at
+// runtime when the CPU supports it and fall back to plain loops otherwise.
+
+// Returns the (wrapping) sum of the `len` values in `src`.
+int64_t SumInts(const int64_t *src, size_t len);
+
+// dst[i] = lhs[i] + rhs[i] for every i < len. `dst` may alias either input.
+void AddInts(const int64_t *lhs, const int64_t *rhs, int64_t *dst, size_t len);
+
+}  // namespace lang
+
+#endif
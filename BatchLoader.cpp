@@ -0,0 +1,322 @@
+#include "BatchLoader.h"
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <numeric>
+#include <thread>
+
+namespace lang {
+
+namespace {
+
+// Open `path` and size `contents` to fit it. Returns -1 if it cannot be opened.
+int OpenForRead(const std::string &path, std::string &contents) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return -1;
+  struct stat st;
+  if (fstat(fd, &st)) {
+    close(fd);
+    return -1;
+  }
+  contents.resize(st.st_size);
+  return fd;
+}
+
+/**
+ * The parts of io_uring we need, used through the raw syscalls so we do not
+ * depend on liburing.
+ */
+class IoUring {
+ public:
+  IoUring() {}
+  IoUring(const IoUring &) = delete;
+  IoUring &operator=(const IoUring &) = delete;
+  ~IoUring();
+
+  bool Setup(unsigned entries);
+
+  // The next free submission entry, cleared. Returns null if the submission
+  // queue is full.
+  io_uring_sqe *GetSqe();
+
+  // Submit every entry from GetSqe() since the last call and wait until at
+  // least `min_complete` completions are ready.
+  bool SubmitAndWait(unsigned min_complete);
+
+  bool PopCqe(io_uring_cqe &cqe);
+
+ private:
+  int fd_ = -1;
+  void *ring_ = MAP_FAILED;
+  size_t ring_size_ = 0;
+  io_uring_sqe *sqes_ = static_cast<io_uring_sqe *>(MAP_FAILED);
+  size_t sqes_size_ = 0;
+
+  unsigned *sq_head_, *sq_tail_, *sq_mask_, *sq_array_;
+  unsigned *cq_head_, *cq_tail_, *cq_mask_;
+  io_uring_cqe *cqes_;
+  unsigned sq_entries_;
+  unsigned to_submit_ = 0;
+};
+
+IoUring::~IoUring() {
+  if (sqes_ != MAP_FAILED) munmap(sqes_, sqes_size_);
+  if (ring_ != MAP_FAILED) munmap(ring_, ring_size_);
+  if (fd_ >= 0) close(fd_);
+}
+
+bool IoUring::Setup(unsigned entries) {
+  io_uring_params params = {};
+  fd_ = syscall(__NR_io_uring_setup, entries, &params);
+  if (fd_ < 0) return false;
+
+  // Older kernels map the submission and completion rings separately. We only
+  // support the single mapping every kernel since 5.4 uses.
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP)) return false;
+
+  ring_size_ =
+      std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+               params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+  ring_ = mmap(nullptr, ring_size_, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+  if (ring_ == MAP_FAILED) return false;
+
+  sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+  sqes_ = static_cast<io_uring_sqe *>(mmap(nullptr, sqes_size_,
+                                           PROT_READ | PROT_WRITE,
+                                           MAP_SHARED | MAP_POPULATE, fd_,
+                                           IORING_OFF_SQES));
+  if (sqes_ == MAP_FAILED) return false;
+
+  char *ring = static_cast<char *>(ring_);
+  sq_head_ = reinterpret_cast<unsigned *>(ring + params.sq_off.head);
+  sq_tail_ = reinterpret_cast<unsigned *>(ring + params.sq_off.tail);
+  sq_mask_ = reinterpret_cast<unsigned *>(ring + params.sq_off.ring_mask);
+  sq_array_ = reinterpret_cast<unsigned *>(ring + params.sq_off.array);
+  cq_head_ = reinterpret_cast<unsigned *>(ring + params.cq_off.head);
+  cq_tail_ = reinterpret_cast<unsigned *>(ring + params.cq_off.tail);
+  cq_mask_ = reinterpret_cast<unsigned *>(ring + params.cq_off.ring_mask);
+  cqes_ = reinterpret_cast<io_uring_cqe *>(ring + params.cq_off.cqes);
+  sq_entries_ = params.sq_entries;
+  return true;
+}
+
+io_uring_sqe *IoUring::GetSqe() {
+  // Only we write the tail, but the kernel moves the head as it consumes
+  // entries.
+  unsigned tail = *sq_tail_ + to_submit_;
+  if (tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_)
+    return nullptr;
+
+  unsigned index = tail & *sq_mask_;
+  sq_array_[index] = index;
+  ++to_submit_;
+  io_uring_sqe *sqe = &sqes_[index];
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+bool IoUring::SubmitAndWait(unsigned min_complete) {
+  // Publish the new entries before telling the kernel about them.
+  __atomic_store_n(sq_tail_, *sq_tail_ + to_submit_, __ATOMIC_RELEASE);
+  to_submit_ = 0;
+  while (true) {
+    // The kernel stops at an entry it cannot start, like one with an opcode it
+    // does not know, after posting its completion. The entries after it stay
+    // queued, so everything still queued is submitted again on every call.
+    unsigned queued = *sq_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    long submitted = syscall(__NR_io_uring_enter, fd_, queued, min_complete,
+                             IORING_ENTER_GETEVENTS, nullptr, 0);
+    if (submitted >= 0) return true;
+    if (errno != EINTR) return false;
+  }
+}
+
+bool IoUring::PopCqe(io_uring_cqe &cqe) {
+  unsigned head = *cq_head_;
+  if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) return false;
+  cqe = cqes_[head & *cq_mask_];
+  __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+}  // namespace
+
+void BatchLoader::Load(const std::vector<std::string> &paths,
+                       const LoadCallback &on_loaded) {
+  std::vector<size_t> unread(paths.size());
+  std::iota(unread.begin(), unread.end(), 0);
+  if (backend_ == BACKEND_IO_URING &&
+      LoadWithIoUring(paths, on_loaded, unread))
+    return;
+  backend_ = BACKEND_THREAD_POOL;
+  LoadWithThreadPool(paths, unread, on_loaded);
+}
+
+bool BatchLoader::LoadWithIoUring(const std::vector<std::string> &paths,
+                                  const LoadCallback &on_loaded,
+                                  std::vector<size_t> &unread) {
+  IoUring ring;
+  if (!ring.Setup(max_in_flight_)) return false;
+
+  // A file being read. The slot index is the user data of its reads.
+  struct Read {
+    size_t index;
+    int fd;
+    size_t done;
+    std::string contents;
+  };
+  std::vector<Read> reads(max_in_flight_);
+  std::vector<unsigned> free_slots;
+  for (unsigned i = max_in_flight_; i > 0; --i) free_slots.push_back(i - 1);
+
+  auto submit_read = [&](unsigned slot) {
+    Read &read = reads[slot];
+    io_uring_sqe *sqe = ring.GetSqe();
+    assert(sqe && "More reads in flight than submission entries");
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = read.fd;
+    sqe->addr = reinterpret_cast<uint64_t>(&read.contents[read.done]);
+    sqe->len = read.contents.size() - read.done;
+    sqe->off = read.done;
+    sqe->user_data = slot;
+  };
+
+  auto finish = [&](unsigned slot, bool ok) {
+    Read &read = reads[slot];
+    close(read.fd);
+    on_loaded(read.index, ok, read.contents);
+    free_slots.push_back(slot);
+  };
+
+  // Kernels before 5.6 set up the ring but fail every IORING_OP_READ with
+  // -EINVAL. If the first read fails that way, we wait for the rest in flight
+  // and leave every file not handed back yet to the thread pool.
+  bool completed_any = false, unsupported = false;
+
+  size_t next = 0;
+  while ((next < paths.size() && !unsupported) ||
+         free_slots.size() < max_in_flight_) {
+    // Keep as many reads in flight as we can. Empty and missing files never
+    // need one.
+    while (next < paths.size() && !unsupported && !free_slots.empty()) {
+      unsigned slot = free_slots.back();
+      Read &read = reads[slot];
+      read.index = next++;
+      read.done = 0;
+      read.fd = OpenForRead(paths[read.index], read.contents);
+      if (read.fd < 0) {
+        read.contents.clear();
+        on_loaded(read.index, false, read.contents);
+        continue;
+      }
+      free_slots.pop_back();
+      if (read.contents.empty()) {
+        finish(slot, true);
+        continue;
+      }
+      submit_read(slot);
+    }
+    if (free_slots.size() == max_in_flight_) continue;
+
+    bool submitted = ring.SubmitAndWait(1);
+    assert(submitted && "io_uring_enter failed with reads in flight");
+
+    io_uring_cqe cqe;
+    while (ring.PopCqe(cqe)) {
+      unsigned slot = cqe.user_data;
+      Read &read = reads[slot];
+      if (!completed_any && cqe.res == -EINVAL) {
+        unsupported = true;
+        unread.clear();
+      }
+      completed_any = true;
+      if (unsupported) {
+        close(read.fd);
+        unread.push_back(read.index);
+        free_slots.push_back(slot);
+      } else if (cqe.res < 0) {
+        finish(slot, false);
+      } else if (cqe.res == 0) {
+        // The file shrank since we sized the buffer.
+        read.contents.resize(read.done);
+        finish(slot, true);
+      } else if ((read.done += cqe.res) < read.contents.size()) {
+        submit_read(slot);
+      } else {
+        finish(slot, true);
+      }
+    }
+  }
+  if (!unsupported) return true;
+  for (; next < paths.size(); ++next) unread.push_back(next);
+  return false;
+}
+
+void BatchLoader::LoadWithThreadPool(const std::vector<std::string> &paths,
+                                     const std::vector<size_t> &indices,
+                                     const LoadCallback &on_loaded) {
+  struct Loaded {
+    size_t index;
+    bool ok;
+    std::string contents;
+  };
+  std::mutex mutex;
+  std::condition_variable loaded_cv;
+  std::deque<Loaded> loaded;
+  std::atomic<size_t> next(0);
+
+  auto read_files = [&] {
+    for (size_t i = next++; i < indices.size(); i = next++) {
+      Loaded file = {indices[i], false, ""};
+      int fd = OpenForRead(paths[file.index], file.contents);
+      if (fd >= 0) {
+        size_t done = 0;
+        while (done < file.contents.size()) {
+          ssize_t n = pread(fd, &file.contents[done],
+                            file.contents.size() - done, done);
+          if (n < 0 && errno == EINTR) continue;
+          if (n <= 0) break;
+          done += n;
+        }
+        file.ok = done == file.contents.size();
+        close(fd);
+      }
+      std::lock_guard<std::mutex> lock(mutex);
+      loaded.push_back(std::move(file));
+      loaded_cv.notify_one();
+    }
+  };
+
+  unsigned num_threads =
+      std::min<size_t>(std::max(max_in_flight_, 1u), indices.size());
+  std::vector<std::thread> threads;
+  for (unsigned i = 0; i < num_threads; ++i) threads.emplace_back(read_files);
+
+  for (size_t done = 0; done < indices.size(); ++done) {
+    Loaded file;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      loaded_cv.wait(lock, [&] { return !loaded.empty(); });
+      file = std::move(loaded.front());
+      loaded.pop_front();
+    }
+    on_loaded(file.index, file.ok, file.contents);
+  }
+  for (std::thread &thread : threads) thread.join();
+}
+
+}  // namespace lang
@@ -0,0 +1,59 @@
+#ifndef BATCH_LOADER_H
+#define BATCH_LOADER_H
+
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace lang {
+
+/**
+ * Reads many files at once, handing each one back as soon as it has been read
+ * so the caller can compile it while the rest are still being read.
+ *
+ * Reads are submitted through io_uring when the kernel supports it. Otherwise a
+ * pool of threads reads the files with pread(). That includes kernels that can
+ * set up a ring but not read through it, which is found out from the first
+ * read.
+ */
+class BatchLoader {
+ public:
+  enum Backend { BACKEND_IO_URING, BACKEND_THREAD_POOL };
+
+  // Called on the thread that called Load() once for every path, in whatever
+  // order the reads finish. `ok` is false if the file could not be read. The
+  // contents may be moved from.
+  using LoadCallback =
+      std::function<void(size_t index, bool ok, std::string &contents)>;
+
+  // At most `max_in_flight` files are open at once.
+  explicit BatchLoader(unsigned max_in_flight = 64,
+                       Backend backend = BACKEND_IO_URING)
+      : max_in_flight_(max_in_flight), backend_(backend) {}
+
+  void Load(const std::vector<std::string> &paths,
+            const LoadCallback &on_loaded);
+
+  // The backend the last call to Load() used. If io_uring could not be set up
+  // or used, this becomes BACKEND_THREAD_POOL.
+  Backend getBackend() const { return backend_; }
+
+ private:
+  // Returns false if io_uring cannot be used, with the indices of the paths
+  // it did not hand back left in `unread`.
+  bool LoadWithIoUring(const std::vector<std::string> &paths,
+                       const LoadCallback &on_loaded,
+                       std::vector<size_t> &unread);
+
+  // Load only the paths at `indices`.
+  void LoadWithThreadPool(const std::vector<std::string> &paths,
+                          const std::vector<size_t> &indices,
+                          const LoadCallback &on_loaded);
+
+  unsigned max_in_flight_;
+  Backend backend_;
+};
+
+}  // namespace lang
+
+#endif
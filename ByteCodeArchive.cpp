@@ -0,0 +1,117 @@
+#include "ByteCodeArchive.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Compress.h"
+
+namespace lang {
+
+constexpr uint32_t ByteCodeArchiveHeader::kMagic;
+constexpr uint32_t ByteCodeArchiveHeader::kVersion;
+
+bool ByteCodeArchiveWriter::Open(const std::string &path) {
+  index_.clear();
+  out_.open(path, std::ios::binary | std::ios::trunc);
+
+  // The header is filled in by Finish() once we know where the index is.
+  ByteCodeArchiveHeader header = {};
+  out_.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  offset_ = sizeof(header);
+  return static_cast<bool>(out_);
+}
+
+uint64_t ByteCodeArchiveWriter::Add(uint64_t source_hash,
+                                    const ByteCodeEmitter &emitter) {
+  std::string image = BuildProgramImage(source_hash, emitter);
+  std::string block = CompressBlock(image.data(), image.size());
+  out_.write(block.data(), block.size());
+  index_.push_back({offset_, block.size(), image.size(), source_hash});
+  offset_ += block.size();
+  return index_.size() - 1;
+}
+
+bool ByteCodeArchiveWriter::Finish() {
+  // Keep the index 8 byte aligned so it can be used in place.
+  std::string padding((8 - offset_ % 8) % 8, '\0');
+  out_.write(padding.data(), padding.size());
+  offset_ += padding.size();
+
+  ByteCodeArchiveHeader header = {};
+  header.magic = ByteCodeArchiveHeader::kMagic;
+  header.version = ByteCodeArchiveHeader::kVersion;
+  header.num_programs = index_.size();
+  header.index_offset = offset_;
+  header.file_size = offset_ + index_.size() * sizeof(ByteCodeArchiveEntry);
+
+  out_.write(reinterpret_cast<const char *>(index_.data()),
+             index_.size() * sizeof(ByteCodeArchiveEntry));
+  out_.seekp(0);
+  out_.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  out_.close();
+  return !out_.fail();
+}
+
+bool ByteCodeArchive::Map(const std::string &path) {
+  Unmap();
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) || st.st_size < sizeof(ByteCodeArchiveHeader)) {
+    close(fd);
+    return false;
+  }
+  void *base = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) return false;
+
+  base_ = static_cast<const char *>(base);
+  size_ = st.st_size;
+  if (!isValid()) {
+    Unmap();
+    return false;
+  }
+  return true;
+}
+
+void ByteCodeArchive::Unmap() {
+  if (!base_) return;
+  munmap(const_cast<char *>(base_), size_);
+  base_ = nullptr;
+  size_ = 0;
+}
+
+bool ByteCodeArchive::isValid() const {
+  const ByteCodeArchiveHeader &header = getHeader();
+  if (header.magic != ByteCodeArchiveHeader::kMagic ||
+      header.version != ByteCodeArchiveHeader::kVersion ||
+      header.file_size != size_ || header.index_offset % 8 ||
+      header.index_offset > size_ ||
+      header.num_programs > (size_ - header.index_offset) /
+                                sizeof(ByteCodeArchiveEntry))
+    return false;
+
+  for (uint64_t id = 0; id < header.num_programs; ++id) {
+    const ByteCodeArchiveEntry &entry = getEntry(id);
+    // The image size comes from the file too, so it is bounded before Load()
+    // allocates that much.
+    if (entry.offset > header.index_offset ||
+        entry.compressed_size > header.index_offset - entry.offset ||
+        entry.image_size > entry.compressed_size * kMaxExpansionRatio)
+      return false;
+  }
+  return true;
+}
+
+bool ByteCodeArchive::Load(uint64_t id, ProgramImageBuffer &image) const {
+  const ByteCodeArchiveEntry &entry = getEntry(id);
+  char *dst = image.Prepare(entry.image_size);
+  if (!DecompressBlock(base_ + entry.offset, entry.compressed_size, dst,
+                       entry.image_size))
+    return false;
+  return image.Finish();
+}
+
+}  // namespace lang
@@ -0,0 +1,105 @@
+#ifndef BYTE_CODE_ARCHIVE_H
+#define BYTE_CODE_ARCHIVE_H
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "ByteCodeFile.h"
+
+namespace lang {
+
+/**
+ * Many compiled programs bundled in one file (.shba), each compressed on its
+ * own so any one of them can be loaded without touching the others:
+ *
+ *   ByteCodeArchiveHeader
+ *   char[]                                   (compressed blocks)
+ *   ByteCodeArchiveEntry[num_programs]       (the index, at index_offset)
+ *
+ * Each block is a program image laid out as in a .shbc file, compressed with
+ * CompressBlock(). A program's ID is its position in the index.
+ */
+struct ByteCodeArchiveHeader {
+  static constexpr uint32_t kMagic = 0x41424853;  // "SHBA"
+  static constexpr uint32_t kVersion = 1;
+
+  uint32_t magic;
+  uint32_t version;
+  uint64_t file_size;
+  uint64_t num_programs;
+  uint64_t index_offset;
+};
+
+struct ByteCodeArchiveEntry {
+  uint64_t offset;
+  uint64_t compressed_size;
+  uint64_t image_size;
+  uint64_t source_hash;
+};
+
+/**
+ * Writes an archive one program at a time, so only the index is held in
+ * memory.
+ */
+class ByteCodeArchiveWriter {
+ public:
+  // Returns false if `path` could not be created.
+  bool Open(const std::string &path);
+
+  // Compress and append everything the emitter produced. Returns the ID of the
+  // program in the archive.
+  uint64_t Add(uint64_t source_hash, const ByteCodeEmitter &emitter);
+
+  // Write the index and header. Returns false if anything could not be
+  // written.
+  bool Finish();
+
+ private:
+  std::ofstream out_;
+  std::vector<ByteCodeArchiveEntry> index_;
+  uint64_t offset_ = 0;
+};
+
+/**
+ * An archive mapped read-only. Programs are decompressed on demand.
+ */
+class ByteCodeArchive {
+ public:
+  ByteCodeArchive() {}
+  ByteCodeArchive(const ByteCodeArchive &) = delete;
+  ByteCodeArchive &operator=(const ByteCodeArchive &) = delete;
+  ~ByteCodeArchive() { Unmap(); }
+
+  // Returns false if `path` does not exist or is not a valid archive for this
+  // version.
+  bool Map(const std::string &path);
+  void Unmap();
+
+  uint64_t getNumPrograms() const { return getHeader().num_programs; }
+
+  const ByteCodeArchiveEntry &getEntry(uint64_t id) const {
+    assert(id < getNumPrograms() && "Unknown program ID");
+    return reinterpret_cast<const ByteCodeArchiveEntry *>(
+        base_ + getHeader().index_offset)[id];
+  }
+
+  // Decompress a program straight into `image`, ready to be run. Returns false
+  // if its block is corrupt.
+  bool Load(uint64_t id, ProgramImageBuffer &image) const;
+
+ private:
+  const ByteCodeArchiveHeader &getHeader() const {
+    assert(base_ && "No archive was mapped");
+    return *reinterpret_cast<const ByteCodeArchiveHeader *>(base_);
+  }
+
+  bool isValid() const;
+
+  const char *base_ = nullptr;
+  size_t size_ = 0;
+};
+
+}  // namespace lang
+
+#endif
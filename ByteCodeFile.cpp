@@ -0,0 +1,252 @@
+#include "ByteCodeFile.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <fstream>
+
+namespace lang {
+
+constexpr uint32_t ByteCodeFileHeader::kMagic;
+constexpr uint32_t ByteCodeFileHeader::kVersion;
+
+namespace {
+
+uint64_t AlignTo8(uint64_t offset) { return (offset + 7) & ~uint64_t(7); }
+
+// Append `len` bytes to the image at the next 8 byte aligned offset and
+// return that offset.
+uint64_t AppendSection(std::string &image, const void *data, size_t len) {
+  image.resize(AlignTo8(image.size()), '\0');
+  uint64_t offset = image.size();
+  image.append(static_cast<const char *>(data), len);
+  return offset;
+}
+
+template <typename T>
+uint64_t AppendSection(std::string &image, const std::vector<T> &items) {
+  return AppendSection(image, items.data(), items.size() * sizeof(T));
+}
+
+bool SectionFits(uint64_t offset, uint64_t count, size_t elem_size,
+                 size_t file_size) {
+  if (offset % 8 || offset > file_size) return false;
+  return count <= (file_size - offset) / elem_size;
+}
+
+bool StrFits(uint64_t offset, uint64_t len, uint64_t strs_size) {
+  return offset <= strs_size && len <= strs_size - offset;
+}
+
+}  // namespace
+
+uint64_t HashSource(const std::string &source) {
+  uint64_t hash = 0xCBF29CE484222325ULL;
+  for (char c : source) {
+    hash ^= static_cast<unsigned char>(c);
+    hash *= 0x100000001B3ULL;
+  }
+  return hash;
+}
+
+std::string BuildProgramImage(uint64_t source_hash,
+                              const ByteCodeEmitter &emitter) {
+  std::string strs;
+
+  std::vector<ByteCodeFileConstant> constants;
+  for (const Evaluatable &constant : emitter.getConstants()) {
+    assert(constant.isStrType() && "Only str constants can be written");
+    constants.push_back({TYPE_STR, strs.size(), constant.getStrLen()});
+    strs.append(constant.getStrID(), constant.getStrLen());
+  }
+
+  // Symbol IDs are dense, so each symbol is placed at the index of its ID.
+  std::vector<ByteCodeFileSymbol> symbols(emitter.getSymbols().size());
+  for (const auto &symbol : emitter.getSymbols()) {
+    SymbolHandle handle(symbol.second);
+    symbols[symbol.second] = {symbol.second, emitter.getSymbolType(handle),
+                              strs.size(), symbol.first.size()};
+    strs.append(symbol.first);
+  }
+
+  std::vector<int64_t> result_types(emitter.getResultTypes().begin(),
+                                    emitter.getResultTypes().end());
+
+  ByteCodeFileHeader header = {};
+  header.magic = ByteCodeFileHeader::kMagic;
+  header.version = ByteCodeFileHeader::kVersion;
+  header.source_hash = source_hash;
+  header.num_locals = emitter.getNumLocals();
+  header.num_codes = emitter.getByteCode().size();
+  header.num_constants = constants.size();
+  header.num_symbols = symbols.size();
+  header.num_result_types = result_types.size();
+  header.strs_size = strs.size();
+
+  std::string image(sizeof(header), '\0');
+  header.codes_offset = AppendSection(image, emitter.getByteCode());
+  header.constants_offset = AppendSection(image, constants);
+  header.symbols_offset = AppendSection(image, symbols);
+  header.result_types_offset = AppendSection(image, result_types);
+  header.strs_offset = AppendSection(image, strs.data(), strs.size());
+  header.file_size = image.size();
+  memcpy(&image[0], &header, sizeof(header));
+  return image;
+}
+
+bool WriteByteCodeFile(const std::string &path, uint64_t source_hash,
+                       const ByteCodeEmitter &emitter) {
+  std::string image = BuildProgramImage(source_hash, emitter);
+
+  std::string tmp_path = path + ".tmp." + std::to_string(getpid());
+  {
+    std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+    if (!out) return false;
+    out.write(image.data(), image.size());
+    if (!out) return false;
+  }
+  if (rename(tmp_path.c_str(), path.c_str())) {
+    remove(tmp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool PublishSharedByteCode(const std::string &name, uint64_t source_hash,
+                           const ByteCodeEmitter &emitter) {
+  std::string image = BuildProgramImage(source_hash, emitter);
+
+  // An object already published under this name may be mapped by readers, so
+  // it is never rewritten in place. Unlinking it leaves their mappings intact,
+  // and the image goes into a new object instead.
+  if (shm_unlink(name.c_str()) && errno != ENOENT) return false;
+  int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+  if (fd < 0) return false;
+
+  // Everything but the header first, then the header, so a reader that maps
+  // the new object early sees an invalid magic instead of a partial program.
+  size_t header_size = sizeof(ByteCodeFileHeader);
+  bool written =
+      !ftruncate(fd, image.size()) &&
+      pwrite(fd, image.data() + header_size, image.size() - header_size,
+             header_size) == image.size() - header_size &&
+      pwrite(fd, image.data(), header_size, 0) == header_size;
+  close(fd);
+  return written;
+}
+
+bool UnlinkSharedByteCode(const std::string &name) {
+  return !shm_unlink(name.c_str());
+}
+
+bool ProgramImage::Attach(const void *base, size_t size) {
+  Detach();
+  if (size < sizeof(ByteCodeFileHeader)) return false;
+
+  base_ = base;
+  size_ = size;
+  if (!isValid()) {
+    Detach();
+    return false;
+  }
+  return true;
+}
+
+SymbolHandle ProgramImage::ResolveSymbol(const std::string &name) const {
+  for (uint64_t i = 0; i < getNumSymbols(); ++i) {
+    const ByteCodeFileSymbol &symbol = getSymbols()[i];
+    if (symbol.name_len == name.size() &&
+        !memcmp(getStrData(symbol.name_offset), name.data(), name.size()))
+      return SymbolHandle(symbol.id);
+  }
+  return SymbolHandle();
+}
+
+bool ProgramImage::isValid() const {
+  const ByteCodeFileHeader &header = getHeader();
+  if (header.magic != ByteCodeFileHeader::kMagic ||
+      header.version != ByteCodeFileHeader::kVersion ||
+      header.file_size != size_)
+    return false;
+
+  if (!SectionFits(header.codes_offset, header.num_codes, sizeof(ByteCode),
+                   size_) ||
+      !SectionFits(header.constants_offset, header.num_constants,
+                   sizeof(ByteCodeFileConstant), size_) ||
+      !SectionFits(header.symbols_offset, header.num_symbols,
+                   sizeof(ByteCodeFileSymbol), size_) ||
+      !SectionFits(header.result_types_offset, header.num_result_types,
+                   sizeof(int64_t), size_) ||
+      !SectionFits(header.strs_offset, header.strs_size, 1, size_))
+    return false;
+
+  // Every str must be within the strs section, since they are read in place.
+  for (uint64_t i = 0; i < header.num_constants; ++i) {
+    const ByteCodeFileConstant &constant = getConstants()[i];
+    if (!StrFits(constant.str_offset, constant.str_len, header.strs_size))
+      return false;
+  }
+  for (uint64_t i = 0; i < header.num_symbols; ++i) {
+    const ByteCodeFileSymbol &symbol = getSymbols()[i];
+    if (!StrFits(symbol.name_offset, symbol.name_len, header.strs_size))
+      return false;
+  }
+  return true;
+}
+
+char *ProgramImageBuffer::Prepare(size_t size) {
+  Detach();
+  storage_.assign((size + 7) / 8, 0);
+  image_size_ = size;
+  return reinterpret_cast<char *>(storage_.data());
+}
+
+bool ByteCodeFile::Map(const std::string &path) {
+  Unmap();
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  return MapFd(fd);
+}
+
+bool ByteCodeFile::MapShared(const std::string &name) {
+  Unmap();
+  int fd = shm_open(name.c_str(), O_RDONLY, 0);
+  if (fd < 0) return false;
+  return MapFd(fd);
+}
+
+bool ByteCodeFile::MapFd(int fd) {
+  struct stat st;
+  if (fstat(fd, &st) || st.st_size < sizeof(ByteCodeFileHeader)) {
+    close(fd);
+    return false;
+  }
+
+  // A read-only shared mapping lets every process mapping the same file or
+  // object use the same physical pages.
+  void *base = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) return false;
+
+  mapping_ = base;
+  mapping_size_ = st.st_size;
+  if (!Attach(mapping_, mapping_size_)) {
+    Unmap();
+    return false;
+  }
+  return true;
+}
+
+void ByteCodeFile::Unmap() {
+  Detach();
+  if (!mapping_) return;
+  munmap(mapping_, mapping_size_);
+  mapping_ = nullptr;
+  mapping_size_ = 0;
+}
+
+}  // namespace lang
@@ -0,0 +1,231 @@
+#ifndef BYTE_CODE_FILE_H
+#define BYTE_CODE_FILE_H
+
+#include <string>
+
+#include "Interpret.h"
+
+namespace lang {
+
+/**
+ * The on-disk format for the output of a ByteCodeEmitter (.shbc files).
+ *
+ * The file is laid out so it can be mmap'd and used in place:
+ *
+ *   ByteCodeFileHeader
+ *   ByteCode[num_codes]
+ *   ByteCodeFileConstant[num_constants]
+ *   ByteCodeFileSymbol[num_symbols]  (ordered by ID)
+ *   int64_t[num_result_types]   (TypeKinds)
+ *   char[]                      (str data for constants and symbol names)
+ *
+ * Every section starts at an 8 byte aligned offset from the start of the file
+ * and is stored in native byte order. A file is only used if its magic,
+ * version, and size match what we expect.
+ */
+struct ByteCodeFileHeader {
+  static constexpr uint32_t kMagic = 0x43424853;  // "SHBC"
+  static constexpr uint32_t kVersion = 2;
+
+  uint32_t magic;
+  uint32_t version;
+  uint64_t file_size;
+
+  // Hash of the source this was compiled from. See HashSource().
+  uint64_t source_hash;
+
+  uint64_t num_locals;
+
+  uint64_t codes_offset;
+  uint64_t num_codes;
+  uint64_t constants_offset;
+  uint64_t num_constants;
+  uint64_t symbols_offset;
+  uint64_t num_symbols;
+  uint64_t result_types_offset;
+  uint64_t num_result_types;
+  uint64_t strs_offset;
+  uint64_t strs_size;
+};
+
+struct ByteCodeFileConstant {
+  int64_t kind;  // Always TYPE_STR for now.
+  uint64_t str_offset;
+  uint64_t str_len;
+};
+
+struct ByteCodeFileSymbol {
+  uint64_t id;
+  int64_t type;  // The TypeKind last stored in the global.
+  uint64_t name_offset;
+  uint64_t name_len;
+};
+
+// FNV-1a hash of the source of a program.
+uint64_t HashSource(const std::string &source);
+
+// Lay out everything the emitter produced as a program image.
+std::string BuildProgramImage(uint64_t source_hash,
+                              const ByteCodeEmitter &emitter);
+
+// Write a program image to `path`. The file is written to a temporary path
+// first then renamed so readers never see a partial file. Returns false if the
+// file could not be written.
+bool WriteByteCodeFile(const std::string &path, uint64_t source_hash,
+                       const ByteCodeEmitter &emitter);
+
+// Place a program image in the POSIX shared memory object `name` so other
+// processes can map it with ByteCodeFile::MapShared(). The header is written
+// last so a reader never accepts a partially written image. An image already
+// published under `name` is replaced by a new object instead of being
+// rewritten, so processes that mapped it keep running the old program. While
+// it is being replaced, MapShared() may briefly fail.
+bool PublishSharedByteCode(const std::string &name, uint64_t source_hash,
+                           const ByteCodeEmitter &emitter);
+bool UnlinkSharedByteCode(const std::string &name);
+
+/**
+ * A read-only view of a compiled program laid out as above.
+ *
+ * Everything in the image refers to other parts of it by offset and nothing in
+ * it is ever written, so the same bytes can be mapped at any address by any
+ * number of processes and executed in place. Each ByteCodeEvaluator only keeps
+ * its own symbol table, locals, and eval stack.
+ */
+class ProgramImage {
+ public:
+  ProgramImage() {}
+  ProgramImage(const ProgramImage &) = delete;
+  ProgramImage &operator=(const ProgramImage &) = delete;
+
+  // Use `size` bytes at `base` as an image without taking ownership of them.
+  // Returns false if they are not a valid image for this version.
+  bool Attach(const void *base, size_t size);
+
+  bool isMapped() const { return base_ != nullptr; }
+
+  const ByteCodeFileHeader &getHeader() const {
+    assert(isMapped() && "No image was mapped");
+    return *reinterpret_cast<const ByteCodeFileHeader *>(base_);
+  }
+
+  uint64_t getSourceHash() const { return getHeader().source_hash; }
+  uint64_t getNumLocals() const { return getHeader().num_locals; }
+  uint64_t getNumSymbols() const { return getHeader().num_symbols; }
+  uint64_t getNumConstants() const { return getHeader().num_constants; }
+  uint64_t getNumResultTypes() const { return getHeader().num_result_types; }
+
+  const ByteCode *getByteCode() const {
+    return getSection<ByteCode>(getHeader().codes_offset);
+  }
+  uint64_t getNumByteCodes() const { return getHeader().num_codes; }
+
+  const ByteCodeFileConstant *getConstants() const {
+    return getSection<ByteCodeFileConstant>(getHeader().constants_offset);
+  }
+  const ByteCodeFileSymbol *getSymbols() const {
+    return getSection<ByteCodeFileSymbol>(getHeader().symbols_offset);
+  }
+  const int64_t *getResultTypes() const {
+    return getSection<int64_t>(getHeader().result_types_offset);
+  }
+
+  const char *getStrData(uint64_t offset) const {
+    assert(offset <= getHeader().strs_size && "Str offset out of range");
+    return getSection<char>(getHeader().strs_offset) + offset;
+  }
+  std::string getStr(uint64_t offset, uint64_t len) const {
+    assert(len <= getHeader().strs_size - offset && "Str length out of range");
+    return std::string(getStrData(offset), len);
+  }
+
+  // Returns an invalid handle if there is no global with this name. This scans
+  // the symbols, so resolve once and keep the handle.
+  SymbolHandle ResolveSymbol(const std::string &name) const;
+
+  TypeKind getSymbolType(SymbolHandle handle) const {
+    assert(handle.getSlot() < getNumSymbols() && "Invalid symbol handle");
+    return static_cast<TypeKind>(getSymbols()[handle.getSlot()].type);
+  }
+
+  // The chars of the str constant with this ID. These are not null terminated.
+  const char *getConstantChars(uint64_t id) const {
+    assert(id < getNumConstants() && "Unknown constant ID");
+    return getStrData(getConstants()[id].str_offset);
+  }
+  uint64_t getConstantLen(uint64_t id) const {
+    assert(id < getNumConstants() && "Unknown constant ID");
+    return getConstants()[id].str_len;
+  }
+
+ protected:
+  void Detach() {
+    base_ = nullptr;
+    size_ = 0;
+  }
+
+ private:
+  template <typename T>
+  const T *getSection(uint64_t offset) const {
+    return reinterpret_cast<const T *>(static_cast<const char *>(base_) +
+                                       offset);
+  }
+
+  bool isValid() const;
+
+  const void *base_ = nullptr;
+  size_t size_ = 0;
+};
+
+/**
+ * A program image held in memory owned by this object, like one just built by
+ * BuildProgramImage().
+ */
+class ProgramImageBuffer : public ProgramImage {
+ public:
+  // Copy `image` into storage that is 8 byte aligned and use it. Returns false
+  // if it is not a valid image for this version.
+  bool Load(const std::string &image) {
+    memcpy(Prepare(image.size()), image.data(), image.size());
+    return Finish();
+  }
+
+  // Make room for an image of `size` bytes that the caller writes directly into
+  // the returned buffer, then call Finish() to use it.
+  char *Prepare(size_t size);
+  bool Finish() { return Attach(storage_.data(), image_size_); }
+
+ private:
+  // Kept as int64_ts so the image is 8 byte aligned.
+  std::vector<int64_t> storage_;
+  size_t image_size_ = 0;
+};
+
+/**
+ * A program image mapped read-only from a .shbc file or a shared memory
+ * object.
+ */
+class ByteCodeFile : public ProgramImage {
+ public:
+  ByteCodeFile() {}
+  ~ByteCodeFile() { Unmap(); }
+
+  // Map the file at `path`. Returns false if it does not exist or is not a
+  // valid file for this version.
+  bool Map(const std::string &path);
+
+  // Map a shared memory object made with PublishSharedByteCode().
+  bool MapShared(const std::string &name);
+
+  void Unmap();
+
+ private:
+  bool MapFd(int fd);
+
+  void *mapping_ = nullptr;
+  size_t mapping_size_ = 0;
+};
+
+}  // namespace lang
+
+#endif
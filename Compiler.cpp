@@ -0,0 +1,173 @@
+#include "Compiler.h"
+
+#include <unistd.h>
+
+#include "ByteCodeFile.h"
+
+namespace lang {
+
+bool Compiler::GenerateByteCode(PassManager &passes,
+                                const IRFunctionTable *functions) {
+  unique<IRFunction> func = BuildIR(*module_ptr_, emitter_, {}, functions);
+  passes.Run(*func);
+  for (const auto &instr : func->getEntryBlock().getInstrs()) {
+    if (instr->getOpcode() == IR_CALL) return false;
+  }
+  emitter_.ConvertToByteCode(*func);
+  return true;
+}
+
+void Compiler::setOptLevel(unsigned level,
+                           std::unordered_set<std::string> kept_globals) {
+  opt_level_ = level;
+  passes_.reset();
+  if (!level) return;
+  passes_ = std::make_unique<PassManager>();
+  AddOptimizationPasses(*passes_, level, std::move(kept_globals));
+}
+
+bool Compiler::EvaluateByteCode() {
+  eval_.InitializeConstants(emitter_.getConstants());
+  eval_.InitializeSymbolTable(emitter_.getSymbols());
+  eval_.InitializeLocals(emitter_.getNumLocals());
+  if (eval_.getMemoCapacity()) {
+    return eval_.InterpretMemoized(emitter_.getByteCode(),
+                                   emitter_.FindMemoizableStmts());
+  }
+  return eval_.Interpret(emitter_.getByteCode());
+}
+
+bool Compiler::ResetAndTryRun(const std::string &input, std::string &error) {
+  ResetComponents();
+  LexStatus lex_status = Lex(input);
+  if (!lex_status.isSuccessful()) {
+    error = "Unable to lex the program";
+    return false;
+  }
+  ParseStatus parse_status = Parse();
+  if (!parse_status.isSuccessful()) {
+    error = "Unable to parse the program";
+    return false;
+  }
+  CheckStatus check_status = Check();
+  if (!check_status.isSuccessful()) {
+    error = check_status.getMessage();
+    return false;
+  }
+  if (!RunModule()) {
+    error = eval_.getStatus().getMessage();
+    return false;
+  }
+  return true;
+}
+
+void Compiler::RunStream(int fd, std::ostream &out) {
+  ResetComponents();
+  num_live_objects_ = 0;
+
+  std::string stmt;
+  bool in_str = false;
+  char buffer[1 << 16];
+  ssize_t num_read;
+  while ((num_read = read(fd, buffer, sizeof(buffer))) > 0) {
+    for (ssize_t i = 0; i < num_read; ++i) {
+      char c = buffer[i];
+      stmt.push_back(c);
+      if (c == '"') in_str = !in_str;
+      if (c != ';' || in_str) continue;
+
+      RunStreamedStmt(stmt, out);
+      stmt.clear();
+    }
+
+    // Anything we have finished is written before waiting on more input.
+    out.flush();
+  }
+
+  for (char c : stmt) {
+    if (!isspace(c)) {
+      std::cerr << "Ignoring incomplete statement at end of input\n";
+      break;
+    }
+  }
+}
+
+void Compiler::RunStreamedStmt(const std::string &stmt, std::ostream &out) {
+  if (!Lex(stmt).isSuccessful() || !Parse().isSuccessful()) {
+    std::cerr << "Skipping statement that could not be parsed: " << stmt
+              << "\n";
+    return;
+  }
+  CheckStatus check_status = Check();
+  if (!check_status.isSuccessful()) {
+    std::cerr << "Skipping statement: " << check_status.getMessage() << "\n";
+    ResetModule();
+    return;
+  }
+
+  emitter_.ResetByteCode();
+  GenerateByteCode();
+  ResetModule();
+
+  eval_.AppendNewConstants(emitter_.getConstants());
+  eval_.GrowSymbolTable(emitter_.getSymbols().size());
+  eval_.GrowLocals(emitter_.getNumLocals());
+  if (!eval_.Interpret(emitter_.getByteCode())) {
+    std::cerr << "Stopped statement: " << eval_.getStatus().getMessage()
+              << "\n";
+    eval_.ClearEvalStack();
+    return;
+  }
+
+  const std::vector<int64_t> &results = eval_.getEvalStack();
+  const std::vector<TypeKind> &types = emitter_.getResultTypes();
+  assert(results.size() == types.size());
+  for (size_t i = 0; i < results.size(); ++i) {
+    eval_.DumpValue(out, results[i], types[i]);
+    out << '\n';
+  }
+  eval_.ClearEvalStack();
+
+  // Arrays and maps only outlive a statement if a global holds them, since
+  // nothing else is in scope between statements. Collecting once there are
+  // twice as many as were live after the last collection keeps the cost of
+  // each collection proportional to what was allocated since.
+  size_t num_objects = eval_.getNumArrays() + eval_.getNumMaps();
+  if (num_objects < 2 * num_live_objects_ + 1) return;
+  std::vector<SymbolHandle> array_globals, map_globals;
+  for (const auto &symbol : emitter_.getSymbols()) {
+    SymbolHandle handle(symbol.second);
+    TypeKind type = emitter_.getSymbolType(handle);
+    if (type == TYPE_ARRAY) array_globals.push_back(handle);
+    if (type == TYPE_MAP) map_globals.push_back(handle);
+  }
+  eval_.CollectGarbage(array_globals, map_globals);
+  num_live_objects_ = eval_.getNumArrays() + eval_.getNumMaps();
+}
+
+bool Compiler::RunImage(const ProgramImage &image) {
+  ResetComponents();
+  eval_.InitializeImage(image);
+  return eval_.InterpretImage();
+}
+
+void Compiler::ResetComponents() {
+  ResetTokens();
+  ResetModule();
+  emitter_.ResetComponents();
+  eval_.ResetComponents();
+}
+
+bool DefineFunction(IRFunctionTable &functions, const std::string &name,
+                    const std::vector<std::pair<std::string, TypeKind>> &params,
+                    const std::string &body) {
+  Compiler compiler;
+  if (!compiler.Lex(body).isSuccessful() || !compiler.Parse().isSuccessful())
+    return false;
+  unique<IRFunction> func = BuildFunctionIR(
+      compiler.getModule(), compiler.getEmitter(), params, &functions);
+  functions[name] = std::move(func);
+  return true;
+}
+
+}  // namespace lang
@@ -0,0 +1,192 @@
+#ifndef COMPILER_H
+#define COMPILER_H
+
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "Interpret.h"
+#include "IRPasses.h"
+#include "Lexer.h"
+#include "Parser.h"
+
+namespace lang {
+
+class ProgramImage;
+
+/**
+ * Drives a program through each stage: lexing, parsing, byte code emission,
+ * and evaluation.
+ */
+class Compiler {
+ public:
+  ~Compiler() { ResetModule(); }
+
+  const std::vector<Token> &getTokens() const { return tokens_; }
+
+  const Module &getModule() const { return *module_ptr_; }
+
+  const ByteCodeEmitter &getEmitter() const { return emitter_; }
+  ByteCodeEmitter &getEmitter() { return emitter_; }
+
+  const ByteCodeEvaluator &getEvaluator() const { return eval_; }
+
+  // Perform a standalone lexing of input into a vector of tokens attainable
+  // with getTokens(). Repeated calls to this overrides the previous value of
+  // getTokens() instead of appending.
+  LexStatus Lex(const std::string &input) {
+    ResetTokens();
+    return ReadTokens(input, tokens_);
+  }
+
+  // Perform a standalone parsing of input into a Module * attainable with
+  // getModule(). Repeated calls to this overrides the previous value of
+  // getModule().
+  ParseStatus Parse() {
+    ResetModule();
+    return ReadModule(tokens_, &module_ptr_);
+  }
+
+  // Check that byte code can be generated for the module from Parse(), as in
+  // ByteCodeEmitter::Check().
+  CheckStatus Check() const { return emitter_.Check(*module_ptr_); }
+
+  void GenerateByteCode() { emitter_.ConvertToByteCode(*module_ptr_); }
+
+  // Same as above, but the module goes through the IR and `passes` are run
+  // over it before it is lowered to byte code. The VM cannot call functions,
+  // so this returns false without emitting anything if one of the passes did
+  // not inline every call to `functions`, like a recursive one.
+  bool GenerateByteCode(PassManager &passes,
+                        const IRFunctionTable *functions = nullptr);
+
+  // Returns false if evaluation stopped early, as in
+  // ByteCodeEvaluator::Interpret().
+  bool EvaluateByteCode();
+
+  // Compile through the IR with the passes for optimization `level`, as given
+  // by AddOptimizationPasses(), or straight from the AST at level 0. Only the
+  // globals in `kept_globals` are expected to be read after a program runs.
+  // Statements run by RunStream() are always compiled at level 0, since later
+  // statements can read any global.
+  void setOptLevel(unsigned level,
+                   std::unordered_set<std::string> kept_globals = {});
+  unsigned getOptLevel() const { return opt_level_; }
+
+  // The passes run at the optimization level, with their stats over every
+  // program compiled so far. Null at level 0.
+  const PassManager *getPasses() const { return passes_.get(); }
+
+  // Remember the values of up to `max_entries` pure statements across the
+  // programs this evaluates, as in ByteCodeEvaluator::InterpretMemoized(). 0
+  // turns it off.
+  void setMemoCapacity(size_t max_entries) {
+    eval_.setMemoCapacity(max_entries);
+  }
+
+  int64_t ResetAndCompile(const std::string &input) {
+    ResetComponents();
+    return Compile(input);
+  }
+
+  // Same as above, but any number of results may be left on the eval stack.
+  void ResetAndRun(const std::string &input) {
+    ResetComponents();
+    Run(input);
+  }
+  void ResetAndRun(const std::string &input, PassManager &passes) {
+    ResetComponents();
+    Run(input, &passes);
+  }
+
+  // Same as ResetAndRun(), but returns false with `error` set instead of
+  // asserting if `input` does not lex, parse, or pass Check(), or stops early
+  // when it runs.
+  bool ResetAndTryRun(const std::string &input, std::string &error);
+
+  // Execute `;` terminated statements read from `fd` one at a time as soon as
+  // each one is complete, writing the value of every statement that has one to
+  // `out`. The tokens, AST, and byte code of a statement are discarded once it
+  // runs. Only the symbols, str constants, and the arrays and maps held by
+  // globals outlive it, so memory stays bounded by what the globals hold and
+  // the distinct names and strs seen.
+  void RunStream(int fd, std::ostream &out);
+
+  // Evaluate a compiled program image, like a mapped .shbc file, instead of
+  // compiling one. The image is executed in place.
+  int64_t EvaluateImage(const ProgramImage &image) {
+    bool ran = RunImage(image);
+    assert(ran && "Image stopped early");
+    return getOnlyEvalResult();
+  }
+  bool RunImage(const ProgramImage &image);
+
+  void ResetComponents();
+
+ private:
+  int64_t Compile(const std::string &input) {
+    Run(input);
+    return getOnlyEvalResult();
+  }
+
+  int64_t getOnlyEvalResult() const {
+    assert(eval_.getEvalStack().size() == 1);
+    return eval_.getEvalStack().back();
+  }
+
+  void RunStreamedStmt(const std::string &stmt, std::ostream &out);
+
+  // Emits straight from the AST if there are no `passes` and the optimization
+  // level is 0.
+  void Run(const std::string &input, PassManager *passes = nullptr) {
+    assert(Lex(input).isSuccessful());
+    assert(Parse().isSuccessful());
+    bool ran = RunModule(passes);
+    assert(ran && "Program stopped early");
+  }
+
+  // Generate and evaluate byte code for the module from Parse(). Returns false
+  // if evaluation stopped early.
+  bool RunModule(PassManager *passes = nullptr) {
+    if (!passes) passes = passes_.get();
+    if (passes) {
+      bool generated = GenerateByteCode(*passes);
+      assert(generated && "Only builtins can be called without functions");
+    } else {
+      GenerateByteCode();
+    }
+    return EvaluateByteCode();
+  }
+
+  void ResetTokens() { tokens_.clear(); }
+
+  void ResetModule() {
+    if (module_ptr_) {
+      delete module_ptr_;
+      module_ptr_ = nullptr;
+    }
+  }
+
+  std::vector<Token> tokens_;
+  Module *module_ptr_ = nullptr;
+  ByteCodeEmitter emitter_;
+  ByteCodeEvaluator eval_;
+  unsigned opt_level_ = 0;
+  unique<PassManager> passes_;
+
+  // The number of arrays and maps left after RunStream() last collected them.
+  size_t num_live_objects_ = 0;
+};
+
+// Add the function `name` to `functions`, built from the script `body`. Its
+// parameters are the globals in `params`, which `body` reads but never assigns,
+// and it returns the value of the last statement that has one. `body` may call
+// the functions already defined. Returns false if it could not be lexed or
+// parsed.
+bool DefineFunction(IRFunctionTable &functions, const std::string &name,
+                    const std::vector<std::pair<std::string, TypeKind>> &params,
+                    const std::string &body);
+
+}  // namespace lang
+
+#endif
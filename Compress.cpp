@@ -0,0 +1,133 @@
+#include "Compress.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace lang {
+
+namespace {
+
+constexpr size_t kMinMatch = 4;
+constexpr size_t kMaxOffset = 0xFFFF;
+constexpr unsigned kHashBits = 14;
+
+uint32_t Read32(const char *p) {
+  uint32_t val;
+  memcpy(&val, p, sizeof(val));
+  return val;
+}
+
+uint32_t Hash(uint32_t seq) { return (seq * 2654435761u) >> (32 - kHashBits); }
+
+// Lengths that do not fit in a nibble continue in bytes of 255 and a final
+// byte less than 255.
+void AppendLength(std::string &out, size_t len) {
+  for (; len >= 255; len -= 255) out.push_back(static_cast<char>(255));
+  out.push_back(static_cast<char>(len));
+}
+
+bool ReadLength(const uint8_t *&ip, const uint8_t *end, size_t &len) {
+  uint8_t byte;
+  do {
+    if (ip == end) return false;
+    byte = *ip++;
+    len += byte;
+  } while (byte == 255);
+  return true;
+}
+
+void AppendSequence(std::string &out, const char *literals, size_t num_literals,
+                    size_t offset, size_t match_len) {
+  size_t match_extra = match_len - kMinMatch;
+  uint8_t token = (std::min<size_t>(num_literals, 15) << 4) |
+                  (match_len ? std::min<size_t>(match_extra, 15) : 0);
+  out.push_back(static_cast<char>(token));
+  if (num_literals >= 15) AppendLength(out, num_literals - 15);
+  out.append(literals, num_literals);
+  if (!match_len) return;
+
+  out.push_back(static_cast<char>(offset & 0xFF));
+  out.push_back(static_cast<char>(offset >> 8));
+  if (match_extra >= 15) AppendLength(out, match_extra - 15);
+}
+
+}  // namespace
+
+std::string CompressBlock(const char *src, size_t len) {
+  std::string out;
+  out.reserve(len + len / 255 + 16);
+
+  // The last position each hash of 4 bytes was seen at. Collisions are caught
+  // by comparing the bytes.
+  std::vector<uint32_t> last_seen(1 << kHashBits, 0);
+  size_t anchor = 0, pos = 0;
+  while (pos + kMinMatch <= len) {
+    uint32_t seq = Read32(src + pos);
+    uint32_t &slot = last_seen[Hash(seq)];
+    size_t candidate = slot;
+    slot = pos;
+    if (candidate >= pos || pos - candidate > kMaxOffset ||
+        Read32(src + candidate) != seq) {
+      ++pos;
+      continue;
+    }
+
+    size_t match_len = kMinMatch;
+    while (pos + match_len < len &&
+           src[candidate + match_len] == src[pos + match_len])
+      ++match_len;
+    AppendSequence(out, src + anchor, pos - anchor, pos - candidate,
+                   match_len);
+    pos += match_len;
+    anchor = pos;
+  }
+
+  AppendSequence(out, src + anchor, len - anchor, 0, 0);
+  return out;
+}
+
+bool DecompressBlock(const char *src, size_t src_len, char *dst,
+                     size_t dst_len) {
+  const uint8_t *ip = reinterpret_cast<const uint8_t *>(src);
+  const uint8_t *ip_end = ip + src_len;
+  char *op = dst;
+  char *op_end = dst + dst_len;
+  while (ip < ip_end) {
+    uint8_t token = *ip++;
+    size_t num_literals = token >> 4;
+    if (num_literals == 15 && !ReadLength(ip, ip_end, num_literals))
+      return false;
+    if (num_literals > ip_end - ip || num_literals > op_end - op) return false;
+    memcpy(op, ip, num_literals);
+    op += num_literals;
+    ip += num_literals;
+
+    // Only the last sequence ends after its literals.
+    if (ip == ip_end) break;
+
+    if (ip_end - ip < 2) return false;
+    size_t offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+    if (!offset || offset > op - dst) return false;
+
+    size_t match_len = token & 15;
+    if (match_len == 15 && !ReadLength(ip, ip_end, match_len)) return false;
+    match_len += kMinMatch;
+    if (match_len > op_end - op) return false;
+
+    // A match may overlap the bytes it produces, such as a run of one byte
+    // with an offset of 1, so it is only copied in bulk when it cannot.
+    const char *match = op - offset;
+    if (offset >= match_len) {
+      memcpy(op, match, match_len);
+    } else {
+      for (size_t i = 0; i < match_len; ++i) op[i] = match[i];
+    }
+    op += match_len;
+  }
+  return op == op_end;
+}
+
+}  // namespace lang
@@ -0,0 +1,37 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <cstddef>
+#include <string>
+
+namespace lang {
+
+/**
+ * A small LZ77 block compressor in the style of LZ4, favoring decompression
+ * speed over ratio.
+ *
+ * A block is a series of sequences, each made of:
+ *
+ *   uint8_t token        (literal length << 4 | (match length - 4))
+ *   [uint8_t 255...]     (extra literal length if it was 15)
+ *   char[literal length]
+ *   uint16_t offset      (little endian, back from the current position)
+ *   [uint8_t 255...]     (extra match length if it was 15)
+ *
+ * The last sequence has only literals. Blocks do not record their
+ * decompressed size, so it must be stored next to them.
+ */
+std::string CompressBlock(const char *src, size_t len);
+
+// No block decompresses to more than this many times its own size, since each
+// byte of a block adds at most 255 to a length.
+constexpr size_t kMaxExpansionRatio = 255;
+
+// Decompress a whole block into exactly `dst_len` bytes at `dst`. Returns false
+// if the block is malformed or does not decompress to exactly that size.
+bool DecompressBlock(const char *src, size_t src_len, char *dst,
+                     size_t dst_len);
+
+}  // namespace lang
+
+#endif
@@ -0,0 +1,413 @@
+#include "Disassembler.h"
+
+#include <iomanip>
+#include <sstream>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace lang {
+
+namespace {
+
+constexpr int kUnknownType = -1;
+
+// A value on the eval stack while stepping through the byte code. It keeps the
+// instruction that pushed it, if any, so the push gets a type once the value
+// is used as one.
+struct StackValue {
+  int64_t push;
+  int type;
+};
+
+bool HasOperand(Instruction instr) {
+  switch (instr) {
+    case INSTR_PUSH:
+    case INSTR_INT_TO_FLOAT:
+    case INSTR_LOAD:
+    case INSTR_LOAD_LOCAL:
+    case INSTR_STORE_LOCAL:
+    case INSTR_MAP_PUT:
+    case INSTR_MAP_LOOKUP:
+      return true;
+    default:
+      return false;
+  }
+}
+
+const char *getMnemonic(Instruction instr) {
+  switch (instr) {
+    case INSTR_PUSH:
+      return "push";
+    case INSTR_ADD_OP:
+      return "add";
+    case INSTR_SUB_OP:
+      return "sub";
+    case INSTR_ADD_F:
+      return "add.f";
+    case INSTR_SUB_F:
+      return "sub.f";
+    case INSTR_INT_TO_FLOAT:
+      return "int_to_float";
+    case INSTR_CALL:
+      return "call";
+    case INSTR_STORE:
+      return "store";
+    case INSTR_LOAD:
+      return "load";
+    case INSTR_LOAD_LOCAL:
+      return "load_local";
+    case INSTR_STORE_LOCAL:
+      return "store_local";
+    case INSTR_ARRAY_MAKE:
+      return "make";
+    case INSTR_ARRAY_GET:
+      return "get";
+    case INSTR_ARRAY_SET:
+      return "set";
+    case INSTR_ARRAY_SUM:
+      return "sum";
+    case INSTR_ARRAY_VADD:
+      return "vadd";
+    case INSTR_MAP_NEW:
+      return "map";
+    case INSTR_MAP_PUT:
+      return "put";
+    case INSTR_MAP_LOOKUP:
+      return "lookup";
+  }
+  return nullptr;
+}
+
+// Only ints and strs can be map keys.
+const char *getKeyTypeName(int64_t type) {
+  switch (type) {
+    case TYPE_INT:
+      return "int";
+    case TYPE_STR:
+      return "str";
+    default:
+      return "?";
+  }
+}
+
+// The str constant `id` quoted, with long ones cut short.
+std::string getStrPreview(const ByteCodeEmitter &emitter, int64_t id) {
+  const std::vector<Evaluatable> &constants = emitter.getConstants();
+  if (id < 0 || id >= constants.size() || !constants[id].isStrType())
+    return "#" + std::to_string(id);
+
+  constexpr size_t kMaxPreviewLen = 24;
+  const char *chars = constants[id].getStrID();
+  size_t len = constants[id].getStrLen();
+  std::string preview = "\"";
+  for (size_t i = 0; i < len && i < kMaxPreviewLen; ++i) {
+    if (chars[i] == '"' || chars[i] == '\\') preview.push_back('\\');
+    if (chars[i] == '\n')
+      preview += "\\n";
+    else
+      preview.push_back(chars[i]);
+  }
+  preview.push_back('"');
+  if (len > kMaxPreviewLen) preview += "...";
+  return preview;
+}
+
+}  // namespace
+
+std::vector<DisassembledInstr> DisassembleByteCode(
+    const ByteCodeEmitter &emitter) {
+  const std::vector<ByteCode> &codes = emitter.getByteCode();
+  struct Decoded {
+    uint64_t offset;
+    Instruction instr;
+    int64_t operand;
+  };
+  std::vector<Decoded> decoded;
+  for (size_t i = 0; i < codes.size();) {
+    Instruction instr = codes[i].instr;
+    bool has_operand = HasOperand(instr) && i + 1 < codes.size();
+    decoded.push_back({i, instr, has_operand ? codes[i + 1].value : 0});
+    i += has_operand ? 2 : 1;
+  }
+
+  // Step through the code keeping track of where each value on the stack came
+  // from. Values stored to globals and locals keep their push when loaded.
+  std::unordered_map<int64_t, TypeKind> push_types;
+  std::unordered_set<int64_t> symbol_pushes;
+  std::unordered_map<size_t, uint64_t> store_symbols;
+  std::unordered_map<uint64_t, StackValue> globals, locals;
+  std::unordered_map<uint64_t, unsigned> num_stores;
+  std::vector<std::pair<uint64_t, StackValue>> stored;
+  std::vector<StackValue> stack;
+  auto pop = [&]() -> StackValue {
+    if (stack.empty()) return {-1, kUnknownType};
+    StackValue value = stack.back();
+    stack.pop_back();
+    return value;
+  };
+  auto set_type = [&](const StackValue &value, TypeKind type) {
+    if (value.push >= 0) push_types.emplace(value.push, type);
+  };
+  auto pop_as = [&](TypeKind type) { set_type(pop(), type); };
+  bool lost_track = false;
+  for (size_t i = 0; i < decoded.size() && !lost_track; ++i) {
+    const Decoded &code = decoded[i];
+    switch (code.instr) {
+      case INSTR_PUSH:
+        stack.push_back({static_cast<int64_t>(i), kUnknownType});
+        break;
+      case INSTR_ADD_OP:
+      case INSTR_SUB_OP:
+        pop_as(TYPE_INT);
+        pop_as(TYPE_INT);
+        stack.push_back({-1, TYPE_INT});
+        break;
+      case INSTR_ADD_F:
+      case INSTR_SUB_F:
+        pop_as(TYPE_FLOAT);
+        pop_as(TYPE_FLOAT);
+        stack.push_back({-1, TYPE_FLOAT});
+        break;
+      case INSTR_INT_TO_FLOAT:
+        if (code.operand >= 0 && code.operand < stack.size()) {
+          StackValue &value = stack[stack.size() - 1 - code.operand];
+          set_type(value, TYPE_INT);
+          value = {-1, TYPE_FLOAT};
+        }
+        break;
+      case INSTR_STORE: {
+        StackValue value = pop();
+        StackValue dst = pop();
+        if (dst.push < 0) break;
+        uint64_t symbol = decoded[dst.push].operand;
+        symbol_pushes.insert(dst.push);
+        store_symbols[i] = symbol;
+        globals[symbol] = value;
+        ++num_stores[symbol];
+        stored.emplace_back(symbol, value);
+        break;
+      }
+      case INSTR_LOAD: {
+        auto found = globals.find(code.operand);
+        stack.push_back(found == globals.end() ? StackValue{-1, kUnknownType}
+                                               : found->second);
+        break;
+      }
+      case INSTR_LOAD_LOCAL: {
+        auto found = locals.find(code.operand);
+        stack.push_back(found == locals.end() ? StackValue{-1, kUnknownType}
+                                              : found->second);
+        break;
+      }
+      case INSTR_STORE_LOCAL:
+        locals[code.operand] = pop();
+        break;
+      case INSTR_ARRAY_MAKE:
+        pop_as(TYPE_INT);
+        stack.push_back({-1, TYPE_ARRAY});
+        break;
+      case INSTR_ARRAY_GET:
+        pop_as(TYPE_INT);
+        pop();
+        stack.push_back({-1, TYPE_INT});
+        break;
+      case INSTR_ARRAY_SET:
+        pop_as(TYPE_INT);
+        pop_as(TYPE_INT);
+        pop();
+        break;
+      case INSTR_ARRAY_SUM:
+        pop();
+        stack.push_back({-1, TYPE_INT});
+        break;
+      case INSTR_ARRAY_VADD:
+        pop();
+        pop();
+        stack.push_back({-1, TYPE_ARRAY});
+        break;
+      case INSTR_MAP_NEW:
+        stack.push_back({-1, TYPE_MAP});
+        break;
+      case INSTR_MAP_PUT:
+        pop();
+        pop_as(static_cast<TypeKind>(code.operand));
+        pop();
+        break;
+      case INSTR_MAP_LOOKUP:
+        pop_as(static_cast<TypeKind>(code.operand));
+        pop();
+        stack.push_back({-1, kUnknownType});
+        break;
+      default:
+        // Calls and anything we do not know can take any number of values.
+        lost_track = true;
+        break;
+    }
+  }
+
+  // Results have the types the emitter left them with, and so does what is
+  // stored to a global only once.
+  const std::vector<TypeKind> &result_types = emitter.getResultTypes();
+  if (!lost_track && stack.size() == result_types.size()) {
+    for (size_t i = 0; i < stack.size(); ++i)
+      set_type(stack[i], result_types[i]);
+  }
+  for (const auto &store : stored) {
+    if (num_stores[store.first] == 1)
+      set_type(store.second, emitter.getSymbolType(SymbolHandle(store.first)));
+  }
+
+  // Globals that share a slot are all named.
+  std::unordered_map<uint64_t, std::string> names;
+  for (const auto &symbol : emitter.getSymbols()) {
+    std::string &name = names[symbol.second];
+    if (!name.empty()) name += "/";
+    name += symbol.first;
+  }
+  auto get_name = [&](uint64_t symbol) {
+    auto found = names.find(symbol);
+    return found == names.end() ? "#" + std::to_string(symbol) : found->second;
+  };
+
+  std::vector<DisassembledInstr> instrs;
+  for (size_t i = 0; i < decoded.size(); ++i) {
+    const Decoded &code = decoded[i];
+    const char *mnemonic = getMnemonic(code.instr);
+    std::ostringstream text;
+    if (!mnemonic) {
+      text << "unknown " << static_cast<int64_t>(code.instr);
+      instrs.push_back({code.offset, text.str()});
+      continue;
+    }
+
+    text << mnemonic;
+    switch (code.instr) {
+      case INSTR_PUSH: {
+        if (symbol_pushes.count(i)) {
+          text << " symbol " << get_name(code.operand);
+          break;
+        }
+        auto found = push_types.find(i);
+        if (found == push_types.end()) {
+          text << " " << code.operand;
+          break;
+        }
+        switch (found->second) {
+          case TYPE_INT:
+            text << " int " << code.operand;
+            break;
+          case TYPE_FLOAT:
+            text << " float " << BitsToFloat(code.operand);
+            break;
+          case TYPE_STR:
+            text << " str " << getStrPreview(emitter, code.operand);
+            break;
+          default:
+            text << " " << code.operand;
+            break;
+        }
+        break;
+      }
+      case INSTR_STORE: {
+        auto found = store_symbols.find(i);
+        if (found != store_symbols.end())
+          text << " " << get_name(found->second);
+        break;
+      }
+      case INSTR_LOAD:
+        text << " " << get_name(code.operand);
+        break;
+      case INSTR_MAP_PUT:
+      case INSTR_MAP_LOOKUP:
+        text << " " << getKeyTypeName(code.operand);
+        break;
+      default:
+        if (HasOperand(code.instr)) text << " " << code.operand;
+        break;
+    }
+    instrs.push_back({code.offset, text.str()});
+  }
+  return instrs;
+}
+
+void DumpDisassembly(const ByteCodeEmitter &emitter, std::ostream &out) {
+  const auto &locs = emitter.getStmtLocations();
+  size_t next_loc = 0;
+  for (const DisassembledInstr &instr : DisassembleByteCode(emitter)) {
+    for (; next_loc < locs.size() && locs[next_loc].offset <= instr.offset;
+         ++next_loc) {
+      const SourceLocation &loc = locs[next_loc].loc;
+      if (loc.isValid())
+        out << "; line " << loc.row + 1 << ", col " << loc.col + 1 << "\n";
+    }
+    out << std::setw(6) << instr.offset << ": " << instr.text << "\n";
+  }
+}
+
+size_t DumpByteCodeDiff(const ByteCodeEmitter &before,
+                        const ByteCodeEmitter &after, std::ostream &out) {
+  std::vector<DisassembledInstr> lhs = DisassembleByteCode(before);
+  std::vector<DisassembledInstr> rhs = DisassembleByteCode(after);
+  auto dump_size = [&](const char *which, const ByteCodeEmitter &emitter,
+                       size_t num_instrs) {
+    out << which << ": " << num_instrs << " instrs, "
+        << emitter.getByteCode().size() << " codes, "
+        << emitter.getSymbols().size() << " globals, "
+        << emitter.getNumLocals() << " locals\n";
+  };
+  dump_size("before", before, lhs.size());
+  dump_size("after", after, rhs.size());
+
+  // Skip what is the same at both ends, then line up the rest by their longest
+  // common subsequence. If that would take too much memory, everything in
+  // between is shown as changed.
+  size_t prefix = 0;
+  while (prefix < lhs.size() && prefix < rhs.size() &&
+         lhs[prefix].text == rhs[prefix].text)
+    ++prefix;
+  size_t suffix = 0;
+  while (suffix < lhs.size() - prefix && suffix < rhs.size() - prefix &&
+         lhs[lhs.size() - 1 - suffix].text == rhs[rhs.size() - 1 - suffix].text)
+    ++suffix;
+  size_t n = lhs.size() - prefix - suffix;
+  size_t m = rhs.size() - prefix - suffix;
+
+  constexpr size_t kMaxCells = 1 << 24;
+  std::vector<uint32_t> lengths;
+  if ((n + 1) * (m + 1) <= kMaxCells) {
+    // lengths[i * (m + 1) + j] is the length for lhs[i:] and rhs[j:].
+    lengths.assign((n + 1) * (m + 1), 0);
+    for (size_t i = n; i-- > 0;) {
+      for (size_t j = m; j-- > 0;) {
+        lengths[i * (m + 1) + j] =
+            lhs[prefix + i].text == rhs[prefix + j].text
+                ? lengths[(i + 1) * (m + 1) + j + 1] + 1
+                : std::max(lengths[(i + 1) * (m + 1) + j],
+                           lengths[i * (m + 1) + j + 1]);
+      }
+    }
+  }
+
+  size_t num_changed = 0;
+  auto dump_line = [&](char sign, const DisassembledInstr &instr) {
+    out << sign << std::setw(6) << instr.offset << ": " << instr.text << "\n";
+    ++num_changed;
+  };
+  size_t i = 0, j = 0;
+  while (!lengths.empty() && i < n && j < m) {
+    if (lhs[prefix + i].text == rhs[prefix + j].text) {
+      ++i;
+      ++j;
+    } else if (lengths[(i + 1) * (m + 1) + j] >=
+               lengths[i * (m + 1) + j + 1]) {
+      dump_line('-', lhs[prefix + i++]);
+    } else {
+      dump_line('+', rhs[prefix + j++]);
+    }
+  }
+  for (; i < n; ++i) dump_line('-', lhs[prefix + i]);
+  for (; j < m; ++j) dump_line('+', rhs[prefix + j]);
+  return num_changed;
+}
+
+}  // namespace lang
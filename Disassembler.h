@@ -0,0 +1,41 @@
+#ifndef DISASSEMBLER_H
+#define DISASSEMBLER_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "Interpret.h"
+
+namespace lang {
+
+// One decoded instruction, like `push 5`, `push "hi"`, `store x`, or `load x`.
+struct DisassembledInstr {
+  uint64_t offset;  // Of the instruction in the byte code.
+  std::string text;
+};
+
+// Decode the byte code of `emitter` into its instructions, with the names of
+// the globals they read and write and previews of the constants they push.
+//
+// Pushes do not say what type they push, so the type is worked out from how
+// the value is used later on, like being added as a float or left as a result
+// of some type. Pushes whose type could not be worked out show the raw value.
+std::vector<DisassembledInstr> DisassembleByteCode(
+    const ByteCodeEmitter &emitter);
+
+// Write the instructions of `emitter` one per line after their offset, with
+// where each statement starts in the source if the emitter knows.
+void DumpDisassembly(const ByteCodeEmitter &emitter, std::ostream &out);
+
+// Write how the byte code in `after` differs from `before`, like the output of
+// an optimization compared to the code emitted without one. The sizes of both
+// are written first, then each instruction only in `before` prefixed with `-`
+// and each one only in `after` prefixed with `+`, in order. Returns the number
+// of instructions that differ.
+size_t DumpByteCodeDiff(const ByteCodeEmitter &before,
+                        const ByteCodeEmitter &after, std::ostream &out);
+
+}  // namespace lang
+
+#endif
@@ -0,0 +1,106 @@
+#include "Embed.h"
+
+#include "ByteCodeFile.h"
+#include "Compiler.h"
+
+struct sh_program {
+  lang::ProgramImageBuffer image;
+  std::vector<lang::MemoizableStmt> memoizable;  // In the image's byte code.
+};
+
+struct sh_context {
+  const sh_program *program;
+  lang::ByteCodeEvaluator eval;
+};
+
+sh_program *sh_compile(const char *src) {
+  return sh_compile_with_inputs(src, nullptr, 0);
+}
+
+sh_program *sh_compile_with_inputs(const char *src, const char *const *inputs,
+                                   size_t num_inputs) {
+  std::string input(src);
+  lang::Compiler compiler;
+  if (!compiler.Lex(input).isSuccessful()) return nullptr;
+  if (!compiler.Parse().isSuccessful()) return nullptr;
+
+  for (size_t i = 0; i < num_inputs; ++i)
+    compiler.getEmitter().DeclareSymbol(inputs[i], lang::TYPE_INT);
+  if (!compiler.Check().isSuccessful()) return nullptr;
+  compiler.GenerateByteCode();
+
+  std::string image =
+      lang::BuildProgramImage(lang::HashSource(input), compiler.getEmitter());
+
+  sh_program *program = lang::SafeNew<sh_program>();
+  bool loaded = program->image.Load(image);
+  assert(loaded && "Built an invalid program image");
+  program->memoizable = compiler.getEmitter().FindMemoizableStmts();
+  return program;
+}
+
+void sh_program_free(sh_program *program) { delete program; }
+
+sh_context *sh_context_new(const sh_program *program) {
+  sh_context *ctx = lang::SafeNew<sh_context>();
+  ctx->program = program;
+  ctx->eval.InitializeImage(program->image);
+  return ctx;
+}
+
+void sh_context_free(sh_context *ctx) { delete ctx; }
+
+sh_slot sh_resolve(const sh_program *program, const char *name) {
+  lang::SymbolHandle handle = program->image.ResolveSymbol(name);
+  return handle.isValid() ? handle.getSlot() : -1;
+}
+
+int sh_run(const sh_program *program, sh_context *ctx) {
+  assert(ctx->program == program &&
+         "A context can only run the program it was made for");
+  ctx->eval.ResetRunState();
+  return ctx->eval.InterpretImageMemoized(program->memoizable) ? 0 : -1;
+}
+
+const char *sh_error(const sh_context *ctx) {
+  const lang::EvalStatus &status = ctx->eval.getStatus();
+  return status.isSuccessful() ? nullptr : status.getMessage().c_str();
+}
+
+void sh_set_memo_capacity(sh_context *ctx, size_t max_entries) {
+  ctx->eval.setMemoCapacity(max_entries);
+}
+
+size_t sh_num_memo_hits(const sh_context *ctx) {
+  return ctx->eval.getNumMemoHits();
+}
+
+namespace {
+
+bool IsValidSlot(const sh_context *ctx, sh_slot slot) {
+  return slot >= 0 && slot < ctx->program->image.getNumSymbols();
+}
+
+}  // namespace
+
+int sh_set_var(sh_context *ctx, sh_slot slot, int64_t val) {
+  if (!IsValidSlot(ctx, slot)) return -1;
+  ctx->eval.setValue(lang::SymbolHandle(slot), val);
+  return 0;
+}
+
+int sh_get_var(const sh_context *ctx, sh_slot slot, int64_t *val) {
+  if (!IsValidSlot(ctx, slot)) return -1;
+  *val = ctx->eval.getValue(lang::SymbolHandle(slot));
+  return 0;
+}
+
+size_t sh_num_results(const sh_context *ctx) {
+  return ctx->eval.getEvalStack().size();
+}
+
+int sh_get_result(const sh_context *ctx, size_t i, int64_t *val) {
+  if (i >= ctx->eval.getEvalStack().size()) return -1;
+  *val = ctx->eval.getEvalStack()[i];
+  return 0;
+}
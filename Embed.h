@@ -0,0 +1,89 @@
+#ifndef EMBED_H
+#define EMBED_H
+
+/**
+ * C API for embedding the interpreter in a host program.
+ *
+ * A program is compiled once with sh_compile() and can then be run any number
+ * of times, from any number of contexts. Each context holds the values of the
+ * program's globals between runs. Globals are read and written through slots
+ * resolved once with sh_resolve(), so no names are looked up per run.
+ *
+ *   const char *inputs[] = {"x"};
+ *   sh_program *prog = sh_compile_with_inputs("(add x 1);", inputs, 1);
+ *   sh_context *ctx = sh_context_new(prog);
+ *   sh_slot x = sh_resolve(prog, "x");
+ *   for (int64_t i = 0; i < n; ++i) {
+ *     int64_t result;
+ *     sh_set_var(ctx, x, i);
+ *     if (sh_run(prog, ctx) < 0) fail(sh_error(ctx));
+ *     sh_get_result(ctx, 0, &result);
+ *     use(result);
+ *   }
+ *   sh_context_free(ctx);
+ *   sh_program_free(prog);
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct sh_program sh_program;
+typedef struct sh_context sh_context;
+
+// The slot of a global in a program. Negative if the global does not exist.
+typedef int64_t sh_slot;
+
+// Returns NULL if `src` could not be lexed, parsed, or type checked, like when
+// it reads a global it never assigns or calls a builtin with the wrong number
+// or types of arguments.
+sh_program *sh_compile(const char *src);
+
+// Same as above, but the names in `inputs` are declared as int globals the
+// program may read before assigning to them. These are set by the host with
+// sh_set_var().
+sh_program *sh_compile_with_inputs(const char *src, const char *const *inputs,
+                                   size_t num_inputs);
+void sh_program_free(sh_program *program);
+
+sh_context *sh_context_new(const sh_program *program);
+void sh_context_free(sh_context *ctx);
+
+sh_slot sh_resolve(const sh_program *program, const char *name);
+
+// Run the whole program in `ctx`. The results of the previous run are
+// discarded, but the values of globals are kept. Returns 0 on success, or -1
+// if the program stopped early, like on an array index out of range. Results
+// and globals are then left as they were when it stopped.
+int sh_run(const sh_program *program, sh_context *ctx);
+
+// Why the last sh_run() in `ctx` returned -1, or NULL if it did not. Valid
+// until the next sh_run().
+const char *sh_error(const sh_context *ctx);
+
+// Remember the values of up to `max_entries` statements that only do
+// arithmetic on globals, so sh_run() can skip them when the globals they read
+// have values they already ran with. 0, the default, turns this off.
+void sh_set_memo_capacity(sh_context *ctx, size_t max_entries);
+
+// The number of statements sh_run() skipped in `ctx` so far.
+size_t sh_num_memo_hits(const sh_context *ctx);
+
+// Return 0 on success, or -1 without touching anything if `slot` is not a
+// global of the program.
+int sh_set_var(sh_context *ctx, sh_slot slot, int64_t val);
+int sh_get_var(const sh_context *ctx, sh_slot slot, int64_t *val);
+
+// The values left by statements that have one, in the order they ran.
+// sh_get_result() returns 0 on success, or -1 if `i` is out of range.
+size_t sh_num_results(const sh_context *ctx);
+int sh_get_result(const sh_context *ctx, size_t i, int64_t *val);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif
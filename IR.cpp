@@ -0,0 +1,378 @@
+#include "IR.h"
+
+namespace lang {
+
+namespace {
+
+/**
+ * Builds the IR for a module in one walk over the AST, keeping the order in
+ * which the ByteCodeEmitter would evaluate everything.
+ */
+class IRBuilder : public ASTVisitor {
+ public:
+  IRBuilder(IRFunction &func, const ByteCodeEmitter &emitter,
+            const std::unordered_map<std::string, TypeKind> &input_types,
+            const IRFunctionTable *functions)
+      : func_(func),
+        emitter_(emitter),
+        functions_(functions),
+        global_types_(input_types) {}
+
+  // Build the body of a function, where `params` are read like globals.
+  void AddParams(const std::vector<std::pair<std::string, TypeKind>> &params) {
+    is_function_ = true;
+    for (const auto &param : params) {
+      size_t index = params_.size();
+      params_[param.first] = {index, param.second};
+    }
+  }
+
+ private:
+  void VisitStmt(const Stmt &node) override {
+    Visit(node.getNode());
+    if (!value_) return;
+    func_.AppendInstr(IR_RESULT, value_->getType())->AddOperand(value_);
+  }
+
+  void VisitInt(const Int &node) override {
+    value_ = func_.AppendInstr(IR_INT, TYPE_INT);
+    value_->setImm(node.getVal());
+  }
+
+  void VisitFloat(const Float &node) override {
+    value_ = func_.AppendInstr(IR_FLOAT, TYPE_FLOAT);
+    value_->setImm(FloatToBits(node.getVal()));
+  }
+
+  void VisitStr(const Str &node) override {
+    value_ = func_.AppendInstr(IR_STR, TYPE_STR);
+    value_->setName(node.getVal());
+  }
+
+  void VisitID(const ID &node) override {
+    const std::string &name = node.getName();
+    for (auto local = locals_.rbegin(); local != locals_.rend(); ++local) {
+      if (local->first == name) {
+        value_ = local->second;
+        return;
+      }
+    }
+
+    auto def = function_defs_.find(name);
+    if (def != function_defs_.end()) {
+      value_ = def->second;
+      return;
+    }
+
+    auto param = params_.find(name);
+    if (param != params_.end()) {
+      value_ = func_.AppendInstr(IR_PARAM, param->second.second);
+      value_->setImm(param->second.first);
+      return;
+    }
+
+    value_ = func_.AppendInstr(IR_LOAD_GLOBAL, getGlobalType(name));
+    value_->setName(name);
+  }
+
+  void VisitBinOp(const BinOp &node) override {
+    IRInstr *lhs = VisitValue(node.getLHS());
+    IRInstr *rhs = VisitValue(node.getRHS());
+    assert((lhs->getType() == TYPE_INT || lhs->getType() == TYPE_FLOAT) &&
+           (rhs->getType() == TYPE_INT || rhs->getType() == TYPE_FLOAT) &&
+           "Binary operations can only be performed on ints and floats.");
+
+    bool is_float =
+        lhs->getType() == TYPE_FLOAT || rhs->getType() == TYPE_FLOAT;
+    value_ = func_.AppendInstr(node.getKind() == BINOP_ADD ? IR_ADD : IR_SUB,
+                               is_float ? TYPE_FLOAT : TYPE_INT);
+    value_->AddOperand(lhs);
+    value_->AddOperand(rhs);
+  }
+
+  void VisitLet(const Let &node) override {
+    // The value is evaluated before the name comes into scope.
+    IRInstr *val = VisitValue(node.getVal());
+    locals_.emplace_back(node.getName(), val);
+    Visit(node.getBody());
+    locals_.pop_back();
+  }
+
+  void VisitAssign(const Assign &node) override {
+    const auto *id_node = node.getDst().getAs<ID>();
+    assert(id_node && "Found a node we cannot assign to.");
+    const std::string &name = id_node->getName();
+    IRInstr *val = VisitValue(node.getSrc());
+    value_ = nullptr;
+
+    // Assigning to a local just means the name refers to a new value.
+    for (auto local = locals_.rbegin(); local != locals_.rend(); ++local) {
+      if (local->first == name) {
+        local->second = val;
+        return;
+      }
+    }
+
+    assert(!params_.count(name) && "Parameters cannot be assigned.");
+    if (is_function_) {
+      function_defs_[name] = val;
+      return;
+    }
+    IRInstr *store = func_.AppendInstr(IR_STORE_GLOBAL, val->getType());
+    store->setName(name);
+    store->AddOperand(val);
+    global_types_[name] = val->getType();
+  }
+
+  void VisitCall(const Call &node) override {
+    const auto *id_func = node.getFunc().getAs<ID>();
+    assert(id_func && "Only functions can be called by name.");
+    const Builtin *builtin = LookupBuiltin(id_func->getName());
+    if (!builtin) return VisitFunctionCall(id_func->getName(), node);
+    assert(node.getArgs().size() == builtin->num_args &&
+           "Wrong number of arguments passed to builtin.");
+
+    std::vector<IRInstr *> args;
+    for (const auto &arg : node.getArgs()) args.push_back(VisitValue(*arg));
+    for (size_t i = 0; i < args.size(); ++i) {
+      if (static_cast<int>(i) == builtin->typed_arg) continue;
+      assert(args[i]->getType() == builtin->arg_types[i] &&
+             "Wrong type of argument passed to builtin.");
+    }
+
+    IRInstr *call = func_.AppendInstr(IR_BUILTIN, builtin->result_type);
+    call->setImm(builtin->instr);
+    call->setHasResult(builtin->has_result);
+    for (IRInstr *arg : args) call->AddOperand(arg);
+    if (builtin->typed_arg >= 0) {
+      TypeKind key_type = args[builtin->typed_arg]->getType();
+      assert((key_type == TYPE_INT || key_type == TYPE_STR) &&
+             "Map keys can only be ints or strs.");
+      call->setKeyType(key_type);
+    }
+    value_ = builtin->has_result ? call : nullptr;
+  }
+
+  void VisitFunctionCall(const std::string &name, const Call &node) {
+    assert(functions_ && functions_->count(name) &&
+           "Only builtins and known functions can be called.");
+    const IRFunction &callee = *functions_->at(name);
+    std::vector<IRInstr *> args;
+    for (const auto &arg : node.getArgs()) args.push_back(VisitValue(*arg));
+    assert(args.size() == callee.getParamTypes().size() &&
+           "Wrong number of arguments passed to function.");
+    for (size_t i = 0; i < args.size(); ++i) {
+      assert(args[i]->getType() == callee.getParamTypes()[i] &&
+             "Argument does not have the type of its parameter.");
+    }
+
+    const IRInstr *returned = callee.getReturnValue();
+    IRInstr *call =
+        func_.AppendInstr(IR_CALL, returned ? returned->getType() : TYPE_INT);
+    call->setName(name);
+    call->setHasResult(returned != nullptr);
+    for (IRInstr *arg : args) call->AddOperand(arg);
+    value_ = returned ? call : nullptr;
+  }
+
+  IRInstr *VisitValue(const Node &node) {
+    Visit(node);
+    assert(value_ && "Expected an expression with a value.");
+    return value_;
+  }
+
+  TypeKind getGlobalType(const std::string &name) const {
+    auto found = global_types_.find(name);
+    if (found != global_types_.end()) return found->second;
+    SymbolHandle handle = emitter_.ResolveSymbol(name);
+    assert(handle.isValid() && "Reading a global that was never assigned.");
+    return emitter_.getSymbolType(handle);
+  }
+
+  IRFunction &func_;
+  const ByteCodeEmitter &emitter_;
+  const IRFunctionTable *functions_;
+
+  // The index and type of each parameter, when building a function body.
+  bool is_function_ = false;
+  std::unordered_map<std::string, std::pair<size_t, TypeKind>> params_;
+
+  // The globals a function body assigns are private to each call, so like
+  // lets, they just name the value last assigned to them.
+  std::unordered_map<std::string, IRInstr *> function_defs_;
+
+  // The value of the node last visited, or null if it has none.
+  IRInstr *value_ = nullptr;
+
+  // The value each let-bound name currently refers to, innermost last.
+  std::vector<std::pair<std::string, IRInstr *>> locals_;
+
+  // The type of the value last stored to each global by this module, or of
+  // the inputs given before it stores any.
+  std::unordered_map<std::string, TypeKind> global_types_;
+};
+
+}  // namespace
+
+bool IRInstr::isPure() const {
+  switch (opcode_) {
+    case IR_INT:
+    case IR_FLOAT:
+    case IR_STR:
+    case IR_LOAD_GLOBAL:
+    case IR_ADD:
+    case IR_SUB:
+      return true;
+    case IR_BUILTIN:
+      switch (imm_) {
+        case INSTR_ARRAY_MAKE:
+        case INSTR_ARRAY_GET:
+        case INSTR_ARRAY_SUM:
+        case INSTR_ARRAY_VADD:
+        case INSTR_MAP_NEW:
+        case INSTR_MAP_LOOKUP:
+          return true;
+        default:
+          return false;
+      }
+    case IR_PARAM:
+      return true;
+    case IR_STORE_GLOBAL:
+    case IR_RESULT:
+    case IR_CALL:
+      return false;
+  }
+  return false;
+}
+
+void IRInstr::BecomeInt(int64_t val) {
+  opcode_ = IR_INT;
+  type_ = TYPE_INT;
+  has_result_ = true;
+  imm_ = val;
+  operands_.clear();
+}
+
+void IRInstr::BecomeFloat(double val) {
+  opcode_ = IR_FLOAT;
+  type_ = TYPE_FLOAT;
+  has_result_ = true;
+  imm_ = FloatToBits(val);
+  operands_.clear();
+}
+
+void IRInstr::BecomeStr(const std::string &val) {
+  opcode_ = IR_STR;
+  type_ = TYPE_STR;
+  has_result_ = true;
+  name_ = val;
+  operands_.clear();
+}
+
+void IRInstr::Dump(std::ostream &out) const {
+  if (hasResult()) out << "%" << id_ << " = ";
+  switch (opcode_) {
+    case IR_INT:
+      out << "int " << imm_;
+      return;
+    case IR_FLOAT:
+      out << "float " << BitsToFloat(imm_);
+      return;
+    case IR_STR:
+      out << "str \"" << name_ << "\"";
+      return;
+    case IR_LOAD_GLOBAL:
+      out << "load." << getTypeName(type_) << " " << name_;
+      return;
+    case IR_STORE_GLOBAL:
+      out << "store " << name_;
+      break;
+    case IR_ADD:
+      out << "add." << getTypeName(type_);
+      break;
+    case IR_SUB:
+      out << "sub." << getTypeName(type_);
+      break;
+    case IR_BUILTIN:
+      out << "builtin." << imm_;
+      break;
+    case IR_RESULT:
+      out << "result";
+      break;
+    case IR_PARAM:
+      out << "param." << getTypeName(type_) << " " << imm_;
+      return;
+    case IR_CALL:
+      out << "call " << name_;
+      break;
+  }
+  for (const IRInstr *operand : operands_) out << " %" << operand->getID();
+}
+
+void IRFunction::ReplaceAllUsesWith(const IRInstr *from, IRInstr *to) {
+  for (const auto &block : blocks_) {
+    for (const auto &instr : block->getInstrs()) {
+      for (size_t i = 0; i < instr->getOperands().size(); ++i) {
+        if (instr->getOperand(i) == from) instr->setOperand(i, to);
+      }
+    }
+  }
+}
+
+std::unordered_map<const IRInstr *, unsigned> IRFunction::CountUses() const {
+  std::unordered_map<const IRInstr *, unsigned> uses;
+  for (const auto &block : blocks_) {
+    for (const auto &instr : block->getInstrs()) {
+      for (const IRInstr *operand : instr->getOperands()) ++uses[operand];
+    }
+  }
+  return uses;
+}
+
+size_t IRFunction::getNumInstrs() const {
+  size_t num_instrs = 0;
+  for (const auto &block : blocks_) num_instrs += block->getInstrs().size();
+  return num_instrs;
+}
+
+void IRFunction::Dump(std::ostream &out) const {
+  for (const auto &block : blocks_) {
+    for (const auto &instr : block->getInstrs()) {
+      instr->Dump(out);
+      out << "\n";
+    }
+  }
+}
+
+unique<IRFunction> BuildIR(
+    const Module &module, const ByteCodeEmitter &emitter,
+    const std::unordered_map<std::string, TypeKind> &input_types,
+    const IRFunctionTable *functions) {
+  auto func = std::make_unique<IRFunction>();
+  IRBuilder(*func, emitter, input_types, functions).Visit(module);
+  return func;
+}
+
+unique<IRFunction> BuildFunctionIR(
+    const Module &module, const ByteCodeEmitter &emitter,
+    const std::vector<std::pair<std::string, TypeKind>> &params,
+    const IRFunctionTable *functions) {
+  auto func = std::make_unique<IRFunction>();
+  IRBuilder builder(*func, emitter, {}, functions);
+  builder.AddParams(params);
+  for (const auto &param : params) func->AddParam(param.second);
+  builder.Visit(module);
+
+  auto &instrs = func->getEntryBlock().getInstrs();
+  size_t kept = 0;
+  for (size_t i = 0; i < instrs.size(); ++i) {
+    if (instrs[i]->getOpcode() == IR_RESULT)
+      func->setReturnValue(instrs[i]->getOperand(0));
+    else
+      instrs[kept++] = std::move(instrs[i]);
+  }
+  instrs.resize(kept);
+  return func;
+}
+
+}  // namespace lang
@@ -0,0 +1,203 @@
+#ifndef IR_H
+#define IR_H
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Interpret.h"
+
+namespace lang {
+
+/**
+ * A mid-level representation between the AST and byte code that optimizations
+ * are written against.
+ *
+ * Every instruction that produces a value defines it exactly once (SSA), and
+ * operands point straight at the instructions that define them. Locals bound
+ * by a let and reassigned inside it become plain values, so only globals are
+ * loaded and stored. Instructions run in the order they appear in their block.
+ *
+ * There is no control flow in the language yet, so a function is a single
+ * block. Blocks and phis come in once branches do.
+ */
+enum IROpcode {
+  // Constants. The value is in the immediate, or the name for strs.
+  IR_INT,
+  IR_FLOAT,  // Stored as its bits.
+  IR_STR,
+
+  // Read or write the global in the name. A store takes the value to store.
+  IR_LOAD_GLOBAL,
+  IR_STORE_GLOBAL,
+
+  // Arithmetic on ints or floats, as given by the type of the instruction. If
+  // it is a float, int operands are converted to floats first.
+  IR_ADD,
+  IR_SUB,
+
+  // The builtin instruction in the immediate applied to the operands. For
+  // builtins with a typed argument, the type is in the key type.
+  IR_BUILTIN,
+
+  // Leave the operand on the eval stack as the value of a top-level statement.
+  IR_RESULT,
+
+  // The argument at the index in the immediate, in the body of a function.
+  IR_PARAM,
+
+  // Call the function in the name with the operands as its arguments. The VM
+  // cannot call functions yet, so these must be inlined before lowering.
+  IR_CALL,
+};
+
+class IRInstr {
+ public:
+  IRInstr(unsigned id, IROpcode opcode, TypeKind type)
+      : id_(id),
+        opcode_(opcode),
+        type_(type),
+        has_result_(opcode != IR_STORE_GLOBAL && opcode != IR_RESULT) {}
+
+  // A copy of `other` with a new ID and no operands yet.
+  IRInstr(unsigned id, const IRInstr &other) : IRInstr(other) {
+    id_ = id;
+    operands_.clear();
+  }
+
+  // Unique within a function. Used for printing.
+  unsigned getID() const { return id_; }
+
+  IROpcode getOpcode() const { return opcode_; }
+
+  // The type of the value this produces, if it produces one.
+  TypeKind getType() const { return type_; }
+  bool hasResult() const { return has_result_; }
+  void setHasResult(bool has_result) { has_result_ = has_result; }
+
+  // Whether this can be removed when its value is unused. Builtins that only
+  // read arrays and maps or make new ones are pure, but what they read can
+  // change, so they are never reused.
+  bool isPure() const;
+  bool isConstant() const {
+    return opcode_ == IR_INT || opcode_ == IR_FLOAT || opcode_ == IR_STR;
+  }
+
+  const std::vector<IRInstr *> &getOperands() const { return operands_; }
+  IRInstr *getOperand(size_t i) const { return operands_.at(i); }
+  void AddOperand(IRInstr *operand) { operands_.push_back(operand); }
+  void setOperand(size_t i, IRInstr *operand) { operands_.at(i) = operand; }
+
+  int64_t getImm() const { return imm_; }
+  void setImm(int64_t imm) { imm_ = imm; }
+
+  const std::string &getName() const { return name_; }
+  void setName(const std::string &name) { name_ = name; }
+
+  bool hasKeyType() const { return has_key_type_; }
+  TypeKind getKeyType() const { return key_type_; }
+  void setKeyType(TypeKind type) {
+    key_type_ = type;
+    has_key_type_ = true;
+  }
+
+  // Turn this into a constant in place, so every use now sees the constant.
+  void BecomeInt(int64_t val);
+  void BecomeFloat(double val);
+  void BecomeStr(const std::string &val);
+
+  void Dump(std::ostream &out) const;
+
+ private:
+  unsigned id_;
+  IROpcode opcode_;
+  TypeKind type_;
+  bool has_result_;
+  std::vector<IRInstr *> operands_;
+  int64_t imm_ = 0;
+  std::string name_;
+  bool has_key_type_ = false;
+  TypeKind key_type_ = TYPE_INT;
+};
+
+class IRBlock {
+ public:
+  std::vector<unique<IRInstr>> &getInstrs() { return instrs_; }
+  const std::vector<unique<IRInstr>> &getInstrs() const { return instrs_; }
+
+ private:
+  std::vector<unique<IRInstr>> instrs_;
+};
+
+class IRFunction {
+ public:
+  IRFunction() { blocks_.push_back(std::make_unique<IRBlock>()); }
+
+  IRBlock &getEntryBlock() { return *blocks_.front(); }
+  const IRBlock &getEntryBlock() const { return *blocks_.front(); }
+  const std::vector<unique<IRBlock>> &getBlocks() const { return blocks_; }
+
+  // Make a new instruction that is not yet in any block.
+  unique<IRInstr> MakeInstr(IROpcode opcode, TypeKind type) {
+    return std::make_unique<IRInstr>(next_id_++, opcode, type);
+  }
+
+  unique<IRInstr> MakeCopy(const IRInstr &instr) {
+    return std::make_unique<IRInstr>(next_id_++, instr);
+  }
+
+  // Make a new instruction at the end of the entry block.
+  IRInstr *AppendInstr(IROpcode opcode, TypeKind type) {
+    getEntryBlock().getInstrs().push_back(MakeInstr(opcode, type));
+    return getEntryBlock().getInstrs().back().get();
+  }
+
+  // The types of the arguments a function body takes.
+  const std::vector<TypeKind> &getParamTypes() const { return param_types_; }
+  void AddParam(TypeKind type) { param_types_.push_back(type); }
+
+  // What a function body gives back to its caller, or null if nothing.
+  IRInstr *getReturnValue() const { return return_value_; }
+  void setReturnValue(IRInstr *value) { return_value_ = value; }
+
+  // Point every operand that refers to `from` at `to` instead.
+  void ReplaceAllUsesWith(const IRInstr *from, IRInstr *to);
+
+  // The number of times each instruction is used as an operand.
+  std::unordered_map<const IRInstr *, unsigned> CountUses() const;
+
+  size_t getNumInstrs() const;
+
+  void Dump(std::ostream &out) const;
+
+ private:
+  std::vector<unique<IRBlock>> blocks_;
+  unsigned next_id_ = 0;
+  std::vector<TypeKind> param_types_;
+  IRInstr *return_value_ = nullptr;
+};
+
+// Functions scripts can call, by name.
+using IRFunctionTable = std::unordered_map<std::string, unique<IRFunction>>;
+
+// Build the IR for a module. The types of globals the module reads before it
+// assigns them, like inputs or globals from earlier statements in a stream,
+// come from `input_types` or else the symbols already known to `emitter`.
+// Calls to anything but builtins must be to `functions`.
+unique<IRFunction> BuildIR(
+    const Module &module, const ByteCodeEmitter &emitter,
+    const std::unordered_map<std::string, TypeKind> &input_types = {},
+    const IRFunctionTable *functions = nullptr);
+
+// Build the body of a function from a module that reads its parameters as
+// globals it never assigns. The value of the last statement that has one is
+// returned, and no statement leaves a result. Globals the module assigns are
+// private to each call, so a call never changes the globals of its caller.
+unique<IRFunction> BuildFunctionIR(
+    const Module &module, const ByteCodeEmitter &emitter,
+    const std::vector<std::pair<std::string, TypeKind>> &params,
+    const IRFunctionTable *functions = nullptr);
+
+}  // namespace lang
+
+#endif
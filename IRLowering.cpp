@@ -0,0 +1,314 @@
+#include <algorithm>
+
+#include "IR.h"
+#include "Interpret.h"
+
+namespace lang {
+
+namespace {
+
+// Where a value is kept between the instruction that defines it and its uses.
+enum ValueHome {
+  // Left on the eval stack for its only use to consume. This is what the
+  // emitter does for every expression.
+  HOME_STACK,
+
+  // Stored to a local slot and loaded at each use.
+  HOME_LOCAL,
+
+  // Not kept anywhere. Constants are pushed again at each use instead.
+  HOME_REMAT,
+};
+
+/**
+ * Decides where each value lives so the IR can be emitted in order as stack
+ * code.
+ *
+ * Every value starts out on the stack if it has one use. An instruction takes
+ * its operands from the top of the stack, so operands that are not computed on
+ * the stack are pushed in among those that are. If an operand comes before one
+ * that is computed on the stack, it is pushed right before the code computing
+ * that one starts (an early push). The symbol ID under the value of a store is
+ * pushed the same way. Values that cannot be laid out like this are moved to a
+ * local or rematerialized, and the layout is checked again until nothing
+ * moves.
+ */
+class StackLayout {
+ public:
+  // Operand -1 of a store is its symbol ID.
+  struct EarlyPush {
+    const IRInstr *user;
+    int operand;
+  };
+
+  StackLayout(const std::vector<unique<IRInstr>> &instrs,
+              const std::unordered_map<const IRInstr *, unsigned> &uses)
+      : instrs_(instrs) {
+    for (size_t i = 0; i < instrs.size(); ++i) {
+      const IRInstr *instr = instrs[i].get();
+      index_[instr] = i;
+      if (!instr->hasResult()) continue;
+      auto found = uses.find(instr);
+      unsigned num_uses = found == uses.end() ? 0 : found->second;
+      homes_[instr] = num_uses == 1 ? HOME_STACK : getHomeOffStack(*instr);
+    }
+    while (!TryLayout()) {
+    }
+  }
+
+  ValueHome getHome(const IRInstr *instr) const { return homes_.at(instr); }
+
+  const std::vector<EarlyPush> &getEarlyPushes(size_t index) const {
+    return early_pushes_[index];
+  }
+
+  // Whether an operand is pushed early instead of by its user.
+  bool isPushedEarly(const IRInstr &user, int operand) const {
+    return operand < getLastOnStack(user) &&
+           (operand < 0 || getHome(user.getOperand(operand)) != HOME_STACK);
+  }
+
+ private:
+  static ValueHome getHomeOffStack(const IRInstr &instr) {
+    return instr.isConstant() ? HOME_REMAT : HOME_LOCAL;
+  }
+
+  // The last operand computed on the stack, or -1 if there is none. Stores
+  // count their symbol ID as operand -1.
+  int getLastOnStack(const IRInstr &instr) const {
+    const std::vector<IRInstr *> &operands = instr.getOperands();
+    for (int i = operands.size() - 1; i >= 0; --i) {
+      if (getHome(operands[i]) == HOME_STACK) return i;
+    }
+    return -1;
+  }
+
+  int getFirstOperand(const IRInstr &instr) const {
+    return instr.getOpcode() == IR_STORE_GLOBAL ? -1 : 0;
+  }
+
+  void MoveOffStack(const IRInstr &instr) {
+    for (const IRInstr *operand : instr.getOperands()) {
+      if (getHome(operand) == HOME_STACK)
+        homes_[operand] = getHomeOffStack(*operand);
+    }
+  }
+
+  // Returns false if any value had to be moved off the stack.
+  bool TryLayout() {
+    // The first instruction of the code computing each value on the stack.
+    std::vector<size_t> start(instrs_.size());
+    early_pushes_.assign(instrs_.size(), {});
+    for (size_t i = 0; i < instrs_.size(); ++i) {
+      const IRInstr &instr = *instrs_[i];
+      const std::vector<IRInstr *> &operands = instr.getOperands();
+      start[i] = i;
+      for (const IRInstr *operand : operands) {
+        if (getHome(operand) == HOME_STACK)
+          start[i] = std::min(start[i], start[index_.at(operand)]);
+      }
+
+      int next_on_stack = getLastOnStack(instr);
+      for (int j = next_on_stack - 1; j >= getFirstOperand(instr); --j) {
+        if (j >= 0 && getHome(operands[j]) == HOME_STACK) {
+          next_on_stack = j;
+          continue;
+        }
+        size_t push_at = start[index_.at(operands[next_on_stack])];
+
+        // A local can only be loaded once it has been stored.
+        if (j >= 0 && getHome(operands[j]) == HOME_LOCAL &&
+            index_.at(operands[j]) >= push_at) {
+          MoveOffStack(instr);
+          return false;
+        }
+        early_pushes_[push_at].push_back({&instr, j});
+      }
+    }
+
+    // Code for an outer instruction starts before code for the instructions
+    // inside it, so pushes for later users go first.
+    for (std::vector<EarlyPush> &pushes : early_pushes_) {
+      std::sort(pushes.begin(), pushes.end(),
+                [this](const EarlyPush &lhs, const EarlyPush &rhs) {
+                  if (lhs.user != rhs.user)
+                    return index_.at(lhs.user) > index_.at(rhs.user);
+                  return lhs.operand < rhs.operand;
+                });
+    }
+
+    // What is on the stack at each point and who pushed it: null for values
+    // computed on the stack, or the user for early pushes. Statement results
+    // are null entries, which stay there for good.
+    using Entry = std::pair<const IRInstr *, const IRInstr *>;
+    auto get_pushed = [](const IRInstr &user, int operand) -> Entry {
+      return {operand < 0 ? &user : user.getOperand(operand), &user};
+    };
+    std::vector<Entry> stack;
+    for (size_t i = 0; i < instrs_.size(); ++i) {
+      for (const EarlyPush &push : early_pushes_[i])
+        stack.push_back(get_pushed(*push.user, push.operand));
+
+      const IRInstr &instr = *instrs_[i];
+      // Nothing is taken from the stack without an operand computed on it.
+      std::vector<Entry> expected;
+      int last_on_stack = getLastOnStack(instr);
+      int first = last_on_stack < 0 ? 0 : getFirstOperand(instr);
+      for (int j = first; j <= last_on_stack; ++j) {
+        if (isPushedEarly(instr, j))
+          expected.push_back(get_pushed(instr, j));
+        else
+          expected.push_back({instr.getOperand(j), nullptr});
+      }
+
+      if (stack.size() < expected.size() ||
+          !std::equal(expected.begin(), expected.end(),
+                      stack.end() - expected.size())) {
+        MoveOffStack(instr);
+        return false;
+      }
+      stack.resize(stack.size() - expected.size());
+
+      if (instr.getOpcode() == IR_RESULT) stack.push_back({nullptr, nullptr});
+      if (instr.hasResult() && getHome(&instr) == HOME_STACK)
+        stack.push_back({&instr, nullptr});
+    }
+    return true;
+  }
+
+  const std::vector<unique<IRInstr>> &instrs_;
+  std::unordered_map<const IRInstr *, size_t> index_;
+  std::unordered_map<const IRInstr *, ValueHome> homes_;
+  std::vector<std::vector<EarlyPush>> early_pushes_;
+};
+
+}  // namespace
+
+void ByteCodeEmitter::ConvertToByteCode(const IRFunction &func) {
+  assert(func.getBlocks().size() == 1 && "Only one block can be lowered.");
+  const auto &instrs = func.getEntryBlock().getInstrs();
+  auto uses = func.CountUses();
+  StackLayout layout(instrs, uses);
+  stmt_locs_.push_back({byte_code_.size(), SourceLocation()});
+
+  // Values kept in locals get a slot from their definition to their last use.
+  // Slots freed by one value are reused by the next.
+  std::unordered_map<const IRInstr *, uint64_t> slots;
+  std::vector<uint64_t> free_slots;
+  uint64_t num_slots = 0;
+  auto release = [&](const IRInstr *value) {
+    if (--uses[value] == 0) free_slots.push_back(slots.at(value));
+  };
+
+  auto push_symbol = [&](const std::string &name) {
+    if (!uniqueSymbolExists(name)) makeUniqueSymbolID(name);
+    PushBackInstr(INSTR_PUSH);
+    PushBackValue(getUniqueSymbolID(name));
+  };
+
+  auto push_constant = [&](const IRInstr &instr) {
+    PushBackInstr(INSTR_PUSH);
+    PushBackValue(instr.getOpcode() == IR_STR
+                      ? getUniqueConstantID(instr.getName())
+                      : instr.getImm());
+  };
+
+  // Get an operand onto the top of the stack for its use.
+  auto use_value = [&](const IRInstr *value) {
+    switch (layout.getHome(value)) {
+      case HOME_STACK:
+        break;
+      case HOME_REMAT:
+        push_constant(*value);
+        break;
+      case HOME_LOCAL:
+        PushBackInstr(INSTR_LOAD_LOCAL);
+        PushBackValue(slots.at(value));
+        release(value);
+        break;
+    }
+  };
+
+  for (size_t i = 0; i < instrs.size(); ++i) {
+    for (const StackLayout::EarlyPush &push : layout.getEarlyPushes(i)) {
+      if (push.operand < 0)
+        push_symbol(push.user->getName());
+      else
+        use_value(push.user->getOperand(push.operand));
+    }
+
+    const IRInstr &instr = *instrs[i];
+    const std::vector<IRInstr *> &operands = instr.getOperands();
+    auto use = [&](int operand) {
+      if (!layout.isPushedEarly(instr, operand))
+        use_value(operands[operand]);
+    };
+    switch (instr.getOpcode()) {
+      case IR_INT:
+      case IR_FLOAT:
+      case IR_STR:
+        if (layout.getHome(&instr) != HOME_REMAT) push_constant(instr);
+        break;
+      case IR_LOAD_GLOBAL:
+        PushBackInstr(INSTR_LOAD);
+        PushBackValue(getUniqueSymbolID(instr.getName()));
+        break;
+      case IR_STORE_GLOBAL:
+        if (!layout.isPushedEarly(instr, -1)) push_symbol(instr.getName());
+        use(0);
+        PushBackInstr(INSTR_STORE);
+        symbol_types_[getUniqueSymbolID(instr.getName())] =
+            operands[0]->getType();
+        break;
+      case IR_ADD:
+      case IR_SUB: {
+        use(0);
+        use(1);
+        bool is_float = instr.getType() == TYPE_FLOAT;
+        if (is_float && operands[1]->getType() == TYPE_INT) {
+          PushBackInstr(INSTR_INT_TO_FLOAT);
+          PushBackValue(0);
+        }
+        if (is_float && operands[0]->getType() == TYPE_INT) {
+          PushBackInstr(INSTR_INT_TO_FLOAT);
+          PushBackValue(1);
+        }
+        if (instr.getOpcode() == IR_ADD)
+          PushBackInstr(is_float ? INSTR_ADD_F : INSTR_ADD_OP);
+        else
+          PushBackInstr(is_float ? INSTR_SUB_F : INSTR_SUB_OP);
+        break;
+      }
+      case IR_BUILTIN: {
+        for (size_t j = 0; j < operands.size(); ++j) use(j);
+        PushBackInstr(static_cast<Instruction>(instr.getImm()));
+        if (instr.hasKeyType()) PushBackValue(instr.getKeyType());
+        break;
+      }
+      case IR_RESULT:
+        use(0);
+        PushType(operands[0]->getType());
+        break;
+      case IR_PARAM:
+      case IR_CALL:
+        assert(false && "Calls must be inlined before lowering.");
+        break;
+    }
+
+    if (!instr.hasResult() || layout.getHome(&instr) != HOME_LOCAL) continue;
+    uint64_t slot;
+    if (free_slots.empty()) {
+      slot = num_slots++;
+    } else {
+      slot = free_slots.back();
+      free_slots.pop_back();
+    }
+    slots[&instr] = slot;
+    PushBackInstr(INSTR_STORE_LOCAL);
+    PushBackValue(slot);
+    if (!uses[&instr]) free_slots.push_back(slot);
+  }
+  num_locals_ = std::max(num_locals_, num_slots);
+}
+
+}  // namespace lang
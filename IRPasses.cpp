@@ -0,0 +1,586 @@
+#include "IRPasses.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <functional>
+#include <map>
+#include <queue>
+#include <sstream>
+#include <tuple>
+#include <unordered_map>
+
+namespace lang {
+
+namespace {
+
+double getAsFloat(const IRInstr &instr) {
+  return instr.getOpcode() == IR_FLOAT ? BitsToFloat(instr.getImm())
+                                       : static_cast<double>(instr.getImm());
+}
+
+// Turn arithmetic on constants into its result. Returns whether it did.
+bool Fold(IRInstr &instr) {
+  IROpcode opcode = instr.getOpcode();
+  if (opcode != IR_ADD && opcode != IR_SUB) return false;
+  const IRInstr &lhs = *instr.getOperand(0);
+  const IRInstr &rhs = *instr.getOperand(1);
+  if (!lhs.isConstant() || !rhs.isConstant()) return false;
+
+  if (instr.getType() == TYPE_FLOAT) {
+    double lhs_val = getAsFloat(lhs), rhs_val = getAsFloat(rhs);
+    instr.BecomeFloat(opcode == IR_ADD ? lhs_val + rhs_val : lhs_val - rhs_val);
+  } else {
+    // Wrap around like the evaluator does instead of overflowing.
+    uint64_t lhs_val = lhs.getImm(), rhs_val = rhs.getImm();
+    instr.BecomeInt(opcode == IR_ADD ? lhs_val + rhs_val : lhs_val - rhs_val);
+  }
+  return true;
+}
+
+}  // namespace
+
+bool PassManager::Run(IRFunction &func) {
+  bool changed = false;
+  for (const auto &pass : passes_) changed |= pass->Run(func);
+  return changed;
+}
+
+void PassManager::DumpStats(std::ostream &out) const {
+  for (const auto &pass : passes_) {
+    std::ostringstream stats;
+    pass->DumpStats(stats);
+    if (!stats.str().empty())
+      out << pass->getName() << ": " << stats.str() << "\n";
+  }
+}
+
+void AddOptimizationPasses(PassManager &passes, unsigned level,
+                           std::unordered_set<std::string> kept_globals) {
+  assert(level >= 1 && level <= kMaxOptLevel &&
+         "Level 0 does not run any passes.");
+  if (level == 1) {
+    passes.AddPass(std::make_unique<ConstantFoldingPass>());
+    passes.AddPass(std::make_unique<DeadCodeEliminationPass>());
+    return;
+  }
+
+  // Value numbering folds constants as it goes.
+  passes.AddPass(std::make_unique<CommonSubexpressionEliminationPass>());
+  passes.AddPass(std::make_unique<AlgebraicSimplificationPass>());
+  passes.AddPass(std::make_unique<DeadStoreEliminationPass>(kept_globals));
+  passes.AddPass(std::make_unique<DeadCodeEliminationPass>());
+  if (level >= 3) {
+    passes.AddPass(
+        std::make_unique<GlobalCoalescingPass>(std::move(kept_globals)));
+  }
+}
+
+bool ConstantFoldingPass::Run(IRFunction &func) {
+  bool changed = false;
+  for (const auto &instr : func.getEntryBlock().getInstrs()) {
+    if (!Fold(*instr)) continue;
+    ++num_folded_;
+    changed = true;
+  }
+  return changed;
+}
+
+void ConstantFoldingPass::DumpStats(std::ostream &out) const {
+  out << num_folded_ << " folded";
+}
+
+bool AlgebraicSimplificationPass::Run(IRFunction &func) {
+  auto &instrs = func.getEntryBlock().getInstrs();
+  auto uses = func.CountUses();
+  auto is_int_arith = [](const IRInstr *instr) {
+    return (instr->getOpcode() == IR_ADD || instr->getOpcode() == IR_SUB) &&
+           instr->getType() == TYPE_INT;
+  };
+
+  // An add or sub used only by another one is part of its user's tree.
+  std::unordered_map<const IRInstr *, unsigned> arith_uses;
+  for (const auto &instr : instrs) {
+    if (!is_int_arith(instr.get())) continue;
+    for (const IRInstr *operand : instr->getOperands()) {
+      if (is_int_arith(operand)) ++arith_uses[operand];
+    }
+  }
+  auto is_inner = [&](const IRInstr *instr) {
+    return is_int_arith(instr) && uses[instr] == 1 && arith_uses[instr] == 1;
+  };
+
+  // Each load stands for the first load of its global since it was stored.
+  std::unordered_map<const IRInstr *, const IRInstr *> same_load;
+  std::unordered_map<std::string, const IRInstr *> first_loads;
+
+  std::unordered_map<const IRInstr *, size_t> positions;
+  std::vector<std::vector<unique<IRInstr>>> inserted(instrs.size());
+  std::unordered_map<const IRInstr *, IRInstr *> replaced;
+
+  struct Term {
+    int64_t coefficient;
+    std::vector<IRInstr *> added, subtracted;
+  };
+  for (size_t i = 0; i < instrs.size(); ++i) {
+    IRInstr *root = instrs[i].get();
+    positions[root] = i;
+    switch (root->getOpcode()) {
+      case IR_LOAD_GLOBAL: {
+        auto inserted_load = first_loads.emplace(root->getName(), root);
+        same_load[root] = inserted_load.first->second;
+        break;
+      }
+      case IR_STORE_GLOBAL:
+        first_loads.erase(root->getName());
+        break;
+      case IR_CALL:
+        first_loads.clear();
+        break;
+      default:
+        break;
+    }
+    if (!is_int_arith(root) || is_inner(root)) continue;
+
+    // Flatten the tree. Terms are kept in the order their leaves are found.
+    std::vector<Term> terms;
+    std::unordered_map<const IRInstr *, size_t> term_indices;
+    uint64_t constant = 0;
+    size_t num_ops = 0;
+    std::function<void(IRInstr *, bool)> flatten = [&](IRInstr *node,
+                                                      bool negate) {
+      if (node == root || is_inner(node)) {
+        ++num_ops;
+        flatten(node->getOperand(0), negate);
+        flatten(node->getOperand(1), negate != (node->getOpcode() == IR_SUB));
+        return;
+      }
+      if (node->getOpcode() == IR_INT) {
+        constant += negate ? -static_cast<uint64_t>(node->getImm())
+                           : static_cast<uint64_t>(node->getImm());
+        return;
+      }
+      auto found = same_load.find(node);
+      const IRInstr *leaf = found == same_load.end() ? node : found->second;
+      auto inserted_term = term_indices.emplace(leaf, terms.size());
+      if (inserted_term.second) terms.push_back({0, {}, {}});
+      Term &term = terms[inserted_term.first->second];
+      term.coefficient += negate ? -1 : 1;
+      (negate ? term.subtracted : term.added).push_back(node);
+    };
+    flatten(root, false);
+
+    // Pick which occurrences of each leaf are left after cancelling.
+    std::vector<std::pair<IRInstr *, bool>> leaves;  // Leaf and if negated.
+    size_t num_added = 0;
+    for (const Term &term : terms) {
+      bool negate = term.coefficient < 0;
+      const std::vector<IRInstr *> &left =
+          negate ? term.subtracted : term.added;
+      for (int64_t j = 0; j < std::abs(term.coefficient); ++j)
+        leaves.emplace_back(left[j], negate);
+      if (!negate) num_added += term.coefficient;
+    }
+    size_t new_num_ops =
+        num_added ? leaves.size() - 1 + (constant != 0) : leaves.size();
+    if (new_num_ops >= num_ops) continue;
+    ++num_simplified_;
+    num_ops_removed_ += num_ops - new_num_ops;
+
+    // Each op goes right after the later of its operands so the sum can be
+    // built on the stack as the leaves are computed.
+    std::sort(leaves.begin(), leaves.end(),
+              [&](const std::pair<IRInstr *, bool> &lhs,
+                  const std::pair<IRInstr *, bool> &rhs) {
+                return positions.at(lhs.first) < positions.at(rhs.first);
+              });
+    auto make_constant = [&](int64_t val, size_t pos) {
+      unique<IRInstr> instr = func.MakeInstr(IR_INT, TYPE_INT);
+      instr->setImm(val);
+      inserted[pos].push_back(std::move(instr));
+      return inserted[pos].back().get();
+    };
+    auto make_op = [&](IROpcode opcode, IRInstr *lhs, IRInstr *rhs,
+                       size_t pos) {
+      unique<IRInstr> instr = func.MakeInstr(opcode, TYPE_INT);
+      instr->AddOperand(lhs);
+      instr->AddOperand(rhs);
+      inserted[pos].push_back(std::move(instr));
+      return inserted[pos].back().get();
+    };
+
+    IRInstr *sum = nullptr;
+    size_t sum_pos = 0;
+    if (!num_added) {
+      // Nothing is added, so start from the constant.
+      sum_pos = leaves.empty() ? i : positions.at(leaves.front().first);
+      sum = make_constant(constant, sum_pos);
+    } else {
+      auto first_added = std::find_if(
+          leaves.begin(), leaves.end(),
+          [](const std::pair<IRInstr *, bool> &leaf) { return !leaf.second; });
+      sum = first_added->first;
+      sum_pos = positions.at(sum);
+      leaves.erase(first_added);
+    }
+    for (const auto &leaf : leaves) {
+      sum_pos = std::max(sum_pos, positions.at(leaf.first));
+      sum = make_op(leaf.second ? IR_SUB : IR_ADD, sum, leaf.first, sum_pos);
+    }
+    if (num_added && constant) {
+      int64_t val = constant;
+      bool negative = val < 0 && val != INT64_MIN;
+      sum = make_op(negative ? IR_SUB : IR_ADD, sum,
+                    make_constant(negative ? -val : val, i), i);
+    }
+
+    auto found = replaced.find(sum);
+    replaced[root] = found == replaced.end() ? sum : found->second;
+  }
+  if (replaced.empty()) return false;
+
+  // Lay out the new instructions and point every use of a tree at its sum.
+  std::vector<unique<IRInstr>> simplified;
+  auto append = [&](unique<IRInstr> instr) {
+    for (size_t j = 0; j < instr->getOperands().size(); ++j) {
+      auto found = replaced.find(instr->getOperand(j));
+      if (found != replaced.end()) instr->setOperand(j, found->second);
+    }
+    simplified.push_back(std::move(instr));
+  };
+  for (size_t i = 0; i < instrs.size(); ++i) {
+    append(std::move(instrs[i]));
+    for (auto &instr : inserted[i]) append(std::move(instr));
+  }
+  instrs = std::move(simplified);
+  return true;
+}
+
+void AlgebraicSimplificationPass::DumpStats(std::ostream &out) const {
+  out << num_simplified_ << " trees simplified, " << num_ops_removed_
+      << " ops removed";
+}
+
+bool CommonSubexpressionEliminationPass::Run(IRFunction &func) {
+  // Everything that identifies the value of an instruction other than a load.
+  using ValueKey = std::tuple<IROpcode, TypeKind, int64_t, std::string,
+                              std::vector<const IRInstr *>>;
+  std::map<ValueKey, IRInstr *> values;
+
+  // The value each global holds right now, if it is known.
+  std::unordered_map<std::string, IRInstr *> globals;
+
+  // Removed instructions and what their uses take instead. Operands always
+  // come before their uses, so one lookup per operand is enough.
+  std::unordered_map<const IRInstr *, IRInstr *> replaced;
+
+  // Loads that are kept but give the same value as an earlier instruction.
+  std::unordered_map<const IRInstr *, IRInstr *> numbers;
+  auto get_number = [&numbers](IRInstr *instr) {
+    auto found = numbers.find(instr);
+    return found == numbers.end() ? instr : found->second;
+  };
+
+  auto &instrs = func.getEntryBlock().getInstrs();
+  size_t kept = 0;
+  for (size_t i = 0; i < instrs.size(); ++i) {
+    IRInstr *instr = instrs[i].get();
+    for (size_t j = 0; j < instr->getOperands().size(); ++j) {
+      auto found = replaced.find(instr->getOperand(j));
+      if (found != replaced.end()) instr->setOperand(j, found->second);
+    }
+    if (Fold(*instr)) ++num_folded_;
+
+    IRInstr *same = nullptr;
+    switch (instr->getOpcode()) {
+      case IR_STORE_GLOBAL:
+        globals[instr->getName()] = get_number(instr->getOperand(0));
+        break;
+      case IR_LOAD_GLOBAL: {
+        auto found = globals.find(instr->getName());
+        if (found == globals.end() ||
+            found->second->getType() != instr->getType()) {
+          globals[instr->getName()] = instr;
+        } else if (found->second->isConstant()) {
+          same = found->second;
+          ++num_forwarded_;
+        } else {
+          numbers[instr] = found->second;
+        }
+        break;
+      }
+      case IR_CALL:
+        // The function may store to any global.
+        globals.clear();
+        break;
+      case IR_BUILTIN:
+      case IR_RESULT:
+        break;
+      default: {
+        std::vector<const IRInstr *> operands;
+        for (IRInstr *operand : instr->getOperands())
+          operands.push_back(get_number(operand));
+        if (instr->getOpcode() == IR_ADD)
+          std::sort(operands.begin(), operands.end(),
+                    [](const IRInstr *lhs, const IRInstr *rhs) {
+                      return lhs->getID() < rhs->getID();
+                    });
+        auto inserted = values.emplace(
+            ValueKey(instr->getOpcode(), instr->getType(), instr->getImm(),
+                     instr->getName(), std::move(operands)),
+            instr);
+        if (!inserted.second) same = inserted.first->second;
+        break;
+      }
+    }
+
+    if (same) {
+      replaced[instr] = same;
+      ++num_eliminated_;
+      continue;
+    }
+    instrs[kept++] = std::move(instrs[i]);
+  }
+
+  bool changed = kept != instrs.size();
+  instrs.resize(kept);
+  return changed;
+}
+
+void CommonSubexpressionEliminationPass::DumpStats(std::ostream &out) const {
+  out << num_eliminated_ << " eliminated (" << num_forwarded_
+      << " loads of stored constants), " << num_folded_ << " folded";
+}
+
+bool DeadStoreEliminationPass::Run(IRFunction &func) {
+  auto &instrs = func.getEntryBlock().getInstrs();
+  size_t num_instrs = instrs.size();
+
+  // Going backwards, the globals that may still be read before they are
+  // stored again.
+  std::unordered_set<std::string> live(kept_globals_.begin(),
+                                       kept_globals_.end());
+  std::unordered_set<std::string> stored, kept;
+  std::vector<bool> dead(instrs.size());
+
+  // Set once a call is found, since the function may read any global.
+  bool all_live = false;
+  for (size_t i = instrs.size(); i > 0; --i) {
+    const IRInstr &instr = *instrs[i - 1];
+    if (instr.getOpcode() == IR_CALL) {
+      all_live = true;
+    } else if (instr.getOpcode() == IR_LOAD_GLOBAL) {
+      live.insert(instr.getName());
+    } else if (instr.getOpcode() == IR_STORE_GLOBAL) {
+      stored.insert(instr.getName());
+      if (live.erase(instr.getName()) || all_live)
+        kept.insert(instr.getName());
+      else
+        dead[i - 1] = true;
+    }
+  }
+
+  size_t kept_instrs = 0;
+  for (size_t i = 0; i < instrs.size(); ++i) {
+    if (!dead[i]) instrs[kept_instrs++] = std::move(instrs[i]);
+  }
+  instrs.resize(kept_instrs);
+  num_stores_removed_ += num_instrs - kept_instrs;
+  num_globals_removed_ += stored.size() - kept.size();
+  return kept_instrs != num_instrs;
+}
+
+void DeadStoreEliminationPass::DumpStats(std::ostream &out) const {
+  out << num_stores_removed_ << " stores removed, " << num_globals_removed_
+      << " globals removed";
+}
+
+bool GlobalCoalescingPass::Run(IRFunction &func) {
+  struct LiveRange {
+    size_t start, end;
+    std::vector<IRInstr *> instrs;
+  };
+  std::vector<LiveRange> ranges;
+
+  // The range each global's current value belongs to.
+  std::unordered_map<std::string, size_t> current;
+  std::unordered_set<std::string> inputs, names;
+
+  auto &instrs = func.getEntryBlock().getInstrs();
+  for (size_t i = 0; i < instrs.size(); ++i) {
+    IRInstr *instr = instrs[i].get();
+    IROpcode opcode = instr->getOpcode();
+
+    // A function may use any global by name.
+    if (opcode == IR_CALL) return false;
+    if (opcode != IR_STORE_GLOBAL && opcode != IR_LOAD_GLOBAL) continue;
+    const std::string &name = instr->getName();
+    names.insert(name);
+    if (kept_globals_.count(name) || inputs.count(name)) continue;
+
+    if (opcode == IR_STORE_GLOBAL) {
+      current[name] = ranges.size();
+      ranges.push_back({i, i, {instr}});
+      continue;
+    }
+    auto found = current.find(name);
+    if (found == current.end()) {
+      inputs.insert(name);
+      continue;
+    }
+    LiveRange &range = ranges[found->second];
+    range.end = i;
+    range.instrs.push_back(instr);
+  }
+
+  // Ranges were made in the order they start. Slots whose ranges have ended
+  // are ordered by when they ended.
+  using Active = std::pair<size_t, size_t>;  // End and slot.
+  std::priority_queue<Active, std::vector<Active>, std::greater<Active>>
+      active;
+  std::vector<size_t> free_slots;
+  std::vector<std::string> slot_names;
+  std::unordered_set<std::string> owned;
+  bool changed = false;
+  for (const LiveRange &range : ranges) {
+    while (!active.empty() && active.top().first < range.start) {
+      free_slots.push_back(active.top().second);
+      active.pop();
+    }
+    size_t slot;
+    if (free_slots.empty()) {
+      // A new slot takes the name of its first global, unless another slot
+      // already has it. Then a number is appended until no slot or global in
+      // the program has the name.
+      const std::string &name = range.instrs.front()->getName();
+      std::string slot_name = name;
+      size_t suffix = 0;
+      while (owned.count(slot_name) || (suffix && names.count(slot_name)))
+        slot_name = name + std::to_string(++suffix);
+      owned.insert(slot_name);
+      slot = slot_names.size();
+      slot_names.push_back(slot_name);
+    } else {
+      slot = free_slots.back();
+      free_slots.pop_back();
+    }
+    active.push({range.end, slot});
+
+    for (IRInstr *instr : range.instrs) {
+      if (instr->getName() == slot_names[slot]) continue;
+      instr->setName(slot_names[slot]);
+      changed = true;
+    }
+  }
+
+  num_ranges_ += ranges.size();
+  num_slots_ += slot_names.size();
+  return changed;
+}
+
+void GlobalCoalescingPass::DumpStats(std::ostream &out) const {
+  out << num_ranges_ << " live ranges in " << num_slots_ << " slots";
+}
+
+constexpr size_t InliningPass::kConstantArgBonus;
+
+bool InliningPass::Run(IRFunction &func) {
+  auto &instrs = func.getEntryBlock().getInstrs();
+  size_t num_inlined = num_inlined_;
+  std::vector<unique<IRInstr>> expanded;
+  Replacements replaced;
+  for (auto &instr : instrs) Expand(func, std::move(instr), replaced, expanded);
+  instrs = std::move(expanded);
+  inlined_calls_.clear();
+  return num_inlined_ != num_inlined;
+}
+
+bool InliningPass::ShouldInline(const IRInstr &call) const {
+  if (inlining_.size() >= max_depth_ ||
+      std::find(inlining_.begin(), inlining_.end(), call.getName()) !=
+          inlining_.end())
+    return false;
+
+  size_t budget = max_size_;
+  for (const IRInstr *arg : call.getOperands()) {
+    if (arg->isConstant()) budget += kConstantArgBonus;
+  }
+  return functions_.at(call.getName())->getNumInstrs() <= budget;
+}
+
+void InliningPass::Expand(IRFunction &func, unique<IRInstr> instr,
+                          Replacements &replaced,
+                          std::vector<unique<IRInstr>> &out) {
+  for (size_t j = 0; j < instr->getOperands().size(); ++j) {
+    auto found = replaced.find(instr->getOperand(j));
+    if (found != replaced.end()) instr->setOperand(j, found->second);
+  }
+  if (instr->getOpcode() != IR_CALL) {
+    out.push_back(std::move(instr));
+    return;
+  }
+  if (!ShouldInline(*instr)) {
+    ++num_not_inlined_;
+    out.push_back(std::move(instr));
+    return;
+  }
+  ++num_inlined_;
+
+  // Each instruction of the body is copied in terms of the copies made before
+  // it. Parameters are not copied, since uses take the arguments instead.
+  const IRFunction &callee = *functions_.at(instr->getName());
+  Replacements copies;
+  inlining_.push_back(instr->getName());
+  for (const auto &body_instr : callee.getEntryBlock().getInstrs()) {
+    if (body_instr->getOpcode() == IR_PARAM) {
+      copies[body_instr.get()] = instr->getOperand(body_instr->getImm());
+      continue;
+    }
+    unique<IRInstr> copy = func.MakeCopy(*body_instr);
+    for (const IRInstr *operand : body_instr->getOperands())
+      copy->AddOperand(copies.at(operand));
+    copies[body_instr.get()] = copy.get();
+    Expand(func, std::move(copy), replaced, out);
+  }
+  inlining_.pop_back();
+
+  if (const IRInstr *returned = callee.getReturnValue()) {
+    IRInstr *value = copies.at(returned);
+    auto found = replaced.find(value);
+    replaced[instr.get()] = found == replaced.end() ? value : found->second;
+  }
+  inlined_calls_.push_back(std::move(instr));
+}
+
+void InliningPass::DumpStats(std::ostream &out) const {
+  out << num_inlined_ << " calls inlined, " << num_not_inlined_
+      << " not inlined";
+}
+
+bool DeadCodeEliminationPass::Run(IRFunction &func) {
+  auto uses = func.CountUses();
+  auto &instrs = func.getEntryBlock().getInstrs();
+  size_t num_instrs = instrs.size();
+
+  // Removing an instruction can leave its operands unused, so go backwards.
+  std::vector<bool> dead(instrs.size());
+  for (size_t i = instrs.size(); i > 0; --i) {
+    const IRInstr &instr = *instrs[i - 1];
+    if (!instr.isPure() || uses[&instr]) continue;
+    dead[i - 1] = true;
+    for (const IRInstr *operand : instr.getOperands()) --uses[operand];
+  }
+
+  size_t kept = 0;
+  for (size_t i = 0; i < instrs.size(); ++i) {
+    if (!dead[i]) instrs[kept++] = std::move(instrs[i]);
+  }
+  instrs.resize(kept);
+  num_removed_ += num_instrs - kept;
+  return kept != num_instrs;
+}
+
+void DeadCodeEliminationPass::DumpStats(std::ostream &out) const {
+  out << num_removed_ << " removed";
+}
+
+}  // namespace lang
@@ -0,0 +1,260 @@
+#ifndef IR_PASSES_H
+#define IR_PASSES_H
+
+#include <iostream>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "IR.h"
+
+namespace lang {
+
+class IRPass {
+ public:
+  virtual ~IRPass() {}
+  virtual const char *getName() const = 0;
+
+  // Returns whether anything changed.
+  virtual bool Run(IRFunction &func) = 0;
+
+  // Write what this pass did over every run so far, if it keeps track.
+  virtual void DumpStats(std::ostream & /*out*/) const {}
+};
+
+/**
+ * Runs a sequence of passes over a function, in the order they were added.
+ */
+class PassManager {
+ public:
+  void AddPass(unique<IRPass> pass) { passes_.push_back(std::move(pass)); }
+
+  // Returns whether any pass changed anything.
+  bool Run(IRFunction &func);
+
+  const std::vector<unique<IRPass>> &getPasses() const { return passes_; }
+
+  // Write the stats of each pass, one per line, prefixed with its name.
+  void DumpStats(std::ostream &out) const;
+
+ private:
+  std::vector<unique<IRPass>> passes_;
+};
+
+// Replace arithmetic on constants with its result.
+class ConstantFoldingPass : public IRPass {
+ public:
+  const char *getName() const override { return "constant-folding"; }
+  bool Run(IRFunction &func) override;
+  void DumpStats(std::ostream &out) const override;
+
+  size_t getNumFolded() const { return num_folded_; }
+
+ private:
+  size_t num_folded_ = 0;
+};
+
+/**
+ * Rewrite each tree of int adds and subs as a sum of its leaves plus one
+ * constant, so constants are folded across the whole tree and a leaf added and
+ * subtracted cancels out, like `(sub (add x 5) 3)` becoming `(add x 2)`. Loads
+ * of the same global with no store between them count as the same leaf.
+ *
+ * A tree is only rewritten if that takes fewer adds and subs. Floats are left
+ * alone since reassociating them changes how they round.
+ */
+class AlgebraicSimplificationPass : public IRPass {
+ public:
+  const char *getName() const override { return "algebraic-simplification"; }
+  bool Run(IRFunction &func) override;
+  void DumpStats(std::ostream &out) const override;
+
+  size_t getNumSimplified() const { return num_simplified_; }
+  size_t getNumOpsRemoved() const { return num_ops_removed_; }
+
+ private:
+  size_t num_simplified_ = 0;
+  size_t num_ops_removed_ = 0;
+};
+
+/**
+ * Global value numbering. An instruction that computes the same value as an
+ * earlier one is removed and its uses take the earlier value instead, which
+ * lowering keeps in a temporary local if it cannot stay on the stack.
+ *
+ * A load of a global gives the same value as the last load of it or store to
+ * it, so what it computes can be matched with what was computed from that
+ * value. The load itself is only replaced if the value is a constant, since
+ * loading a global again costs no more than loading a temporary local. Builtins
+ * read and write arrays and maps, so they are never reused.
+ *
+ * Arithmetic is folded on the way once its operands are known to be constants,
+ * so constants are followed through any chain of globals.
+ */
+class CommonSubexpressionEliminationPass : public IRPass {
+ public:
+  const char *getName() const override {
+    return "common-subexpression-elimination";
+  }
+  bool Run(IRFunction &func) override;
+  void DumpStats(std::ostream &out) const override;
+
+  // Every instruction removed, including loads of constants stored earlier.
+  size_t getNumEliminated() const { return num_eliminated_; }
+  size_t getNumForwarded() const { return num_forwarded_; }
+  size_t getNumFolded() const { return num_folded_; }
+
+ private:
+  size_t num_eliminated_ = 0;
+  size_t num_forwarded_ = 0;
+  size_t num_folded_ = 0;
+};
+
+/**
+ * Remove stores to globals that are never read afterwards, either because the
+ * global is stored again first or because nothing reads it at all. Globals
+ * the caller reads once the program has run are given as `kept_globals`, and
+ * their last stores are kept.
+ *
+ * A global whose stores are all removed never gets a symbol, and symbols get
+ * their IDs as the byte code is emitted, so the IDs left stay dense.
+ */
+class DeadStoreEliminationPass : public IRPass {
+ public:
+  explicit DeadStoreEliminationPass(
+      std::unordered_set<std::string> kept_globals = {})
+      : kept_globals_(std::move(kept_globals)) {}
+
+  const char *getName() const override { return "dead-store-elimination"; }
+  bool Run(IRFunction &func) override;
+  void DumpStats(std::ostream &out) const override;
+
+  size_t getNumStoresRemoved() const { return num_stores_removed_; }
+
+  // Globals that were stored to but left with no stores at all.
+  size_t getNumGlobalsRemoved() const { return num_globals_removed_; }
+
+ private:
+  std::unordered_set<std::string> kept_globals_;
+  size_t num_stores_removed_ = 0;
+  size_t num_globals_removed_ = 0;
+};
+
+/**
+ * Let globals that are never live at the same time share a symbol slot, so
+ * scripts with many short-lived globals need far fewer slots.
+ *
+ * Each store starts a live range that lasts until the last load of what it
+ * stored. Ranges are given slots in the order they start, reusing any slot
+ * whose range has ended, which uses as few slots as any assignment can. Every
+ * slot has its own name, which is the name of the first global given it
+ * unless another slot already has that one. Inputs, which are loaded before
+ * anything is stored to them, and `kept_globals` keep their own slots.
+ */
+class GlobalCoalescingPass : public IRPass {
+ public:
+  explicit GlobalCoalescingPass(
+      std::unordered_set<std::string> kept_globals = {})
+      : kept_globals_(std::move(kept_globals)) {}
+
+  const char *getName() const override { return "global-coalescing"; }
+  bool Run(IRFunction &func) override;
+  void DumpStats(std::ostream &out) const override;
+
+  size_t getNumRanges() const { return num_ranges_; }
+  size_t getNumSlots() const { return num_slots_; }
+
+ private:
+  std::unordered_set<std::string> kept_globals_;
+  size_t num_ranges_ = 0;
+  size_t num_slots_ = 0;
+};
+
+/**
+ * Replace calls to functions with a copy of their bodies, with the arguments
+ * in place of the parameters, so the other passes can work across calls.
+ *
+ * A function is inlined if it has at most `max_size` instructions, with a few
+ * more allowed for each constant argument since those tend to fold away. The
+ * calls in an inlined body are inlined in turn, up to `max_depth` calls deep
+ * and never into a function that is already being inlined.
+ */
+class InliningPass : public IRPass {
+ public:
+  static constexpr size_t kConstantArgBonus = 4;
+
+  explicit InliningPass(const IRFunctionTable &functions, size_t max_size = 32,
+                        size_t max_depth = 8)
+      : functions_(functions), max_size_(max_size), max_depth_(max_depth) {}
+
+  const char *getName() const override { return "inlining"; }
+  bool Run(IRFunction &func) override;
+  void DumpStats(std::ostream &out) const override;
+
+  size_t getNumInlined() const { return num_inlined_; }
+  size_t getNumNotInlined() const { return num_not_inlined_; }
+
+ private:
+  using Replacements = std::unordered_map<const IRInstr *, IRInstr *>;
+
+  bool ShouldInline(const IRInstr &call) const;
+
+  // Append `instr` to `out`, or the body of the function it calls if it is a
+  // call that should be inlined.
+  void Expand(IRFunction &func, unique<IRInstr> instr, Replacements &replaced,
+              std::vector<unique<IRInstr>> &out);
+
+  const IRFunctionTable &functions_;
+  size_t max_size_;
+  size_t max_depth_;
+
+  // The functions being inlined, outermost first.
+  std::vector<std::string> inlining_;
+
+  // Calls that were inlined. They are kept until the pass is done so their
+  // addresses are not reused by the copies made after them.
+  std::vector<unique<IRInstr>> inlined_calls_;
+
+  size_t num_inlined_ = 0;
+  size_t num_not_inlined_ = 0;
+};
+
+// Remove pure instructions whose values are never used.
+class DeadCodeEliminationPass : public IRPass {
+ public:
+  const char *getName() const override { return "dead-code-elimination"; }
+  bool Run(IRFunction &func) override;
+  void DumpStats(std::ostream &out) const override;
+
+  size_t getNumRemoved() const { return num_removed_; }
+
+ private:
+  size_t num_removed_ = 0;
+};
+
+// The highest optimization level, which runs every pass.
+constexpr unsigned kMaxOptLevel = 3;
+
+// The passes for optimization `level`, from 1 to kMaxOptLevel. Level 0 emits
+// straight from the AST without going through the IR at all. Each level adds
+// passes that cost more to run:
+//
+//   1: Folding constants and removing unused instructions.
+//   2: Value numbering and simplifying arithmetic, then removing the stores
+//      and instructions left unused.
+//   3: Sharing slots between globals.
+//
+// Only the globals in `kept_globals` are expected to be read after the program
+// runs.
+void AddOptimizationPasses(PassManager &passes, unsigned level,
+                           std::unordered_set<std::string> kept_globals = {});
+
+// The passes for kMaxOptLevel.
+inline void AddOptimizationPasses(
+    PassManager &passes, std::unordered_set<std::string> kept_globals = {}) {
+  AddOptimizationPasses(passes, kMaxOptLevel, std::move(kept_globals));
+}
+
+}  // namespace lang
+
+#endif
@@ -1,12 +1,23 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
 #include <unordered_map>
 
+#include "ArrayKernels.h"
+#include "ByteCodeFile.h"
 #include "Interpret.h"
 
 namespace lang {
 
+constexpr uint64_t SymbolHandle::kInvalidSlot;
+
 TypeKind IntType::Kind = TYPE_INT;
+TypeKind FloatType::Kind = TYPE_FLOAT;
 TypeKind StrType::Kind = TYPE_STR;
 TypeKind FuncType::Kind = TYPE_FUNC;
+TypeKind ArrayType::Kind = TYPE_ARRAY;
+TypeKind MapType::Kind = TYPE_MAP;
 
 namespace {
 
@@ -18,25 +29,82 @@ unique<Type> MakeBinaryIntFuncType() {
                                     std::move(arg_types));
 }
 
+const Builtin kBuiltins[] = {
+    {"make", INSTR_ARRAY_MAKE, 1, true, TYPE_ARRAY, -1, {TYPE_INT}},
+    {"get", INSTR_ARRAY_GET, 2, true, TYPE_INT, -1, {TYPE_ARRAY, TYPE_INT}},
+    {"set", INSTR_ARRAY_SET, 3, false, TYPE_INT, -1,
+     {TYPE_ARRAY, TYPE_INT, TYPE_INT}},
+    {"sum", INSTR_ARRAY_SUM, 1, true, TYPE_INT, -1, {TYPE_ARRAY}},
+    {"vadd", INSTR_ARRAY_VADD, 2, true, TYPE_ARRAY, -1,
+     {TYPE_ARRAY, TYPE_ARRAY}},
+    {"map", INSTR_MAP_NEW, 0, true, TYPE_MAP, -1, {}},
+    {"put", INSTR_MAP_PUT, 3, false, TYPE_INT, 1,
+     {TYPE_MAP, TYPE_INT, TYPE_INT}},
+    {"lookup", INSTR_MAP_LOOKUP, 2, true, TYPE_INT, 1, {TYPE_MAP, TYPE_INT}},
+};
+
+// Statements shorter than this run faster than looking up their value.
+constexpr uint64_t kMinMemoizedCodes = 12;
+
+// splitmix64 finalizer over the hash so far mixed with the next value.
+uint64_t MixHash(uint64_t hash, int64_t val) {
+  hash ^= static_cast<uint64_t>(val) + 0x9E3779B97F4A7C15ULL + (hash << 6) +
+          (hash >> 2);
+  hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EBULL;
+  return hash ^ (hash >> 31);
+}
+
 }  // namespace
 
-Evaluatable &&Evaluatable::GetInt(int32_t val) {
+const char *getTypeName(TypeKind type) {
+  switch (type) {
+    case TYPE_INT:
+      return "int";
+    case TYPE_FLOAT:
+      return "float";
+    case TYPE_STR:
+      return "str";
+    case TYPE_FUNC:
+      return "func";
+    case TYPE_ARRAY:
+      return "array";
+    case TYPE_MAP:
+      return "map";
+  }
+  return "";
+}
+
+const Builtin *LookupBuiltin(const std::string &name) {
+  for (const Builtin &builtin : kBuiltins) {
+    if (name == builtin.name) return &builtin;
+  }
+  return nullptr;
+}
+
+Evaluatable Evaluatable::GetInt(int32_t val) {
   Evaluatable value(std::make_unique<IntType>());
   value.val_.int_val = val;
-  return std::move(value);
+  return value;
+}
+
+Evaluatable Evaluatable::GetFloat(double val) {
+  Evaluatable value(std::make_unique<FloatType>());
+  value.val_.float_val = val;
+  return value;
 }
 
-Evaluatable &&Evaluatable::GetStr(const std::string &val) {
+Evaluatable Evaluatable::GetStr(const std::string &val) {
   Evaluatable value(std::make_unique<StrType>());
   value.val_.str_val = {MakeChars(val.c_str(), val.size()), val.size()};
-  return std::move(value);
+  return value;
 }
 
-Evaluatable &&Evaluatable::GetFunc(unique<Type> type,
-                                   unique<FunctionValue> val) {
+Evaluatable Evaluatable::GetFunc(unique<Type> type,
+                                 unique<FunctionValue> val) {
   Evaluatable value(std::move(type));
   value.val_.func_val = val.release();
-  return std::move(value);
+  return value;
 }
 
 Evaluatable::Evaluatable(const Evaluatable &other) {
@@ -53,6 +121,14 @@ Evaluatable::Evaluatable(const Evaluatable &other) {
     case TYPE_INT:
       val_.int_val = other.val_.int_val;
       break;
+    case TYPE_FLOAT:
+      val_.float_val = other.val_.float_val;
+      break;
+    case TYPE_ARRAY:
+    case TYPE_MAP:
+      lang_unreachable(
+          "Arrays and maps only exist as handles during evaluation.");
+      break;
   }
 }
 
@@ -65,6 +141,9 @@ Evaluatable::~Evaluatable() {
       delete val_.func_val;
       break;
     case TYPE_INT:
+    case TYPE_FLOAT:
+    case TYPE_ARRAY:
+    case TYPE_MAP:
       // No custom destruction necessary.
       break;
   }
@@ -100,6 +179,8 @@ void ASTVisitor::Visit(const Node &node) {
       return VisitModule(*node.getAs<Module>());
     case NODE_INT:
       return VisitInt(*node.getAs<Int>());
+    case NODE_FLOAT:
+      return VisitFloat(*node.getAs<Float>());
     case NODE_STR:
       return VisitStr(*node.getAs<Str>());
     case NODE_ID:
@@ -110,25 +191,51 @@ void ASTVisitor::Visit(const Node &node) {
       return VisitBinOp(*node.getAs<BinOp>());
     case NODE_ASSIGN:
       return VisitAssign(*node.getAs<Assign>());
+    case NODE_LET:
+      return VisitLet(*node.getAs<Let>());
     case NODE_STMT:
       return VisitStmt(*node.getAs<Stmt>());
   }
 }
 
+int FormatFloat(double val, char *buf, size_t size) {
+  int len = 0;
+  for (int precision = 15; precision <= 17; ++precision) {
+    len = snprintf(buf, size, "%.*g", precision, val);
+    if (strtod(buf, nullptr) == val) break;
+  }
+  return len;
+}
+
 void ByteCodeEmitter::ConvertToByteCode(const Node &node) { Visit(node); }
 
 void ByteCodeEmitter::VisitModule(const Module &module) {
-  for (const auto &node_ptr : module.getNodes()) Visit(*node_ptr);
+  for (const auto &node_ptr : module.getNodes()) {
+    stmt_locs_.push_back({byte_code_.size(), node_ptr->getLoc()});
+    Visit(*node_ptr);
+  }
 }
 
 void ByteCodeEmitter::VisitInt(const Int &node) {
   PushBackInstr(INSTR_PUSH);
   PushBackValue(node.getVal());
+  PushType(TYPE_INT);
+}
+
+void ByteCodeEmitter::VisitFloat(const Float &node) {
+  PushBackInstr(INSTR_PUSH);
+  PushBackValue(FloatToBits(node.getVal()));
+  PushType(TYPE_FLOAT);
 }
 
 uint64_t ByteCodeEmitter::getUniqueConstantID(const std::string &str) {
+  // Identical strs share one constant so they can be compared by ID.
+  auto found = interned_strs_.find(str);
+  if (found != interned_strs_.end()) return found->second;
+
   uint64_t str_id = constants_.size();
   constants_.push_back(Evaluatable::GetStr(str));
+  interned_strs_[str] = str_id;
   return str_id;
 }
 
@@ -151,67 +258,354 @@ void ByteCodeEmitter::makeUniqueSymbolID(const std::string &name) {
 
 void ByteCodeEmitter::VisitStr(const Str &node) {
   PushBackInstr(INSTR_PUSH);
-
-  uint64_t str_id = constants_.size();
-  constants_.push_back(Evaluatable::GetStr(node.getVal()));
-  PushBackValue(str_id);
+  PushBackValue(getUniqueConstantID(node.getVal()));
+  PushType(TYPE_STR);
 }
 
 void ByteCodeEmitter::VisitBinOp(const BinOp &node) {
-  Visit(node.getLHS());
-  Visit(node.getRHS());
+  TypeKind lhs_type = VisitValue(node.getLHS());
+  TypeKind rhs_type = VisitValue(node.getRHS());
+  assert((lhs_type == TYPE_INT || lhs_type == TYPE_FLOAT) &&
+         (rhs_type == TYPE_INT || rhs_type == TYPE_FLOAT) &&
+         "Binary operations can only be performed on ints and floats.");
+
+  // If either side is a float, the int side is promoted to a float.
+  bool is_float = lhs_type == TYPE_FLOAT || rhs_type == TYPE_FLOAT;
+  if (is_float && rhs_type == TYPE_INT) {
+    PushBackInstr(INSTR_INT_TO_FLOAT);
+    PushBackValue(0);
+  }
+  if (is_float && lhs_type == TYPE_INT) {
+    PushBackInstr(INSTR_INT_TO_FLOAT);
+    PushBackValue(1);
+  }
 
   Instruction instr;
   switch (node.getKind()) {
     case BINOP_ADD:
-      instr = INSTR_ADD_OP;
+      instr = is_float ? INSTR_ADD_F : INSTR_ADD_OP;
       break;
     case BINOP_SUB:
-      instr = INSTR_SUB_OP;
+      instr = is_float ? INSTR_SUB_F : INSTR_SUB_OP;
       break;
   }
+  PushType(is_float ? TYPE_FLOAT : TYPE_INT);
   return PushBackInstr(instr);
 }
 
+int64_t ByteCodeEmitter::FindLocal(const std::string &name) const {
+  for (int64_t slot = scopes_.size() - 1; slot >= 0; --slot) {
+    if (scopes_[slot].name == name) return slot;
+  }
+  return -1;
+}
+
+void ByteCodeEmitter::VisitLet(const Let &node) {
+  // The value is evaluated before the name comes into scope.
+  TypeKind type = VisitValue(node.getVal());
+
+  uint64_t slot = scopes_.size();
+  scopes_.push_back({node.getName(), type});
+  num_locals_ = std::max<uint64_t>(num_locals_, scopes_.size());
+  PushBackInstr(INSTR_STORE_LOCAL);
+  PushBackValue(slot);
+
+  Visit(node.getBody());
+  scopes_.pop_back();
+}
+
 void ByteCodeEmitter::VisitID(const ID &node) {
+  int64_t slot = FindLocal(node.getName());
+  if (slot >= 0) {
+    PushBackInstr(INSTR_LOAD_LOCAL);
+    PushBackValue(slot);
+    PushType(scopes_[slot].type);
+    return;
+  }
+
   // Load the value at the symbol and push that onto the stack.
   uint64_t symbol = getUniqueSymbolID(node.getName());
   PushBackInstr(INSTR_LOAD);
   PushBackValue(symbol);
+  PushType(symbol_types_.at(symbol));
 }
 
 void ByteCodeEmitter::VisitAssign(const Assign &node) {
+  const auto *id_node = node.getDst().getAs<ID>();
+  if (!id_node) {
+    lang_unreachable("Found a node we cannot assign to.");
+    return;
+  }
+  const std::string &name = id_node->getName();
+
+  // Assigning to a local just replaces what is in its slot.
+  int64_t slot = FindLocal(name);
+  if (slot >= 0) {
+    scopes_[slot].type = VisitValue(node.getSrc());
+    PushBackInstr(INSTR_STORE_LOCAL);
+    PushBackValue(slot);
+    return;
+  }
+
   // First declaration of this variable. May need to add it to the set of known
   // symbols.
-  if (const auto *id_node = node.getDst().getAs<ID>()) {
-    const std::string &name = id_node->getName();
-    if (!uniqueSymbolExists(name)) makeUniqueSymbolID(name);
+  if (!uniqueSymbolExists(name)) makeUniqueSymbolID(name);
 
-    uint64_t symbol = getUniqueSymbolID(name);
-    PushBackInstr(INSTR_PUSH);
-    PushBackValue(symbol);
-  } else {
-    lang_unreachable("Found a node we cannot assign to.");
-  }
+  uint64_t symbol = getUniqueSymbolID(name);
+  PushBackInstr(INSTR_PUSH);
+  PushBackValue(symbol);
 
-  Visit(node.getSrc());
+  // The symbol ID pushed above is not tracked on the type stack.
+  TypeKind type = VisitValue(node.getSrc());
   PushBackInstr(INSTR_STORE);
+  symbol_types_[symbol] = type;
 }
 
 void ByteCodeEmitter::VisitCall(const Call &node) {
-  VisitNodeSequence(node.getArgs());
-  Visit(node.getFunc());
+  const auto *id_func = node.getFunc().getAs<ID>();
+  const Builtin *builtin =
+      id_func ? LookupBuiltin(id_func->getName()) : nullptr;
+  assert(builtin && "Only builtins can be called.");
+  assert(node.getArgs().size() == builtin->num_args &&
+         "Wrong number of arguments passed to builtin.");
+
+  std::vector<TypeKind> arg_types;
+  for (const auto &arg : node.getArgs()) arg_types.push_back(VisitValue(*arg));
+  for (unsigned i = 0; i < builtin->num_args; ++i) {
+    if (static_cast<int>(i) == builtin->typed_arg) continue;
+    assert(arg_types[i] == builtin->arg_types[i] &&
+           "Wrong type of argument passed to builtin.");
+  }
+  PushBackInstr(builtin->instr);
+
+  if (builtin->typed_arg >= 0) {
+    TypeKind arg_type = arg_types[builtin->typed_arg];
+    assert((arg_type == TYPE_INT || arg_type == TYPE_STR) &&
+           "Map keys can only be ints or strs.");
+    PushBackValue(arg_type);
+  }
+
+  if (builtin->has_result) PushType(builtin->result_type);
+}
+
+CheckStatus CheckStatus::GetSuccess() {
+  CheckStatus status;
+  status.kind_ = CHECK_SUCCESS;
+  return status;
+}
+
+CheckStatus CheckStatus::GetFailure(CheckStatusKind kind, SourceLocation loc,
+                                    const std::string &reason) {
+  CheckStatus status;
+  status.kind_ = kind;
+  if (loc.isValid()) {
+    status.message_ =
+        std::to_string(loc.row + 1) + ":" + std::to_string(loc.col + 1) + ": ";
+  }
+  status.message_ += reason;
+  return status;
+}
+
+namespace {
+
+/**
+ * Walks the AST in the same order as the ByteCodeEmitter and tracks the types
+ * it would push, but stops at the first node it could not emit instead of
+ * asserting.
+ */
+class TypeChecker : public ASTVisitor {
+ public:
+  explicit TypeChecker(std::unordered_map<std::string, TypeKind> globals)
+      : globals_(std::move(globals)) {}
+
+  const CheckStatus &getStatus() const { return status_; }
+
+ private:
+  void VisitModule(const Module &module) override {
+    for (const auto &node_ptr : module.getNodes()) {
+      if (!status_.isSuccessful()) return;
+      Visit(*node_ptr);
+    }
+  }
+
+  void VisitInt(const Int &) override { types_.push_back(TYPE_INT); }
+  void VisitFloat(const Float &) override { types_.push_back(TYPE_FLOAT); }
+  void VisitStr(const Str &) override { types_.push_back(TYPE_STR); }
+
+  void VisitID(const ID &node) override {
+    const std::string &name = node.getName();
+    for (auto it = scopes_.rbegin(); it != scopes_.rend(); ++it) {
+      if (it->first != name) continue;
+      types_.push_back(it->second);
+      return;
+    }
+
+    auto found = globals_.find(name);
+    if (found == globals_.end())
+      return Fail(CHECK_FAIL_UNKNOWN_NAME, node, "Unknown name " + name);
+    types_.push_back(found->second);
+  }
+
+  void VisitBinOp(const BinOp &node) override {
+    TypeKind lhs_type, rhs_type;
+    if (!VisitValue(node.getLHS(), lhs_type) ||
+        !VisitValue(node.getRHS(), rhs_type))
+      return;
+    for (TypeKind type : {lhs_type, rhs_type}) {
+      if (type != TYPE_INT && type != TYPE_FLOAT) {
+        return Fail(CHECK_FAIL_TYPE_MISMATCH, node,
+                    std::string("Cannot add or subtract a ") +
+                        getTypeName(type));
+      }
+    }
+    bool is_float = lhs_type == TYPE_FLOAT || rhs_type == TYPE_FLOAT;
+    types_.push_back(is_float ? TYPE_FLOAT : TYPE_INT);
+  }
+
+  void VisitLet(const Let &node) override {
+    TypeKind type;
+    if (!VisitValue(node.getVal(), type)) return;
+    scopes_.emplace_back(node.getName(), type);
+    Visit(node.getBody());
+    scopes_.pop_back();
+  }
+
+  void VisitAssign(const Assign &node) override {
+    const auto *id_node = node.getDst().getAs<ID>();
+    if (!id_node) {
+      return Fail(CHECK_FAIL_INVALID_ASSIGN, node,
+                  "Only names can be assigned to");
+    }
+    TypeKind type;
+    if (!VisitValue(node.getSrc(), type)) return;
+
+    const std::string &name = id_node->getName();
+    for (auto it = scopes_.rbegin(); it != scopes_.rend(); ++it) {
+      if (it->first != name) continue;
+      it->second = type;
+      return;
+    }
+    globals_[name] = type;
+  }
+
+  void VisitCall(const Call &node) override {
+    const auto *id_func = node.getFunc().getAs<ID>();
+    const Builtin *builtin =
+        id_func ? LookupBuiltin(id_func->getName()) : nullptr;
+    if (!builtin) {
+      return Fail(CHECK_FAIL_NOT_CALLABLE, node,
+                  "Only builtins can be called");
+    }
+
+    const std::vector<unique<Node>> &args = node.getArgs();
+    if (args.size() != builtin->num_args) {
+      return Fail(CHECK_FAIL_WRONG_NUM_ARGS, node,
+                  std::string(builtin->name) + " takes " +
+                      std::to_string(builtin->num_args) + " arguments, not " +
+                      std::to_string(args.size()));
+    }
+
+    for (unsigned i = 0; i < args.size(); ++i) {
+      TypeKind type;
+      if (!VisitValue(*args[i], type)) return;
+      bool matches = static_cast<int>(i) == builtin->typed_arg
+                         ? type == TYPE_INT || type == TYPE_STR
+                         : type == builtin->arg_types[i];
+      if (!matches) {
+        return Fail(CHECK_FAIL_TYPE_MISMATCH, *args[i],
+                    std::string("Argument ") + std::to_string(i + 1) +
+                        " of " + builtin->name + " cannot be a " +
+                        getTypeName(type));
+      }
+    }
+    if (builtin->has_result) types_.push_back(builtin->result_type);
+  }
+
+  // Visit a node that must leave a value and pop its type. Returns false if
+  // the check failed.
+  bool VisitValue(const Node &node, TypeKind &type) {
+    size_t num_types = types_.size();
+    Visit(node);
+    if (!status_.isSuccessful()) return false;
+    if (types_.size() == num_types) {
+      Fail(CHECK_FAIL_TYPE_MISMATCH, node, "Expected a value");
+      return false;
+    }
+    type = types_.back();
+    types_.pop_back();
+    return true;
+  }
+
+  void Fail(CheckStatusKind kind, const Node &node, const std::string &reason) {
+    status_ = CheckStatus::GetFailure(kind, node.getLoc(), reason);
+  }
+
+  CheckStatus status_ = CheckStatus::GetSuccess();
+  std::unordered_map<std::string, TypeKind> globals_;
+  std::vector<std::pair<std::string, TypeKind>> scopes_;
+  std::vector<TypeKind> types_;
+};
+
+}  // namespace
+
+CheckStatus ByteCodeEmitter::Check(const Node &node) const {
+  std::unordered_map<std::string, TypeKind> globals;
+  for (const auto &symbol : symbols_) {
+    auto found = symbol_types_.find(symbol.second);
+    if (found != symbol_types_.end()) globals[symbol.first] = found->second;
+  }
+  TypeChecker checker(std::move(globals));
+  checker.Visit(node);
+  return checker.getStatus();
+}
+
+EvalStatus EvalStatus::GetSuccess() {
+  EvalStatus status;
+  status.kind_ = EVAL_SUCCESS;
+  return status;
+}
+
+EvalStatus EvalStatus::GetFailure(EvalStatusKind kind,
+                                  const std::string &reason) {
+  EvalStatus status;
+  status.kind_ = kind;
+  status.message_ = reason;
+  return status;
+}
+
+bool ByteCodeEvaluator::MakeArray(size_t len, int64_t &handle) {
+  // Lengths a vector cannot hold throw length_error instead of bad_alloc.
+  if (len > std::vector<int64_t>().max_size()) {
+    return Fail(EVAL_FAIL_OUT_OF_MEMORY,
+                "Not enough memory for an array of length " +
+                    std::to_string(len));
+  }
+  arrays_.emplace_back(len, 0);
+  handle = arrays_.size() - 1;
+  return true;
+}
+
+bool ByteCodeEvaluator::Interpret(const ByteCode *codes, size_t num_codes) {
+  status_ = EvalStatus::GetSuccess();
+  // Allocations sized by the program, like arrays and map growth, can fail
+  // without anything else being wrong.
+  try {
+    return InterpretCodes(codes, num_codes);
+  } catch (const std::bad_alloc &) {
+    return Fail(EVAL_FAIL_OUT_OF_MEMORY, "Not enough memory");
+  }
 }
 
-void ByteCodeEvaluator::Interpret(const std::vector<ByteCode> &codes) {
+bool ByteCodeEvaluator::InterpretCodes(const ByteCode *codes,
+                                       size_t num_codes) {
   int64_t i = 0;
-  while (i < codes.size()) {
+  while (i < num_codes) {
     const ByteCode &code = codes[i];
 
     // This is always an instruction
     switch (code.instr) {
       case INSTR_PUSH:
-        assert(i <= codes.size() - 1 && "Expected at least one more code");
+        assert(i + 1 < num_codes && "Expected at least one more code");
         eval_stack_.push_back(codes[i + 1].value);
 
         SafeSignedInplaceAdd(i, 2);
@@ -240,6 +634,33 @@ void ByteCodeEvaluator::Interpret(const std::vector<ByteCode> &codes) {
         SafeSignedInc(i);
         break;
       }
+      case INSTR_ADD_F: {
+        double rhs = BitsToFloat(PopValue());
+        double lhs = BitsToFloat(PopValue());
+        eval_stack_.push_back(FloatToBits(lhs + rhs));
+
+        SafeSignedInc(i);
+        break;
+      }
+      case INSTR_SUB_F: {
+        double rhs = BitsToFloat(PopValue());
+        double lhs = BitsToFloat(PopValue());
+        eval_stack_.push_back(FloatToBits(lhs - rhs));
+
+        SafeSignedInc(i);
+        break;
+      }
+      case INSTR_INT_TO_FLOAT: {
+        assert(i + 1 < num_codes && "Expected at least one more code");
+        int64_t depth = codes[i + 1].value;
+        assert(depth >= 0 && depth < eval_stack_.size() &&
+               "Expected a value at this depth on the eval stack.");
+        int64_t &val = eval_stack_[eval_stack_.size() - 1 - depth];
+        val = FloatToBits(static_cast<double>(val));
+
+        SafeSignedInplaceAdd(i, 2);
+        break;
+      }
       case INSTR_CALL:
         assert(0 && "Calls not yet supported");
         break;
@@ -252,26 +673,349 @@ void ByteCodeEvaluator::Interpret(const std::vector<ByteCode> &codes) {
         uint64_t dst_id = eval_stack_.back();
         eval_stack_.pop_back();
 
-        assert(symbol_table_.find(dst_id) != symbol_table_.end() &&
-               "Found unknown symbol ID");
+        assert(dst_id < symbol_table_.size() && "Found unknown symbol ID");
         symbol_table_[dst_id] = val;
 
         SafeSignedInc(i);
         break;
       }
       case INSTR_LOAD: {
-        assert(i <= codes.size() - 1 && "Expected at least one more code");
+        assert(i + 1 < num_codes && "Expected at least one more code");
         uint64_t load_id = codes[i + 1].value;
 
-        assert(symbol_table_.find(load_id) != symbol_table_.end() &&
-               "Found unknown symbol ID");
-        eval_stack_.push_back(symbol_table_.at(load_id));
+        assert(load_id < symbol_table_.size() && "Found unknown symbol ID");
+        eval_stack_.push_back(symbol_table_[load_id]);
+
+        SafeSignedInplaceAdd(i, 2);
+        break;
+      }
+      case INSTR_LOAD_LOCAL: {
+        assert(i + 1 < num_codes && "Expected at least one more code");
+        uint64_t slot = codes[i + 1].value;
+        assert(slot < locals_.size() && "Found unknown local slot");
+        eval_stack_.push_back(locals_[slot]);
+
+        SafeSignedInplaceAdd(i, 2);
+        break;
+      }
+      case INSTR_STORE_LOCAL: {
+        assert(i + 1 < num_codes && "Expected at least one more code");
+        uint64_t slot = codes[i + 1].value;
+        assert(slot < locals_.size() && "Found unknown local slot");
+        locals_[slot] = PopValue();
+
+        SafeSignedInplaceAdd(i, 2);
+        break;
+      }
+      case INSTR_ARRAY_MAKE: {
+        int64_t len = PopValue();
+        if (len < 0) {
+          return Fail(EVAL_FAIL_NEGATIVE_LENGTH,
+                      "Cannot make an array of length " + std::to_string(len));
+        }
+        int64_t handle;
+        if (!MakeArray(len, handle)) return false;
+        eval_stack_.push_back(handle);
+
+        SafeSignedInc(i);
+        break;
+      }
+      case INSTR_ARRAY_GET: {
+        int64_t idx = PopValue();
+        const std::vector<int64_t> &array = getArray(PopValue());
+        if (idx < 0 || idx >= array.size()) {
+          return Fail(EVAL_FAIL_INDEX_OUT_OF_RANGE,
+                      "Array index " + std::to_string(idx) + " out of range");
+        }
+        eval_stack_.push_back(array[idx]);
+
+        SafeSignedInc(i);
+        break;
+      }
+      case INSTR_ARRAY_SET: {
+        int64_t val = PopValue();
+        int64_t idx = PopValue();
+        std::vector<int64_t> &array = getMutableArray(PopValue());
+        if (idx < 0 || idx >= array.size()) {
+          return Fail(EVAL_FAIL_INDEX_OUT_OF_RANGE,
+                      "Array index " + std::to_string(idx) + " out of range");
+        }
+        array[idx] = val;
+
+        SafeSignedInc(i);
+        break;
+      }
+      case INSTR_ARRAY_SUM: {
+        const std::vector<int64_t> &array = getArray(PopValue());
+        eval_stack_.push_back(SumInts(array.data(), array.size()));
+
+        SafeSignedInc(i);
+        break;
+      }
+      case INSTR_ARRAY_VADD: {
+        int64_t rhs_handle = PopValue();
+        int64_t lhs_handle = PopValue();
+        if (getArray(lhs_handle).size() != getArray(rhs_handle).size()) {
+          return Fail(EVAL_FAIL_LENGTH_MISMATCH,
+                      "Cannot add arrays of lengths " +
+                          std::to_string(getArray(lhs_handle).size()) +
+                          " and " +
+                          std::to_string(getArray(rhs_handle).size()));
+        }
+
+        // Make the result first since it may reallocate the array storage.
+        int64_t dst_handle;
+        if (!MakeArray(getArray(lhs_handle).size(), dst_handle)) return false;
+        const std::vector<int64_t> &lhs = getArray(lhs_handle);
+        const std::vector<int64_t> &rhs = getArray(rhs_handle);
+        AddInts(lhs.data(), rhs.data(), getMutableArray(dst_handle).data(),
+                lhs.size());
+        eval_stack_.push_back(dst_handle);
+
+        SafeSignedInc(i);
+        break;
+      }
+      case INSTR_MAP_NEW:
+        eval_stack_.push_back(maps_.size());
+        maps_.emplace_back();
+
+        SafeSignedInc(i);
+        break;
+      case INSTR_MAP_PUT: {
+        assert(i + 1 < num_codes && "Expected at least one more code");
+        int64_t val = PopValue();
+        int64_t key = PopValue();
+        getMap(PopValue()).Put(key, codes[i + 1].value, val);
+
+        SafeSignedInplaceAdd(i, 2);
+        break;
+      }
+      case INSTR_MAP_LOOKUP: {
+        assert(i + 1 < num_codes && "Expected at least one more code");
+        int64_t key = PopValue();
+        const int64_t *val = getMap(PopValue()).Find(key, codes[i + 1].value);
+        if (!val) return Fail(EVAL_FAIL_KEY_NOT_FOUND, "Key not found in map");
+        eval_stack_.push_back(*val);
 
         SafeSignedInplaceAdd(i, 2);
         break;
       }
     }
   }
+  return true;
+}
+
+namespace {
+
+// Keep the objects in `heap` that the globals in `roots` hold, in the order
+// the globals are listed, and point the globals at their new positions.
+template <typename T>
+void CompactHeap(std::vector<T> &heap, std::vector<int64_t> &symbol_table,
+                 const std::vector<SymbolHandle> &roots) {
+  std::vector<int64_t> moved_to(heap.size(), -1);
+  std::vector<T> kept;
+  for (SymbolHandle root : roots) {
+    int64_t &handle = symbol_table[root.getSlot()];
+    assert(handle >= 0 && handle < heap.size() && "Unknown handle in a global");
+    if (moved_to[handle] < 0) {
+      moved_to[handle] = kept.size();
+      kept.push_back(std::move(heap[handle]));
+    }
+    handle = moved_to[handle];
+  }
+  heap.swap(kept);
+}
+
+}  // namespace
+
+void ByteCodeEvaluator::CollectGarbage(
+    const std::vector<SymbolHandle> &array_globals,
+    const std::vector<SymbolHandle> &map_globals) {
+  assert(eval_stack_.empty() && "Values on the eval stack would dangle");
+  CompactHeap(arrays_, symbol_table_, array_globals);
+  CompactHeap(maps_, symbol_table_, map_globals);
+}
+
+void ByteCodeEvaluator::InitializeImage(const ProgramImage &image) {
+  constants_.clear();
+  image_ = &image;
+  InitializeSymbolTable(image.getNumSymbols());
+  InitializeLocals(image.getNumLocals());
+}
+
+bool ByteCodeEvaluator::InterpretImage() {
+  assert(image_ && "No image to interpret");
+  return Interpret(image_->getByteCode(), image_->getNumByteCodes());
+}
+
+bool ByteCodeEvaluator::InterpretMemoized(
+    const std::vector<ByteCode> &codes,
+    const std::vector<MemoizableStmt> &stmts) {
+  return InterpretMemoized(codes.data(), codes.size(), stmts);
+}
+
+bool ByteCodeEvaluator::InterpretMemoized(
+    const ByteCode *codes, size_t num_codes,
+    const std::vector<MemoizableStmt> &stmts) {
+  if (!max_memo_entries_) {
+    return Interpret(codes, num_codes);
+  }
+
+  uint64_t i = 0;
+  for (const MemoizableStmt &stmt : stmts) {
+    assert(stmt.begin >= i && stmt.end <= num_codes &&
+           "Memoizable statements must be in order and in the byte code");
+    if (!Interpret(codes + i, stmt.begin - i)) return false;
+    i = stmt.end;
+
+    memo_key_.code_hash = stmt.code_hash;
+    memo_key_.code.assign(codes + stmt.begin, codes + stmt.end);
+    memo_key_.values.clear();
+    for (uint64_t symbol : stmt.symbols) {
+      assert(symbol < symbol_table_.size() && "Found unknown symbol ID");
+      memo_key_.values.push_back(symbol_table_[symbol]);
+    }
+    auto found = memo_.find(memo_key_);
+    if (found != memo_.end()) {
+      ++memo_hits_;
+      eval_stack_.push_back(found->second);
+      continue;
+    }
+
+    ++memo_misses_;
+    if (!Interpret(codes + stmt.begin, stmt.end - stmt.begin)) return false;
+    if (memo_.size() >= max_memo_entries_) memo_.clear();
+    memo_.emplace(memo_key_, eval_stack_.back());
+  }
+  return Interpret(codes + i, num_codes - i);
+}
+
+bool ByteCodeEvaluator::InterpretImageMemoized(
+    const std::vector<MemoizableStmt> &stmts) {
+  assert(image_ && "No image to interpret");
+  return InterpretMemoized(image_->getByteCode(), image_->getNumByteCodes(),
+                           stmts);
+}
+
+size_t ByteCodeEvaluator::MemoKeyHash::operator()(const MemoKey &key) const {
+  uint64_t hash = key.code_hash;
+  for (int64_t val : key.values) hash = MixHash(hash, val);
+  return hash;
+}
+
+void ByteCodeEvaluator::getStr(int64_t val, const char *&chars,
+                               size_t &len) const {
+  if (image_) {
+    chars = image_->getConstantChars(val);
+    len = image_->getConstantLen(val);
+    return;
+  }
+  assert(val >= 0 && val < constants_.size() && "Unknown str constant");
+  chars = constants_[val].getStrID();
+  len = constants_[val].getStrLen();
+}
+
+void ByteCodeEvaluator::DumpValue(std::ostream &out, int64_t val,
+                                  TypeKind kind) const {
+  switch (kind) {
+    case TYPE_INT:
+      out << val;
+      break;
+    case TYPE_FLOAT: {
+      char buf[32];
+      out.write(buf, FormatFloat(BitsToFloat(val), buf, sizeof(buf)));
+      break;
+    }
+    case TYPE_STR: {
+      const char *chars;
+      size_t len;
+      getStr(val, chars, len);
+      out.write(chars, len);
+      break;
+    }
+    case TYPE_ARRAY: {
+      out << "[";
+      const std::vector<int64_t> &array = getArray(val);
+      for (size_t i = 0; i < array.size(); ++i) {
+        if (i) out << ", ";
+        out << array[i];
+      }
+      out << "]";
+      break;
+    }
+    case TYPE_MAP:
+      out << "<map of " << maps_[val].size() << ">";
+      break;
+    case TYPE_FUNC:
+      out << "<func>";
+      break;
+  }
+}
+
+std::vector<MemoizableStmt> ByteCodeEmitter::FindMemoizableStmts() const {
+  std::vector<MemoizableStmt> stmts;
+  for (size_t s = 0; s < stmt_locs_.size(); ++s) {
+    uint64_t begin = stmt_locs_[s].offset;
+    uint64_t end = s + 1 < stmt_locs_.size() ? stmt_locs_[s + 1].offset
+                                             : byte_code_.size();
+    if (end - begin < kMinMemoizedCodes) continue;
+
+    // Step through the statement keeping track of how many values it has on
+    // the stack, stopping at anything with a side effect.
+    MemoizableStmt stmt{begin, end, 0, {}};
+    std::vector<int64_t> written_locals;
+    int64_t depth = 0;
+    bool pure = true;
+    for (uint64_t i = begin; i < end && pure;) {
+      Instruction instr = byte_code_[i].instr;
+      int64_t operand = i + 1 < end ? byte_code_[i + 1].value : -1;
+      switch (instr) {
+        case INSTR_PUSH:
+          ++depth;
+          i += 2;
+          break;
+        case INSTR_ADD_OP:
+        case INSTR_SUB_OP:
+        case INSTR_ADD_F:
+        case INSTR_SUB_F:
+          pure = depth-- >= 2;
+          ++i;
+          break;
+        case INSTR_INT_TO_FLOAT:
+          pure = operand >= 0 && operand < depth;
+          i += 2;
+          break;
+        case INSTR_LOAD:
+          stmt.symbols.push_back(operand);
+          ++depth;
+          i += 2;
+          break;
+        case INSTR_LOAD_LOCAL:
+          pure = std::find(written_locals.begin(), written_locals.end(),
+                           operand) != written_locals.end();
+          ++depth;
+          i += 2;
+          break;
+        case INSTR_STORE_LOCAL:
+          pure = depth-- >= 1;
+          written_locals.push_back(operand);
+          i += 2;
+          break;
+        default:
+          pure = false;
+          break;
+      }
+    }
+    if (!pure || depth != 1) continue;
+
+    for (uint64_t i = begin; i < end; ++i)
+      stmt.code_hash = MixHash(stmt.code_hash, byte_code_[i].value);
+    std::sort(stmt.symbols.begin(), stmt.symbols.end());
+    stmt.symbols.erase(std::unique(stmt.symbols.begin(), stmt.symbols.end()),
+                       stmt.symbols.end());
+    stmts.push_back(std::move(stmt));
+  }
+  return stmts;
 }
 
 void ByteCodeEmitter::DumpByteCode(std::ostream &out) const {
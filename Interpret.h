@@ -5,6 +5,7 @@
 #include <unordered_map>
 
 #include "Parser.h"
+#include "ValueMap.h"
 
 namespace lang {
 
@@ -22,6 +23,7 @@ class ASTVisitor {
     VisitNodeSequence(node.getNodes());
   }
   virtual void VisitInt(const Int &) {}
+  virtual void VisitFloat(const Float &) {}
   virtual void VisitStr(const Str &) {}
   virtual void VisitID(const ID &) {}
   virtual void VisitCall(const Call &node) {
@@ -32,6 +34,10 @@ class ASTVisitor {
     Visit(node.getSrc());
     Visit(node.getDst());
   }
+  virtual void VisitLet(const Let &node) {
+    Visit(node.getVal());
+    Visit(node.getBody());
+  }
   virtual void VisitBinOp(const BinOp &node) {
     Visit(node.getLHS());
     Visit(node.getRHS());
@@ -41,10 +47,16 @@ class ASTVisitor {
 
 enum TypeKind {
   TYPE_INT,
+  TYPE_FLOAT,
   TYPE_STR,
   TYPE_FUNC,
+  TYPE_ARRAY,
+  TYPE_MAP,
 };
 
+// Like "int" or "array".
+const char *getTypeName(TypeKind type);
+
 class Type {
  public:
   virtual ~Type() {}
@@ -96,6 +108,19 @@ class IntType : public Type {
   }
 };
 
+class FloatType : public Type {
+ public:
+  static TypeKind Kind;
+
+  FloatType() : Type(Kind) {}
+
+  Type *Copy() const override { return SafeNew<FloatType>(); }
+
+  bool equals(const Type &other) const override {
+    return other.getKind() == Kind;
+  }
+};
+
 class StrType : public Type {
  public:
   static TypeKind Kind;
@@ -109,6 +134,36 @@ class StrType : public Type {
   }
 };
 
+// A fixed length sequence of ints. At evaluation time, this is represented as a
+// handle into the evaluator's array storage.
+class ArrayType : public Type {
+ public:
+  static TypeKind Kind;
+
+  ArrayType() : Type(Kind) {}
+
+  Type *Copy() const override { return SafeNew<ArrayType>(); }
+
+  bool equals(const Type &other) const override {
+    return other.getKind() == Kind;
+  }
+};
+
+// A hash map from ints or strs to ints. At evaluation time, this is represented
+// as a handle into the evaluator's map storage.
+class MapType : public Type {
+ public:
+  static TypeKind Kind;
+
+  MapType() : Type(Kind) {}
+
+  Type *Copy() const override { return SafeNew<MapType>(); }
+
+  bool equals(const Type &other) const override {
+    return other.getKind() == Kind;
+  }
+};
+
 class FuncType : public Type {
  public:
   static TypeKind Kind;
@@ -153,6 +208,7 @@ class FuncType : public Type {
 };
 
 class FunctionValue;
+class ProgramImage;
 
 /**
  * Represents a value that we can determine during evaluation. This is pretty
@@ -160,9 +216,10 @@ class FunctionValue;
  */
 class Evaluatable {
  public:
-  static Evaluatable &&GetInt(int32_t val);
-  static Evaluatable &&GetStr(const std::string &val);
-  static Evaluatable &&GetFunc(unique<Type> type, unique<FunctionValue> func);
+  static Evaluatable GetInt(int32_t val);
+  static Evaluatable GetFloat(double val);
+  static Evaluatable GetStr(const std::string &val);
+  static Evaluatable GetFunc(unique<Type> type, unique<FunctionValue> func);
 
   Evaluatable(const Evaluatable &other);
   Evaluatable operator=(const Evaluatable &other) const {
@@ -180,6 +237,13 @@ class Evaluatable {
     return val_.int_val;
   }
 
+  bool isFloatType() const { return type_->getKind() == TYPE_FLOAT; }
+  double getFloatVal() const {
+    assert(isFloatType() &&
+           "Cannot get a float value from one that is not a float type");
+    return val_.float_val;
+  }
+
   bool isFuncType() const { return type_->getKind() == TYPE_FUNC; }
   FunctionValue &getFunc() const;
 
@@ -216,6 +280,7 @@ class Evaluatable {
 
   union Value {
     int32_t int_val;
+    double float_val;
 
     // Small inline representation of a sequence of characters.
     struct {
@@ -289,11 +354,58 @@ enum Instruction : int64_t {
   INSTR_ADD_OP,
   INSTR_SUB_OP,
 
+  // Same as above, but the operands are floats stored in the bits of the
+  // stack values.
+  INSTR_ADD_F,
+  INSTR_SUB_F,
+
+  // Convert the int value at some depth from the top of the evaluation stack to
+  // a float. The code after this is the depth, where 0 is the top of the stack.
+  INSTR_INT_TO_FLOAT,
+
   INSTR_CALL,
   INSTR_STORE,
   INSTR_LOAD,
+
+  // Local variables live in fixed slots of the current frame. The code after
+  // these is the slot index. STORE_LOCAL pops the value it stores.
+  INSTR_LOAD_LOCAL,
+  INSTR_STORE_LOCAL,
+
+  // Array builtins. These take their arguments from the top of the evaluation
+  // stack in the order they were written.
+  INSTR_ARRAY_MAKE,  // (make n) -> array of n zeros
+  INSTR_ARRAY_GET,   // (get a i) -> a[i]
+  INSTR_ARRAY_SET,   // (set a i v) -> nothing
+  INSTR_ARRAY_SUM,   // (sum a) -> a[0] + ... + a[n-1]
+  INSTR_ARRAY_VADD,  // (vadd a b) -> new array where c[i] = a[i] + b[i]
+
+  // Map builtins. The code after a PUT or LOOKUP is the TypeKind of the key so
+  // int keys and str keys with the same value do not collide. Str keys are
+  // compared by their constant ID since str constants are interned.
+  INSTR_MAP_NEW,     // (map) -> empty map
+  INSTR_MAP_PUT,     // (put m k v) -> nothing
+  INSTR_MAP_LOOKUP,  // (lookup m k) -> value at k
 };
 
+// Floats are stored on the evaluation stack and in the byte code as their bit
+// patterns.
+inline int64_t FloatToBits(double val) {
+  int64_t bits;
+  memcpy(&bits, &val, sizeof(bits));
+  return bits;
+}
+
+inline double BitsToFloat(int64_t bits) {
+  double val;
+  memcpy(&val, &bits, sizeof(val));
+  return val;
+}
+
+// Write `val` into `buf` with the fewest significant digits that read back as
+// the same double, like `2.5` or `1234567.5`. Returns the length written.
+int FormatFloat(double val, char *buf, size_t size);
+
 union ByteCode {
   Instruction instr;
   int64_t value;
@@ -318,23 +430,236 @@ union ByteCode {
   void Dump(std::ostream &out) const { out << value; }
 };
 
+// A function call emitted as its own instruction instead of an INSTR_CALL.
+struct Builtin {
+  const char *name;
+  Instruction instr;
+  unsigned num_args;
+
+  // Whether this leaves a value on the eval stack and what type it is.
+  bool has_result;
+  TypeKind result_type;
+
+  // If not negative, the type of this argument is emitted as an operand after
+  // the instruction. It can be an int or a str.
+  int typed_arg;
+
+  // The types of the other arguments.
+  TypeKind arg_types[3];
+};
+
+// Returns null if `name` is not a builtin.
+const Builtin *LookupBuiltin(const std::string &name);
+
+enum CheckStatusKind {
+  CHECK_SUCCESS,
+
+  // A name that is not a local or a global is read.
+  CHECK_FAIL_UNKNOWN_NAME,
+
+  // Something other than a builtin is called.
+  CHECK_FAIL_NOT_CALLABLE,
+
+  // Something other than a name is assigned to.
+  CHECK_FAIL_INVALID_ASSIGN,
+
+  // A builtin is called with the wrong number of arguments.
+  CHECK_FAIL_WRONG_NUM_ARGS,
+
+  // An operand or argument has a type it cannot have, or has no value at all.
+  CHECK_FAIL_TYPE_MISMATCH,
+};
+
+class CheckStatus {
+ public:
+  CheckStatusKind getKind() const { return kind_; }
+  bool isSuccessful() const { return kind_ == CHECK_SUCCESS; }
+
+  // Where and why the check failed, like "1:4: Unknown name y".
+  const std::string &getMessage() const {
+    assert(!isSuccessful() && "Cannot get the reason we failed if we did not");
+    return message_;
+  }
+
+  static CheckStatus GetSuccess();
+  static CheckStatus GetFailure(CheckStatusKind kind, SourceLocation loc,
+                                const std::string &reason);
+
+ private:
+  // Does nothing, but we do not want to accidentally create a new CheckStatus
+  // without any of the static getters.
+  CheckStatus() {}
+
+  CheckStatusKind kind_;
+  std::string message_;
+};
+
+enum EvalStatusKind {
+  EVAL_SUCCESS,
+
+  // An array is read or written outside of its bounds.
+  EVAL_FAIL_INDEX_OUT_OF_RANGE,
+
+  // An array is made with a negative length.
+  EVAL_FAIL_NEGATIVE_LENGTH,
+
+  // Arrays of different lengths are added.
+  EVAL_FAIL_LENGTH_MISMATCH,
+
+  // A key that is not in a map is looked up.
+  EVAL_FAIL_KEY_NOT_FOUND,
+
+  // An array is too large to allocate.
+  EVAL_FAIL_OUT_OF_MEMORY,
+};
+
+/**
+ * Why evaluation stopped early. These depend on the values a program computes,
+ * so unlike a CheckStatus they cannot be found before it runs.
+ */
+class EvalStatus {
+ public:
+  EvalStatusKind getKind() const { return kind_; }
+  bool isSuccessful() const { return kind_ == EVAL_SUCCESS; }
+
+  // Why evaluation failed, like "Array index 5 out of range".
+  const std::string &getMessage() const {
+    assert(!isSuccessful() && "Cannot get the reason we failed if we did not");
+    return message_;
+  }
+
+  static EvalStatus GetSuccess();
+  static EvalStatus GetFailure(EvalStatusKind kind, const std::string &reason);
+
+ private:
+  // Does nothing, but we do not want to accidentally create a new EvalStatus
+  // without any of the static getters.
+  EvalStatus() {}
+
+  EvalStatusKind kind_;
+  std::string message_;
+};
+
+/**
+ * A global resolved ahead of time. Hosts that read or write the same globals
+ * on every run resolve each name to a handle once, then use the handle to
+ * index the evaluator's symbol table directly without hashing the name.
+ */
+class SymbolHandle {
+ public:
+  // Makes an invalid handle.
+  SymbolHandle() {}
+  explicit SymbolHandle(uint64_t slot) : slot_(slot) {}
+
+  bool isValid() const { return slot_ != kInvalidSlot; }
+  uint64_t getSlot() const { return slot_; }
+
+ private:
+  static constexpr uint64_t kInvalidSlot = ~uint64_t(0);
+
+  uint64_t slot_ = kInvalidSlot;
+};
+
+/**
+ * A top-level statement whose value only depends on the globals it reads, so
+ * running it again with the same values of them can be skipped. These only
+ * push constants, do arithmetic, read globals, and use locals they wrote
+ * themselves, and they leave exactly one value.
+ */
+struct MemoizableStmt {
+  uint64_t begin, end;            // Where its byte code is.
+  uint64_t code_hash;             // Of its byte code, for lookups.
+  std::vector<uint64_t> symbols;  // The globals it reads.
+};
+
+class IRFunction;
+
 class ByteCodeEmitter : public ASTVisitor {
  public:
+  // Check that byte code can be emitted for `node` after the code already
+  // emitted, with the globals and types known so far. ConvertToByteCode()
+  // asserts on anything this rejects, so code from untrusted sources should be
+  // checked first.
+  CheckStatus Check(const Node &node) const;
+
   void ConvertToByteCode(const Node &node);
+
+  // Lower IR built with BuildIR() to byte code. Symbols, constants, locals,
+  // and result types are added to the ones we already have just like when
+  // emitting from the AST. Defined in IRLowering.cpp.
+  void ConvertToByteCode(const IRFunction &func);
   const std::vector<ByteCode> &getByteCode() const { return byte_code_; }
   const std::vector<Evaluatable> &getConstants() const { return constants_; }
   const std::unordered_map<std::string, uint64_t> &getSymbols() const {
     return symbols_;
   }
 
+  // The types of the values left on the evaluation stack after evaluating the
+  // emitted byte code, from the bottom of the stack to the top.
+  const std::vector<TypeKind> &getResultTypes() const { return type_stack_; }
+
+  // Where each top-level statement starts in the byte code and in the source,
+  // in the order they were emitted. Code lowered from the IR counts as one
+  // statement with no location since its statements can be interleaved.
+  struct StmtLocation {
+    uint64_t offset;
+    SourceLocation loc;
+  };
+  const std::vector<StmtLocation> &getStmtLocations() const {
+    return stmt_locs_;
+  }
+
+  // The statements in the emitted byte code that can be memoized, in order.
+  // Only statements in getStmtLocations() are considered.
+  std::vector<MemoizableStmt> FindMemoizableStmts() const;
+
   uint64_t getSymbolID(const std::string &symbol) const {
     return symbols_.at(symbol);
   }
 
+  // Returns an invalid handle if there is no global with this name.
+  SymbolHandle ResolveSymbol(const std::string &symbol) const {
+    auto found = symbols_.find(symbol);
+    if (found == symbols_.end()) return SymbolHandle();
+    return SymbolHandle(found->second);
+  }
+
+  // The type of the value last stored in a global by the emitted code.
+  TypeKind getSymbolType(SymbolHandle handle) const {
+    return symbol_types_.at(handle.getSlot());
+  }
+
+  // Declare a global the code we emit may read before it assigns to it, like
+  // an input set by the host. Returns its symbol ID.
+  uint64_t DeclareSymbol(const std::string &name, TypeKind type) {
+    if (!uniqueSymbolExists(name)) makeUniqueSymbolID(name);
+    uint64_t symbol = getUniqueSymbolID(name);
+    symbol_types_[symbol] = type;
+    return symbol;
+  }
+
+  // The number of local slots a frame needs to evaluate the emitted byte code.
+  uint64_t getNumLocals() const { return num_locals_; }
+
   void ResetComponents() {
     byte_code_.clear();
     symbols_.clear();
     constants_.clear();
+    interned_strs_.clear();
+    symbol_types_.clear();
+    type_stack_.clear();
+    scopes_.clear();
+    stmt_locs_.clear();
+    num_locals_ = 0;
+  }
+
+  // Drop the emitted byte code and the results it would leave on the eval
+  // stack, but keep the symbols and constants so more code can be emitted that
+  // refers to them.
+  void ResetByteCode() {
+    byte_code_.clear();
+    type_stack_.clear();
+    stmt_locs_.clear();
   }
 
   void DumpByteCode(std::ostream &) const;
@@ -342,10 +667,12 @@ class ByteCodeEmitter : public ASTVisitor {
  private:
   void VisitModule(const Module &module) override;
   void VisitInt(const Int &) override;
+  void VisitFloat(const Float &) override;
   void VisitStr(const Str &) override;
   void VisitID(const ID &) override;
   void VisitCall(const Call &) override;
   void VisitAssign(const Assign &) override;
+  void VisitLet(const Let &) override;
   void VisitBinOp(const BinOp &) override;
 
   void PushBackInstr(Instruction instr) {
@@ -358,6 +685,26 @@ class ByteCodeEmitter : public ASTVisitor {
 
   uint64_t getUniqueConstantID(const std::string &str);
 
+  // We keep track of the types of the values that will be on the evaluation
+  // stack as we emit code for them. This lets us pick instructions based on
+  // the types of their operands.
+  void PushType(TypeKind kind) { type_stack_.push_back(kind); }
+  TypeKind PopType() {
+    assert(!type_stack_.empty() && "Expected a type on the type stack.");
+    TypeKind kind = type_stack_.back();
+    type_stack_.pop_back();
+    return kind;
+  }
+
+  // Emit `node`, which must leave exactly one value, and pop its type.
+  TypeKind VisitValue(const Node &node) {
+    size_t num_types = type_stack_.size();
+    Visit(node);
+    assert(type_stack_.size() == num_types + 1 &&
+           "Expected an expression with a value.");
+    return PopType();
+  }
+
   uint64_t getUniqueSymbolID(const std::string &name) const;
   void makeUniqueSymbolID(const std::string &name);
   bool uniqueSymbolExists(const std::string &name) const;
@@ -365,14 +712,36 @@ class ByteCodeEmitter : public ASTVisitor {
   std::unordered_map<std::string, uint64_t> symbols_;
   std::vector<ByteCode> byte_code_;
   std::vector<Evaluatable> constants_;
+  std::unordered_map<std::string, uint64_t> interned_strs_;
+
+  // The type of the value last stored in each symbol.
+  std::unordered_map<uint64_t, TypeKind> symbol_types_;
+  std::vector<TypeKind> type_stack_;
+  std::vector<StmtLocation> stmt_locs_;
+
+  // Local variables that are in scope, from outermost to innermost. Each one
+  // occupies the slot matching its position here, so slots are reused once a
+  // scope ends.
+  struct LocalVar {
+    std::string name;
+    TypeKind type;
+  };
+  std::vector<LocalVar> scopes_;
+  uint64_t num_locals_ = 0;
+
+  // Returns the slot of the innermost local with this name or -1 if the name
+  // does not refer to a local.
+  int64_t FindLocal(const std::string &name) const;
 };
 
 class ByteCodeEvaluator {
  public:
   ByteCodeEvaluator(const std::vector<Evaluatable> &constants,
-                    const std::unordered_map<std::string, uint64_t> &symbols)
+                    const std::unordered_map<std::string, uint64_t> &symbols,
+                    uint64_t num_locals = 0)
       : constants_(constants) {
     InitializeSymbolTable(symbols);
+    InitializeLocals(num_locals);
   }
   ByteCodeEvaluator() {}
 
@@ -380,27 +749,208 @@ class ByteCodeEvaluator {
     constants_ = constants;
   }
 
+  // Symbol IDs are dense, so every global gets the slot matching its ID.
   void InitializeSymbolTable(
       const std::unordered_map<std::string, uint64_t> &symbols) {
-    for (auto it = symbols.begin(); it != symbols.end(); ++it) {
-      symbol_table_[it->second] = 0;
-    }
+    InitializeSymbolTable(symbols.size());
+  }
+
+  void InitializeSymbolTable(uint64_t num_symbols) {
+    symbol_table_.assign(num_symbols, 0);
+  }
+
+  void InitializeLocals(uint64_t num_locals) { locals_.assign(num_locals, 0); }
+
+  // Make room for symbols, locals, and constants that were added to the same
+  // emitter since this was initialized, keeping the values we already have.
+  void GrowSymbolTable(uint64_t num_symbols) {
+    if (num_symbols > symbol_table_.size()) symbol_table_.resize(num_symbols);
+  }
+  void GrowLocals(uint64_t num_locals) {
+    if (num_locals > locals_.size()) locals_.resize(num_locals);
+  }
+  void AppendNewConstants(const std::vector<Evaluatable> &constants) {
+    assert(constants.size() >= constants_.size() &&
+           "Constants can only be appended");
+    constants_.insert(constants_.end(), constants.begin() + constants_.size(),
+                      constants.end());
+  }
+
+  void ClearEvalStack() { eval_stack_.clear(); }
+
+  // Free every array and map not held by one of `array_globals` or
+  // `map_globals`, and renumber the rest so their handles stay dense. The
+  // globals are updated to the new handles. Anything else holding a handle,
+  // like the eval stack or a local, is left dangling, so this is only safe
+  // between statements.
+  void CollectGarbage(const std::vector<SymbolHandle> &array_globals,
+                      const std::vector<SymbolHandle> &map_globals);
+  size_t getNumArrays() const { return arrays_.size(); }
+  size_t getNumMaps() const { return maps_.size(); }
+
+  // Drop everything a previous run of a program left behind except the values
+  // of globals, so the same program can be run again.
+  void ResetRunState() {
+    eval_stack_.clear();
+    arrays_.clear();
+    maps_.clear();
+  }
+
+  // Read or write a global through a handle resolved from the emitter or
+  // program image this evaluator was initialized with.
+  int64_t getValue(SymbolHandle handle) const {
+    assert(handle.getSlot() < symbol_table_.size() && "Invalid symbol handle");
+    return symbol_table_[handle.getSlot()];
   }
+  void setValue(SymbolHandle handle, int64_t val) {
+    assert(handle.getSlot() < symbol_table_.size() && "Invalid symbol handle");
+    symbol_table_[handle.getSlot()] = val;
+  }
+
+  // Prepare to run a compiled program image in place. Nothing in the image is
+  // copied, so it must outlive this evaluator. Only the symbol table and locals
+  // are allocated here.
+  void InitializeImage(const ProgramImage &image);
 
   void ResetComponents() {
     eval_stack_.clear();
     constants_.clear();
+    image_ = nullptr;
     symbol_table_.clear();
+    locals_.clear();
+    arrays_.clear();
+    maps_.clear();
   }
 
-  void Interpret(const std::vector<ByteCode> &codes);
+  // Returns false if the code stopped on a failure that depends on the values
+  // it computed, like indexing past the end of an array. getStatus() says why.
+  // The eval stack, globals, arrays, and maps are left as they were when it
+  // stopped.
+  bool Interpret(const std::vector<ByteCode> &codes) {
+    return Interpret(codes.data(), codes.size());
+  }
+
+  // Run byte code that lives outside of a vector, like a mapped .shbc file.
+  bool Interpret(const ByteCode *codes, size_t num_codes);
+
+  // Run the byte code of the image passed to InitializeImage().
+  bool InterpretImage();
+
+  // Why the last run returned false.
+  const EvalStatus &getStatus() const { return status_; }
+
+  // Same as Interpret(), but each of `stmts` that already ran with the same
+  // values of the globals it reads pushes the value it had then instead of
+  // running again. Values are remembered by the byte code of the statement and
+  // the values of those globals. That is all the value depends on, so they
+  // never go stale, even when running other programs. The whole byte code is
+  // compared on a hit, so statements with the same code_hash never share one.
+  bool InterpretMemoized(const std::vector<ByteCode> &codes,
+                         const std::vector<MemoizableStmt> &stmts);
+  bool InterpretMemoized(const ByteCode *codes, size_t num_codes,
+                         const std::vector<MemoizableStmt> &stmts);
+
+  // Same as InterpretImage(), memoizing `stmts` of the image's byte code.
+  bool InterpretImageMemoized(const std::vector<MemoizableStmt> &stmts);
+
+  // At most `max_entries` values are remembered. Once there are that many, all
+  // of them are dropped before remembering another. 0, the default, turns off
+  // memoization so InterpretMemoized() is the same as Interpret().
+  void setMemoCapacity(size_t max_entries) {
+    max_memo_entries_ = max_entries;
+    if (memo_.size() > max_entries) memo_.clear();
+  }
+  size_t getMemoCapacity() const { return max_memo_entries_; }
+
+  size_t getNumMemoHits() const { return memo_hits_; }
+  size_t getNumMemoMisses() const { return memo_misses_; }
+  size_t getNumMemoEntries() const { return memo_.size(); }
 
   const std::vector<int64_t> &getEvalStack() const { return eval_stack_; }
 
+  // Print a value from the eval stack or symbol table as the given type.
+  void DumpValue(std::ostream &out, int64_t val, TypeKind kind) const;
+
+  // The chars of a str value. These are not null terminated if they come from
+  // a program image.
+  void getStr(int64_t val, const char *&chars, size_t &len) const;
+
+  const std::vector<int64_t> &getArray(int64_t handle) const {
+    assert(handle >= 0 && handle < arrays_.size() && "Unknown array handle");
+    return arrays_[handle];
+  }
+
+  size_t getMapSize(int64_t handle) const {
+    assert(handle >= 0 && handle < maps_.size() && "Unknown map handle");
+    return maps_[handle].size();
+  }
+
  private:
+  int64_t PopValue() {
+    assert(!eval_stack_.empty() && "Expected a value on the eval stack.");
+    int64_t val = eval_stack_.back();
+    eval_stack_.pop_back();
+    return val;
+  }
+
+  std::vector<int64_t> &getMutableArray(int64_t handle) {
+    assert(handle >= 0 && handle < arrays_.size() && "Unknown array handle");
+    return arrays_[handle];
+  }
+
+  ValueMap &getMap(int64_t handle) {
+    assert(handle >= 0 && handle < maps_.size() && "Unknown map handle");
+    return maps_[handle];
+  }
+
+  // Returns false with the status set if the array could never be allocated.
+  // Throws bad_alloc if there is not enough memory for it right now.
+  bool MakeArray(size_t len, int64_t &handle);
+
+  // Interpret() without catching bad_alloc.
+  bool InterpretCodes(const ByteCode *codes, size_t num_codes);
+
+  bool Fail(EvalStatusKind kind, const std::string &reason) {
+    status_ = EvalStatus::GetFailure(kind, reason);
+    return false;
+  }
+
   std::vector<int64_t> eval_stack_;
+
+  // Constants come from either a vector we own or a program image we run in
+  // place.
   std::vector<Evaluatable> constants_;
-  std::unordered_map<uint64_t, int64_t> symbol_table_;
+  const ProgramImage *image_ = nullptr;
+  std::vector<int64_t> symbol_table_;
+  std::vector<int64_t> locals_;
+
+  // Every array created during evaluation. Array values on the eval stack are
+  // indices into this.
+  std::vector<std::vector<int64_t>> arrays_;
+
+  // Every map created during evaluation. Map values on the eval stack are
+  // indices into this.
+  std::vector<ValueMap> maps_;
+
+  struct MemoKey {
+    uint64_t code_hash;
+    std::vector<ByteCode> code;   // Of the statement.
+    std::vector<int64_t> values;  // Of the globals the statement reads.
+
+    bool operator==(const MemoKey &other) const {
+      return code_hash == other.code_hash && values == other.values &&
+             code == other.code;
+    }
+  };
+  struct MemoKeyHash {
+    size_t operator()(const MemoKey &key) const;
+  };
+  EvalStatus status_ = EvalStatus::GetSuccess();
+
+  std::unordered_map<MemoKey, int64_t, MemoKeyHash> memo_;
+  MemoKey memo_key_;  // Reused for lookups so they do not allocate.
+  size_t max_memo_entries_ = 0;
+  size_t memo_hits_ = 0, memo_misses_ = 0;
 };
 
 }  // namespace lang
@@ -1,8 +1,76 @@
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+
 #include "Lexer.h"
 #include "Common.h"
 
 namespace lang {
 
+namespace {
+
+// SWAR helpers for converting 8 ASCII digits at a time. The 8 characters are
+// loaded into a single 64-bit word in little-endian order, so the first
+// character of the chunk lands in the lowest byte.
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define LANG_SWAR_DIGITS 1
+
+bool IsEightDigits(uint64_t chunk) {
+  // Every byte must be in the range '0' (0x30) to '9' (0x39). Adding 6 pushes
+  // anything above '9' into the next high nibble.
+  return ((chunk & 0xF0F0F0F0F0F0F0F0) |
+          (((chunk + 0x0606060606060606) & 0xF0F0F0F0F0F0F0F0) >> 4)) ==
+         0x3333333333333333;
+}
+
+uint32_t ParseEightDigits(uint64_t chunk) {
+  // Combine adjacent digits into 2-digit, then 4-digit, then 8-digit values.
+  chunk -= 0x3030303030303030;
+  chunk = (chunk * 10) + (chunk >> 8);
+  chunk = (((chunk & 0x000000FF000000FF) * (100 + (1000000ULL << 32))) +
+           (((chunk >> 16) & 0x000000FF000000FF) * (1 + (10000ULL << 32)))) >>
+          32;
+  return static_cast<uint32_t>(chunk);
+}
+#endif
+
+// Accumulate `digits` (which has `scale` = 10^num_digits) into `val`. Returns
+// false if the result does not fit in an int64_t.
+bool AccumulateDigits(uint64_t &val, uint64_t scale, uint64_t digits) {
+  if (__builtin_mul_overflow(val, scale, &val)) return false;
+  if (__builtin_add_overflow(val, digits, &val)) return false;
+  return val <= static_cast<uint64_t>(std::numeric_limits<int64_t>::max());
+}
+
+// Read the run of digits starting at `current` and store its value in `val`.
+// `current` is left at the first non-digit character. Returns false if the
+// value overflows.
+bool ReadIntLiteral(const std::string &input, int64_t &current, int64_t &val) {
+  uint64_t result = 0;
+  bool fits = true;
+
+#ifdef LANG_SWAR_DIGITS
+  while (current + 8 <= static_cast<int64_t>(input.size())) {
+    uint64_t chunk;
+    memcpy(&chunk, input.data() + current, sizeof(chunk));
+    if (!IsEightDigits(chunk)) break;
+
+    fits &= AccumulateDigits(result, 100000000, ParseEightDigits(chunk));
+    SafeSignedInplaceAdd(current, 8);
+  }
+#endif
+
+  while (isdigit(input[current])) {
+    fits &= AccumulateDigits(result, 10, input[current] - '0');
+    SafeSignedInc(current);
+  }
+
+  val = static_cast<int64_t>(result);
+  return fits;
+}
+
+}  // namespace
+
 SourceLocation::SourceLocation(unsigned row, unsigned col)
     : row(row), col(col) {}
 
@@ -19,8 +87,13 @@ LexStatus LexStatus::GetSuccess() {
 }
 
 LexStatus LexStatus::GetFailure(SourceLocation loc, char c) {
+  return GetFailure(LEX_FAIL, loc, c);
+}
+
+LexStatus LexStatus::GetFailure(LexStatusKind kind, SourceLocation loc,
+                                char c) {
   LexStatus status;
-  status.kind_ = LEX_FAIL;
+  status.kind_ = kind;
   status.loc_ = loc;
   status.failing_char_ = c;
   return status;
@@ -78,22 +151,34 @@ LexStatus ReadTokens(const std::string &input, std::vector<Token> &result) {
       SafeSignedInc(current);
       if (c == '\n') {
         SafeSignedInc(row);
-        current = 0;
+        col = 0;
         continue;
       }
       SafeSignedInc(col);
       continue;
     } else if (isdigit(c)) {
-      std::string str;
-      while (isdigit(c)) {
-        str.push_back(c);
+      int64_t start = current;
+      int64_t val;
+      bool fits = ReadIntLiteral(input, current, val);
+
+      // Floats are digits, a '.', then more digits.
+      if (input[current] == '.' && isdigit(input[current + 1])) {
         SafeSignedInc(current);
-        c = input[current];
+        while (isdigit(input[current])) SafeSignedInc(current);
+
+        int64_t len = current - start;
+        result.emplace_back(TOK_FLOAT, loc, input.substr(start, len));
+        result.back().float_val = strtod(result.back().chars.c_str(), nullptr);
+        SafeSignedInplaceAdd(col, len);
+        continue;
       }
 
-      Token tok(TOK_INT, loc, str);
-      result.push_back(tok);
-      SafeSignedInplaceAdd(col, str.size());
+      if (!fits) return LexStatus::GetFailure(LEX_FAIL_INT_OVERFLOW, loc, c);
+
+      int64_t len = current - start;
+      result.emplace_back(TOK_INT, loc, input.substr(start, len));
+      result.back().int_val = val;
+      SafeSignedInplaceAdd(col, len);
       continue;
     } else if (isalpha(c)) {
       // IDs are composed only of alphabetic characters for now.
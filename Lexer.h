@@ -2,6 +2,7 @@
 #define LEXER_H
 
 #include <cassert>
+#include <cstdint>
 #include <string>
 #include <vector>
 
@@ -36,6 +37,7 @@ enum TokenKind {
 
   // Atoms
   TOK_INT,
+  TOK_FLOAT,
   TOK_STR,
   TOK_ID,
 
@@ -59,6 +61,13 @@ struct Token {
   // If the token is a string, it will not be saved surrounded with the quotes.
   std::string chars;
 
+  // The value of a TOK_INT, converted by the lexer straight from the source
+  // bytes so the parser never has to re-read the digits.
+  int64_t int_val = 0;
+
+  // The value of a TOK_FLOAT.
+  double float_val = 0;
+
   // We do not care about the SourceLocation.
   bool operator==(const Token &other) const {
     return kind == other.kind && chars == other.chars;
@@ -70,6 +79,9 @@ struct Token {
 enum LexStatusKind {
   LEX_SUCCESS,
   LEX_FAIL,
+
+  // An integer literal does not fit in an int64_t.
+  LEX_FAIL_INT_OVERFLOW,
 };
 
 class LexStatus {
@@ -89,6 +101,7 @@ class LexStatus {
 
   static LexStatus GetSuccess();
   static LexStatus GetFailure(SourceLocation loc, char c);
+  static LexStatus GetFailure(LexStatusKind kind, SourceLocation loc, char c);
 
  private:
   // Does nothing, but we do not want to accidentally create a new LexStatus
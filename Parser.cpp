@@ -1,3 +1,4 @@
+#include <limits>
 #include <unordered_map>
 
 #include "Common.h"
@@ -9,9 +10,11 @@ namespace lang {
 NodeKind Module::Kind = NODE_MODULE;
 NodeKind Stmt::Kind = NODE_STMT;
 NodeKind Int::Kind = NODE_INT;
+NodeKind Float::Kind = NODE_FLOAT;
 NodeKind Str::Kind = NODE_STR;
 NodeKind ID::Kind = NODE_ID;
 NodeKind Assign::Kind = NODE_ASSIGN;
+NodeKind Let::Kind = NODE_LET;
 NodeKind BinOp::Kind = NODE_BINOP;
 NodeKind Call::Kind = NODE_CALL;
 
@@ -34,6 +37,9 @@ ParseStatus ReadBinOpOperands(const std::vector<Token> &input, int64_t &current,
   unique<Node> rhs_node(rhs);
 
   // We reached the end of the input without finding an appropriate RPAR.
+  if (current >= input.size())
+    return ParseStatus::GetFailure(PARSE_FAIL_NO_RPAR, input.back());
+
   const Token &tok = input[current];
   if (tok.kind != TOK_RPAR)
     return ParseStatus::GetFailure(PARSE_FAIL_TOO_MANY_BINOP_OPERANDS, tok);
@@ -46,6 +52,43 @@ ParseStatus ReadBinOpOperands(const std::vector<Token> &input, int64_t &current,
   return ParseStatus::GetSuccess();
 }
 
+ParseStatus ReadLetOperands(const std::vector<Token> &input, int64_t &current,
+                            Node **result) {
+  if (current >= input.size())
+    return ParseStatus::GetFailure(PARSE_FAIL_NO_RPAR, input.back());
+
+  SourceLocation start_loc = input[current].loc;
+  const Token &name_tok = input[current];
+  if (name_tok.kind != TOK_ID)
+    return ParseStatus::GetFailure(PARSE_FAIL_INVALID_LET_NAME, name_tok);
+  std::string name = name_tok.chars;
+  SafeSignedInc(current);
+
+  Node *val;
+  ParseStatus status = ReadNode(input, current, &val);
+  if (!status) return status;
+  unique<Node> val_node(val);
+
+  Node *body;
+  status = ReadNode(input, current, &body);
+  if (!status) return status;
+  unique<Node> body_node(body);
+
+  if (current >= input.size())
+    return ParseStatus::GetFailure(PARSE_FAIL_NO_RPAR, input.back());
+
+  const Token &tok = input[current];
+  if (tok.kind != TOK_RPAR)
+    return ParseStatus::GetFailure(PARSE_FAIL_TOO_MANY_LET_OPERANDS, tok);
+
+  // Consume the RPAR
+  SafeSignedInc(current);
+
+  *result = SafeNew<Let>(start_loc, name, std::move(val_node),
+                         std::move(body_node));
+  return ParseStatus::GetSuccess();
+}
+
 ParseStatus ReadCall(const std::vector<Token> &input, int64_t &current,
                      Node **result) {
   SourceLocation start_loc = input[current].loc;
@@ -65,6 +108,8 @@ ParseStatus ReadCall(const std::vector<Token> &input, int64_t &current,
       return ReadBinOpOperands(input, current, result, BINOP_ADD);
     } else if (id_func->getName() == "sub") {
       return ReadBinOpOperands(input, current, result, BINOP_SUB);
+    } else if (id_func->getName() == "let") {
+      return ReadLetOperands(input, current, result);
     }
   }
 
@@ -99,8 +144,21 @@ ParseStatus ReadCall(const std::vector<Token> &input, int64_t &current,
 ParseStatus ReadInt(const std::vector<Token> &input, int64_t &current,
                     Node **result) {
   const Token &tok = input[current];
-  int32_t val = std::stol(tok.chars);
-  *result = SafeNew<Int>(tok.loc, val);
+
+  // The lexer already converted the digits. We just need to make sure the value
+  // fits in an Int node.
+  if (tok.int_val > std::numeric_limits<int32_t>::max())
+    return ParseStatus::GetFailure(PARSE_FAIL_INT_OUT_OF_RANGE, tok);
+
+  *result = SafeNew<Int>(tok.loc, static_cast<int32_t>(tok.int_val));
+  SafeSignedInc(current);
+  return ParseStatus::GetSuccess();
+}
+
+ParseStatus ReadFloat(const std::vector<Token> &input, int64_t &current,
+                      Node **result) {
+  const Token &tok = input[current];
+  *result = SafeNew<Float>(tok.loc, tok.float_val);
   SafeSignedInc(current);
   return ParseStatus::GetSuccess();
 }
@@ -156,6 +214,8 @@ ParseStatus ReadNode(const std::vector<Token> &input, int64_t &current,
         return ReadCall(input, current, result);
       case TOK_INT:
         return ReadInt(input, current, result);
+      case TOK_FLOAT:
+        return ReadFloat(input, current, result);
       case TOK_STR:
         return ReadStr(input, current, result);
       case TOK_ID:
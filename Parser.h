@@ -13,9 +13,11 @@ enum NodeKind {
   NODE_STMT,
 
   NODE_ASSIGN,
+  NODE_LET,
 
   // Expressions
   NODE_INT,
+  NODE_FLOAT,
   NODE_STR,
   NODE_ID,
   NODE_CALL,
@@ -134,6 +136,26 @@ class Int : public Node {
   int32_t val_;
 };
 
+class Float : public Node {
+ public:
+  static NodeKind Kind;
+
+  Float(SourceLocation loc, double val) : Node(Kind, loc), val_(val) {}
+  Float(double val) : Float(SourceLocation(), val) {}
+
+  double getVal() const { return val_; }
+
+  bool equals(const Node &other) const override {
+    const Float *other_float = other.getAs<Float>();
+    if (!other_float) return false;
+
+    return val_ == other_float->getVal();
+  }
+
+ private:
+  double val_;
+};
+
 class Str : public Node {
  public:
   static NodeKind Kind;
@@ -204,6 +226,47 @@ class Assign : public Node {
   unique<Node> src_;
 };
 
+/**
+ * (let name val body)
+ *
+ * Binds `name` to `val` only within `body`. The value of the whole expression
+ * is the value of `body`.
+ */
+class Let : public Node {
+ public:
+  static NodeKind Kind;
+
+  Let(SourceLocation loc, const std::string &name, unique<Node> val,
+      unique<Node> body)
+      : Node(Kind, loc),
+        name_(name),
+        val_(std::move(val)),
+        body_(std::move(body)) {
+    CheckNonNull(val_.get());
+    CheckNonNull(body_.get());
+  }
+  Let(const std::string &name, unique<Node> val, unique<Node> body)
+      : Let(SourceLocation(), name, std::move(val), std::move(body)) {}
+
+  const std::string &getName() const { return name_; }
+  const Node &getVal() const { return *val_; }
+  const Node &getBody() const { return *body_; }
+
+  bool equals(const Node &other) const override {
+    const Let *other_let = other.getAs<Let>();
+    if (!other_let) return false;
+
+    return (name_ == other_let->getName() &&
+            getVal() == other_let->getVal() &&
+            getBody() == other_let->getBody());
+  }
+
+ private:
+  std::string name_;
+  unique<Node> val_;
+  unique<Node> body_;
+};
+
 enum BinOpKind {
   BINOP_ADD,
   BINOP_SUB,
@@ -295,6 +358,15 @@ enum ParseStatusKind {
 
   // Missing semicolon at the end of a statement.
   PARSE_FAIL_MISSING_SEMICOL,
+
+  // An integer literal does not fit in the width of an Int node.
+  PARSE_FAIL_INT_OUT_OF_RANGE,
+
+  // The name bound by a let is not an ID.
+  PARSE_FAIL_INVALID_LET_NAME,
+
+  // A let has more than a name, value, and body.
+  PARSE_FAIL_TOO_MANY_LET_OPERANDS,
 };
 
 class ParseStatus {
@@ -0,0 +1,107 @@
+#include "ResultWriter.h"
+
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <sstream>
+
+namespace lang {
+
+void ResultWriter::WriteNamed(const std::string &name, int64_t val,
+                              TypeKind kind) {
+  if (format_ == FORMAT_BINARY) {
+    AppendRaw(static_cast<uint32_t>(name.size()));
+    buffer_.append(name);
+    AppendBinary(val, kind);
+    return;
+  }
+
+  if (!name.empty()) {
+    buffer_.append(name);
+    buffer_.push_back('=');
+  }
+  AppendText(val, kind);
+  buffer_.push_back('\n');
+}
+
+void ResultWriter::WriteEvalStack(const std::vector<TypeKind> &types) {
+  const std::vector<int64_t> &results = eval_.getEvalStack();
+  assert(results.size() == types.size() && "Result types do not match stack");
+  for (size_t i = 0; i < results.size(); ++i) Write(results[i], types[i]);
+}
+
+void ResultWriter::AppendText(int64_t val, TypeKind kind) {
+  char buf[32];
+  int len;
+  switch (kind) {
+    case TYPE_INT:
+      len = snprintf(buf, sizeof(buf), "%lld", static_cast<long long>(val));
+      buffer_.append(buf, len);
+      return;
+    case TYPE_FLOAT:
+      len = FormatFloat(BitsToFloat(val), buf, sizeof(buf));
+      buffer_.append(buf, len);
+      return;
+    case TYPE_STR: {
+      const char *chars;
+      size_t str_len;
+      eval_.getStr(val, chars, str_len);
+      buffer_.append(chars, str_len);
+      return;
+    }
+    case TYPE_ARRAY:
+    case TYPE_MAP:
+    case TYPE_FUNC: {
+      std::ostringstream out;
+      eval_.DumpValue(out, val, kind);
+      buffer_.append(out.str());
+      return;
+    }
+  }
+}
+
+void ResultWriter::AppendBinary(int64_t val, TypeKind kind) {
+  buffer_.push_back(static_cast<char>(kind));
+  switch (kind) {
+    case TYPE_STR: {
+      const char *chars;
+      size_t len;
+      eval_.getStr(val, chars, len);
+      AppendRaw(static_cast<uint32_t>(len));
+      buffer_.append(chars, len);
+      return;
+    }
+    case TYPE_ARRAY: {
+      const std::vector<int64_t> &array = eval_.getArray(val);
+      AppendRaw(static_cast<uint32_t>(array.size()));
+      buffer_.append(reinterpret_cast<const char *>(array.data()),
+                     array.size() * sizeof(int64_t));
+      return;
+    }
+    case TYPE_MAP:
+      AppendRaw(static_cast<int64_t>(eval_.getMapSize(val)));
+      return;
+    case TYPE_INT:
+    case TYPE_FLOAT:
+    case TYPE_FUNC:
+      AppendRaw(val);
+      return;
+  }
+}
+
+bool ResultWriter::Flush(int fd) {
+  size_t written = 0;
+  while (written < buffer_.size()) {
+    ssize_t n = write(fd, buffer_.data() + written, buffer_.size() - written);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    written += n;
+  }
+  buffer_.clear();
+  return true;
+}
+
+}  // namespace lang
@@ -0,0 +1,63 @@
+#ifndef RESULT_WRITER_H
+#define RESULT_WRITER_H
+
+#include <string>
+
+#include "Interpret.h"
+
+namespace lang {
+
+/**
+ * Buffers program results and writes them out in one go.
+ *
+ * In the text format each value is written on its own line, prefixed with
+ * `name=` if it is a named global.
+ *
+ * In the binary format each value is a record of:
+ *
+ *   uint32_t name_len, char[name_len]  (0 for unnamed results)
+ *   uint8_t kind                       (a TypeKind)
+ *   payload
+ *
+ * where the payload is a uint32_t length followed by the chars for a str, a
+ * uint32_t count followed by int64_ts for an array, the number of entries as
+ * an int64_t for a map, and the raw int64_t value for everything else. All
+ * integers are in native byte order.
+ */
+class ResultWriter {
+ public:
+  enum Format { FORMAT_TEXT, FORMAT_BINARY };
+
+  ResultWriter(const ByteCodeEvaluator &eval, Format format)
+      : eval_(eval), format_(format) {}
+
+  void Write(int64_t val, TypeKind kind) { WriteNamed("", val, kind); }
+  void WriteNamed(const std::string &name, int64_t val, TypeKind kind);
+
+  // Write each value left on the eval stack, bottom first.
+  void WriteEvalStack(const std::vector<TypeKind> &types);
+
+  const std::string &getBuffer() const { return buffer_; }
+  void Clear() { buffer_.clear(); }
+
+  // Write everything buffered so far to `fd` and clear the buffer. Returns
+  // false if any of it could not be written.
+  bool Flush(int fd);
+
+ private:
+  void AppendText(int64_t val, TypeKind kind);
+  void AppendBinary(int64_t val, TypeKind kind);
+
+  template <typename T>
+  void AppendRaw(T val) {
+    buffer_.append(reinterpret_cast<const char *>(&val), sizeof(val));
+  }
+
+  const ByteCodeEvaluator &eval_;
+  Format format_;
+  std::string buffer_;
+};
+
+}  // namespace lang
+
+#endif
@@ -0,0 +1,334 @@
+#include "Server.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+
+#include "Compiler.h"
+#include "ResultWriter.h"
+
+namespace lang {
+
+constexpr uint32_t ScriptServer::kDefaultMaxRequestSize;
+
+namespace {
+
+// Connections are only handed to a worker once a request starts to arrive. One
+// that stalls partway through would still hold the worker, so reads give up
+// after this long.
+constexpr time_t kRequestTimeoutSeconds = 5;
+
+bool ReadFull(int fd, void *buf, size_t len) {
+  char *dst = static_cast<char *>(buf);
+  while (len) {
+    ssize_t n = read(fd, dst, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    dst += n;
+    len -= n;
+  }
+  return true;
+}
+
+// Without MSG_NOSIGNAL, a client closing its end would kill the whole process
+// with SIGPIPE.
+bool SendFull(int fd, const void *buf, size_t len) {
+  const char *src = static_cast<const char *>(buf);
+  while (len) {
+    ssize_t n = send(fd, src, len, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    src += n;
+    len -= n;
+  }
+  return true;
+}
+
+// A length prefixed string of at most `max_len` chars.
+bool ReadMessage(int fd, std::string &msg, uint32_t max_len = UINT32_MAX) {
+  uint32_t len;
+  if (!ReadFull(fd, &len, sizeof(len)) || len > max_len) return false;
+  msg.resize(len);
+  return ReadFull(fd, &msg[0], len);
+}
+
+bool FillAddress(const std::string &path, sockaddr_un &addr) {
+  if (path.size() >= sizeof(addr.sun_path)) return false;
+  addr = {};
+  addr.sun_family = AF_UNIX;
+  memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+  return true;
+}
+
+}  // namespace
+
+std::shared_ptr<const CachedProgram> ProgramCache::Get(
+    const std::string &source, ServerStatus &status, std::string &error) {
+  uint64_t hash = HashSource(source);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto found = programs_.find(hash);
+    if (found != programs_.end() && found->second.source == source) {
+      ++hits_;
+      status = SERVER_OK;
+      return found->second.program;
+    }
+  }
+  ++misses_;
+
+  // Compile without holding the lock so other workers can keep using the
+  // cache. Two workers may compile the same source, which is harmless.
+  Compiler compiler;
+  LexStatus lex_status = compiler.Lex(source);
+  if (!lex_status.isSuccessful()) {
+    status = SERVER_LEX_FAILED;
+    error = std::to_string(lex_status.getKind());
+    return nullptr;
+  }
+  ParseStatus parse_status = compiler.Parse();
+  if (!parse_status.isSuccessful()) {
+    status = SERVER_PARSE_FAILED;
+    error = std::to_string(parse_status.getKind());
+    return nullptr;
+  }
+  CheckStatus check_status = compiler.Check();
+  if (!check_status.isSuccessful()) {
+    status = SERVER_COMPILE_FAILED;
+    error = check_status.getMessage();
+    return nullptr;
+  }
+  compiler.GenerateByteCode();
+
+  auto program = std::make_shared<CachedProgram>();
+  bool loaded =
+      program->image.Load(BuildProgramImage(hash, compiler.getEmitter()));
+  assert(loaded && "Built an invalid program image");
+  program->memoizable = compiler.getEmitter().FindMemoizableStmts();
+  status = SERVER_OK;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (programs_.size() >= max_programs_) programs_.clear();
+  programs_[hash] = {source, program};
+  return program;
+}
+
+ScriptServer::~ScriptServer() {
+  assert(workers_.empty() && "Destroyed while still serving");
+  if (listen_fd_ >= 0) close(listen_fd_);
+}
+
+bool ScriptServer::Listen(const std::string &path) {
+  sockaddr_un addr;
+  if (!FillAddress(path, addr)) return false;
+
+  listen_fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd_ < 0) return false;
+  unlink(path.c_str());
+  if (bind(listen_fd_, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) ||
+      listen(listen_fd_, SOMAXCONN)) {
+    close(listen_fd_);
+    listen_fd_ = -1;
+    return false;
+  }
+  path_ = path;
+  return true;
+}
+
+void ScriptServer::Serve() {
+  assert(listen_fd_ >= 0 && "Serving before listening");
+  if (pipe2(wake_fds_, O_CLOEXEC | O_NONBLOCK)) return;
+  for (unsigned i = 0; i < num_workers_; ++i)
+    workers_.emplace_back(&ScriptServer::WorkerLoop, this);
+
+  std::vector<int> idle;
+  std::vector<pollfd> polled;
+  while (!stopping_) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      idle.insert(idle.end(), returned_.begin(), returned_.end());
+      returned_.clear();
+    }
+    polled.assign({{listen_fd_, POLLIN, 0}, {wake_fds_[0], POLLIN, 0}});
+    for (int fd : idle) polled.push_back({fd, POLLIN, 0});
+    if (poll(polled.data(), polled.size(), -1) < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+
+    if (polled[1].revents) {
+      char drained[64];
+      while (read(wake_fds_[0], drained, sizeof(drained)) > 0) {
+      }
+    }
+
+    // Connections with a request waiting, or that were hung up, go to the
+    // workers. The rest stay idle.
+    idle.clear();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (size_t i = 2; i < polled.size(); ++i) {
+        if (!polled[i].revents) {
+          idle.push_back(polled[i].fd);
+          continue;
+        }
+        pending_.push_back(polled[i].fd);
+        pending_cv_.notify_one();
+      }
+    }
+
+    if (polled[0].revents && !AcceptConnection(idle)) break;
+  }
+
+  Stop();
+  for (std::thread &worker : workers_) worker.join();
+  workers_.clear();
+
+  // Workers close every connection they were handed, so only idle ones are
+  // left.
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (int fd : connections_) close(fd);
+  connections_.clear();
+  returned_.clear();
+  close(wake_fds_[0]);
+  close(wake_fds_[1]);
+  wake_fds_[0] = wake_fds_[1] = -1;
+  unlink(path_.c_str());
+}
+
+bool ScriptServer::AcceptConnection(std::vector<int> &idle) {
+  int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+  if (fd < 0) return errno == EINTR || errno == ECONNABORTED;
+
+  timeval timeout = {kRequestTimeoutSeconds, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (stopping_) {
+    close(fd);
+    return false;
+  }
+  connections_.insert(fd);
+  idle.push_back(fd);
+  return true;
+}
+
+void ScriptServer::Stop() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (stopping_.exchange(true)) return;
+
+  // Wakes up Serve() and any worker blocked reading a request.
+  if (listen_fd_ >= 0) shutdown(listen_fd_, SHUT_RDWR);
+  for (int fd : connections_) shutdown(fd, SHUT_RDWR);
+  Wake();
+  pending_cv_.notify_all();
+}
+
+void ScriptServer::Wake() {
+  if (wake_fds_[1] < 0) return;
+  char wake = 0;
+  // Fails only if the pipe is full, in which case Serve() is already woken.
+  ssize_t written = write(wake_fds_[1], &wake, 1);
+  (void)written;
+}
+
+int ScriptServer::PopConnection() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  pending_cv_.wait(lock, [this] { return stopping_ || !pending_.empty(); });
+  if (pending_.empty()) return -1;
+  int fd = pending_.front();
+  pending_.pop_front();
+  return fd;
+}
+
+void ScriptServer::WorkerLoop() {
+  ByteCodeEvaluator eval;
+  eval.setMemoCapacity(memo_capacity_);
+  for (int fd = PopConnection(); fd >= 0; fd = PopConnection()) {
+    bool keep = ServeRequest(fd, eval);
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (keep && !stopping_) {
+      returned_.push_back(fd);
+      Wake();
+      continue;
+    }
+    connections_.erase(fd);
+    close(fd);
+  }
+}
+
+bool ScriptServer::ServeRequest(int fd, ByteCodeEvaluator &eval) {
+  std::string source, error;
+  if (!ReadMessage(fd, source, max_request_size_)) return false;
+
+  ServerStatus status;
+  std::shared_ptr<const CachedProgram> program =
+      cache_.Get(source, status, error);
+
+  // The header is written into the buffer before the output so the whole
+  // response goes out in one write.
+  uint32_t header[2] = {0, 0};
+  std::string response(reinterpret_cast<const char *>(header),
+                       sizeof(header));
+  if (program) {
+    eval.ResetRunState();
+    eval.InitializeImage(program->image);
+    if (!eval.InterpretImageMemoized(program->memoizable)) {
+      status = SERVER_RUNTIME_FAILED;
+      error = eval.getStatus().getMessage();
+    }
+  }
+  if (status == SERVER_OK) {
+    std::vector<TypeKind> result_types;
+    for (uint64_t i = 0; i < program->image.getNumResultTypes(); ++i)
+      result_types.push_back(
+          static_cast<TypeKind>(program->image.getResultTypes()[i]));
+    ResultWriter writer(eval, ResultWriter::FORMAT_TEXT);
+    writer.WriteEvalStack(result_types);
+    response += writer.getBuffer();
+  } else {
+    response += error;
+  }
+
+  header[0] = status;
+  header[1] = response.size() - sizeof(header);
+  memcpy(&response[0], header, sizeof(header));
+  return SendFull(fd, response.data(), response.size());
+}
+
+bool ScriptClient::Connect(const std::string &path) {
+  Close();
+  sockaddr_un addr;
+  if (!FillAddress(path, addr)) return false;
+  fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd_ < 0) return false;
+  if (connect(fd_, reinterpret_cast<sockaddr *>(&addr), sizeof(addr))) {
+    Close();
+    return false;
+  }
+  return true;
+}
+
+void ScriptClient::Close() {
+  if (fd_ < 0) return;
+  close(fd_);
+  fd_ = -1;
+}
+
+bool ScriptClient::Run(const std::string &source, ServerStatus &status,
+                       std::string &output) {
+  uint32_t len = source.size();
+  std::string request(reinterpret_cast<const char *>(&len), sizeof(len));
+  request += source;
+  if (!SendFull(fd_, request.data(), request.size())) return false;
+
+  uint32_t raw_status;
+  if (!ReadFull(fd_, &raw_status, sizeof(raw_status))) return false;
+  status = static_cast<ServerStatus>(raw_status);
+  return ReadMessage(fd_, output);
+}
+
+}  // namespace lang
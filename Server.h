@@ -0,0 +1,179 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "ByteCodeFile.h"
+
+namespace lang {
+
+/**
+ * The protocol spoken over the socket.
+ *
+ * A request is a uint32_t length followed by that many bytes of source. A
+ * response is a uint32_t ServerStatus, a uint32_t length, and that many bytes
+ * of output. On success the output is the value of every statement that has
+ * one, one per line as written by ResultWriter. On failure it is the number of
+ * the LexStatusKind or ParseStatusKind that stopped compilation, or the message
+ * of the CheckStatus or EvalStatus. All integers are in native byte order,
+ * since both ends are on the same machine.
+ *
+ * The server closes the connection instead of responding if a request is
+ * longer than its maximum or does not arrive in full within a timeout.
+ */
+enum ServerStatus : uint32_t {
+  SERVER_OK,
+  SERVER_LEX_FAILED,
+  SERVER_PARSE_FAILED,
+  SERVER_COMPILE_FAILED,
+  SERVER_RUNTIME_FAILED,
+};
+
+/**
+ * A compiled program and the statements in its byte code that can be memoized.
+ */
+struct CachedProgram {
+  ProgramImageBuffer image;
+  std::vector<MemoizableStmt> memoizable;
+};
+
+/**
+ * Compiled programs keyed by their source, shared by every worker. Once
+ * `max_programs` are cached, the whole cache is dropped before adding another.
+ */
+class ProgramCache {
+ public:
+  explicit ProgramCache(size_t max_programs) : max_programs_(max_programs) {}
+
+  // Returns the compiled program for `source`, compiling it if it is not
+  // cached. Returns null with `status` and `error` set if it does not compile.
+  std::shared_ptr<const CachedProgram> Get(const std::string &source,
+                                           ServerStatus &status,
+                                           std::string &error);
+
+  size_t getNumHits() const { return hits_; }
+  size_t getNumMisses() const { return misses_; }
+
+ private:
+  struct Entry {
+    std::string source;
+    std::shared_ptr<const CachedProgram> program;
+  };
+
+  std::mutex mutex_;
+  std::unordered_map<uint64_t, Entry> programs_;
+  size_t max_programs_;
+  std::atomic<size_t> hits_{0}, misses_{0};
+};
+
+/**
+ * Runs scripts sent over a Unix domain socket so callers do not pay for
+ * starting a process per script.
+ *
+ * Connections are handed to a fixed pool of workers, each with its own
+ * ByteCodeEvaluator. A worker answers one request, then hands the connection
+ * back to Serve(), which polls every idle connection and queues the ones with
+ * another request waiting. Idle clients never hold a worker, so any number of
+ * them can stay connected.
+ */
+class ScriptServer {
+ public:
+  static constexpr uint32_t kDefaultMaxRequestSize = 1 << 24;
+
+  explicit ScriptServer(unsigned num_workers, size_t max_programs = 1024,
+                        uint32_t max_request_size = kDefaultMaxRequestSize)
+      : num_workers_(num_workers),
+        max_request_size_(max_request_size),
+        cache_(max_programs) {}
+  ~ScriptServer();
+
+  // Bind and listen on `path`, replacing any socket file already there.
+  bool Listen(const std::string &path);
+
+  // Accept connections until Stop() is called. Starts the workers and waits
+  // for them to finish before returning.
+  void Serve();
+
+  // Make Serve() stop accepting and shut down every connection. Safe to call
+  // from another thread while Serve() runs.
+  void Stop();
+
+  // Have each worker remember the values of up to `max_entries` statements, as
+  // in ByteCodeEvaluator::setMemoCapacity(). Must be called before Serve().
+  void setMemoCapacity(size_t max_entries) { memo_capacity_ = max_entries; }
+
+  const ProgramCache &getCache() const { return cache_; }
+
+ private:
+  void WorkerLoop();
+
+  // Answer one request on `fd`. Returns false if the connection should be
+  // closed.
+  bool ServeRequest(int fd, ByteCodeEvaluator &eval);
+  int PopConnection();
+
+  // Accept a connection and add it to `idle`. Returns false if the listening
+  // socket failed.
+  bool AcceptConnection(std::vector<int> &idle);
+
+  // Wake up the poll() in Serve(). Must hold `mutex_`.
+  void Wake();
+
+  unsigned num_workers_;
+  uint32_t max_request_size_;
+  size_t memo_capacity_ = 0;
+  ProgramCache cache_;
+  std::string path_;
+  int listen_fd_ = -1;
+  std::atomic<bool> stopping_{false};
+  std::vector<std::thread> workers_;
+
+  // Guards everything below.
+  std::mutex mutex_;
+  std::condition_variable pending_cv_;
+
+  // Connections with a request waiting, for the workers.
+  std::deque<int> pending_;
+
+  // Connections workers are done with, for Serve() to poll again.
+  std::vector<int> returned_;
+  std::unordered_set<int> connections_;
+
+  // Written to by Wake(). Open while Serve() runs.
+  int wake_fds_[2] = {-1, -1};
+};
+
+/**
+ * One connection to a ScriptServer.
+ */
+class ScriptClient {
+ public:
+  ScriptClient() {}
+  ScriptClient(const ScriptClient &) = delete;
+  ScriptClient &operator=(const ScriptClient &) = delete;
+  ~ScriptClient() { Close(); }
+
+  bool Connect(const std::string &path);
+  void Close();
+
+  // Send `source` and wait for the response. Returns false if the connection
+  // failed.
+  bool Run(const std::string &source, ServerStatus &status,
+           std::string &output);
+
+ private:
+  int fd_ = -1;
+};
+
+}  // namespace lang
+
+#endif
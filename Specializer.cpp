@@ -0,0 +1,145 @@
+#include "Specializer.h"
+
+#include <unordered_set>
+
+#include "Compiler.h"
+
+namespace lang {
+
+namespace {
+
+void AppendKeyPart(std::string &key, const std::string &part) {
+  key += std::to_string(part.size());
+  key += ':';
+  key += part;
+}
+
+// Every part is prefixed with its length so no two different sets of
+// arguments make the same key.
+std::string MakeKey(const std::string &source, const KnownValues &known,
+                    const std::vector<std::string> &inputs) {
+  std::string key;
+  AppendKeyPart(key, source);
+  for (const auto &value : known) {
+    AppendKeyPart(key, value.first);
+    key += std::to_string(value.second.type);
+    key += ':';
+    key += std::to_string(value.second.val);
+    key += ':';
+    AppendKeyPart(key, value.second.str);
+  }
+  key += '|';
+  for (const std::string &input : inputs) AppendKeyPart(key, input);
+  return key;
+}
+
+}  // namespace
+
+bool SpecializationPass::Run(IRFunction &func) {
+  std::unordered_set<std::string> stored;
+  bool changed = false;
+  for (const auto &instr : func.getEntryBlock().getInstrs()) {
+    // The function may store to any of the globals.
+    if (instr->getOpcode() == IR_CALL) break;
+    if (instr->getOpcode() == IR_STORE_GLOBAL) stored.insert(instr->getName());
+    if (instr->getOpcode() != IR_LOAD_GLOBAL ||
+        stored.count(instr->getName()))
+      continue;
+    auto found = known_.find(instr->getName());
+    if (found == known_.end()) continue;
+
+    const KnownValue &known = found->second;
+    assert(known.type == instr->getType() &&
+           "Known value does not have the type of the global.");
+    switch (known.type) {
+      case TYPE_INT:
+        instr->BecomeInt(known.val);
+        break;
+      case TYPE_FLOAT:
+        instr->BecomeFloat(BitsToFloat(known.val));
+        break;
+      case TYPE_STR:
+        instr->BecomeStr(known.str);
+        break;
+      default:
+        assert(false && "Only ints, floats, and strs can be known values.");
+    }
+    ++num_replaced_;
+    changed = true;
+  }
+  return changed;
+}
+
+void SpecializationPass::DumpStats(std::ostream &out) const {
+  out << num_replaced_ << " loads replaced";
+}
+
+bool CompileSpecialized(const std::string &source, const KnownValues &known,
+                        const std::vector<std::string> &inputs,
+                        ProgramImageBuffer &program) {
+  Compiler compiler;
+  if (!compiler.Lex(source).isSuccessful() ||
+      !compiler.Parse().isSuccessful())
+    return false;
+
+  ByteCodeEmitter &emitter = compiler.getEmitter();
+  for (const std::string &input : inputs)
+    emitter.DeclareSymbol(input, TYPE_INT);
+
+  // Known globals are not declared, so they only get symbols if the script
+  // assigns them. They are only declared to check the script.
+  ByteCodeEmitter checker;
+  for (const std::string &input : inputs)
+    checker.DeclareSymbol(input, TYPE_INT);
+  for (const auto &value : known)
+    checker.DeclareSymbol(value.first, value.second.type);
+  if (!checker.Check(compiler.getModule()).isSuccessful()) return false;
+
+  std::unordered_map<std::string, TypeKind> known_types;
+  for (const auto &value : known) known_types[value.first] = value.second.type;
+  unique<IRFunction> func =
+      BuildIR(compiler.getModule(), emitter, known_types);
+
+  std::unordered_set<std::string> assigned;
+  for (const auto &instr : func->getEntryBlock().getInstrs()) {
+    if (instr->getOpcode() == IR_STORE_GLOBAL)
+      assigned.insert(instr->getName());
+  }
+
+  PassManager passes;
+  passes.AddPass(std::make_unique<SpecializationPass>(known));
+  AddOptimizationPasses(passes, std::move(assigned));
+  passes.Run(*func);
+  emitter.ConvertToByteCode(*func);
+
+  bool loaded = program.Load(BuildProgramImage(HashSource(source), emitter));
+  assert(loaded && "Built an invalid program image");
+  return true;
+}
+
+std::shared_ptr<const ProgramImageBuffer> SpecializationCache::Get(
+    const std::string &source, const KnownValues &known,
+    const std::vector<std::string> &inputs) {
+  std::string key = MakeKey(source, known, inputs);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto found = programs_.find(key);
+    if (found != programs_.end()) {
+      ++hits_;
+      return found->second;
+    }
+  }
+  ++misses_;
+
+  // Compile without holding the lock so other threads can keep using the
+  // cache. Two threads may compile the same program, which is harmless.
+  auto program = std::make_shared<ProgramImageBuffer>();
+  if (!CompileSpecialized(source, known, inputs, *program)) return nullptr;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (programs_.size() >= max_programs_) programs_.clear();
+  programs_[key] = program;
+  return program;
+}
+
+}  // namespace lang
@@ -0,0 +1,92 @@
+#ifndef SPECIALIZER_H
+#define SPECIALIZER_H
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "ByteCodeFile.h"
+#include "IRPasses.h"
+
+namespace lang {
+
+// The value of an input global that is fixed for a specialized program.
+struct KnownValue {
+  static KnownValue Int(int64_t val) { return {TYPE_INT, val, ""}; }
+  static KnownValue Float(double val) {
+    return {TYPE_FLOAT, FloatToBits(val), ""};
+  }
+  static KnownValue Str(std::string val) {
+    return {TYPE_STR, 0, std::move(val)};
+  }
+
+  TypeKind type;
+  int64_t val;  // Ints, or the bits of floats.
+  std::string str;
+};
+
+// Ordered by name so the same values always make the same cache key.
+using KnownValues = std::map<std::string, KnownValue>;
+
+/**
+ * Replace each load of a global with a known value by that value, as long as
+ * nothing was stored to the global before the load. Anything computed only
+ * from known values is then left for the optimization passes to precompute.
+ */
+class SpecializationPass : public IRPass {
+ public:
+  explicit SpecializationPass(KnownValues known) : known_(std::move(known)) {}
+
+  const char *getName() const override { return "specialization"; }
+  bool Run(IRFunction &func) override;
+  void DumpStats(std::ostream &out) const override;
+
+  size_t getNumReplaced() const { return num_replaced_; }
+
+ private:
+  KnownValues known_;
+  size_t num_replaced_ = 0;
+};
+
+// Compile `source` specialized for `known` into `program`. The globals in
+// `inputs` are ints set before each run, like with sh_compile_with_inputs().
+// Every global the script assigns is kept so callers can still read them.
+// Returns false if `source` could not be lexed, parsed, or type checked with
+// the inputs and known values declared.
+bool CompileSpecialized(const std::string &source, const KnownValues &known,
+                        const std::vector<std::string> &inputs,
+                        ProgramImageBuffer &program);
+
+/**
+ * Specialized programs keyed by their source, known values, and inputs. Once
+ * `max_programs` are cached, the whole cache is dropped before adding another.
+ */
+class SpecializationCache {
+ public:
+  explicit SpecializationCache(size_t max_programs)
+      : max_programs_(max_programs) {}
+
+  // Returns the program for `source` specialized for `known`, compiling it if
+  // it is not cached. Returns null if it does not compile.
+  std::shared_ptr<const ProgramImageBuffer> Get(
+      const std::string &source, const KnownValues &known,
+      const std::vector<std::string> &inputs = {});
+
+  size_t getNumHits() const { return hits_; }
+  size_t getNumMisses() const { return misses_; }
+
+ private:
+  std::mutex mutex_;
+  std::unordered_map<std::string, std::shared_ptr<const ProgramImageBuffer>>
+      programs_;
+  size_t max_programs_;
+  std::atomic<size_t> hits_{0}, misses_{0};
+};
+
+}  // namespace lang
+
+#endif
@@ -0,0 +1,114 @@
+#include "ValueMap.h"
+
+#include <cassert>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace lang {
+
+constexpr size_t ValueMap::kGroupWidth;
+constexpr int8_t ValueMap::kEmpty;
+
+uint64_t ValueMap::Hash(int64_t key, uint8_t tag) {
+  // splitmix64 finalizer over the key mixed with the tag.
+  uint64_t hash = static_cast<uint64_t>(key) ^ (tag * 0x9E3779B97F4A7C15ULL);
+  hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EBULL;
+  return hash ^ (hash >> 31);
+}
+
+uint32_t ValueMap::MatchGroup(size_t start, int8_t h2) const {
+  const int8_t *ctrl = ctrl_.data() + start;
+#ifdef __SSE2__
+  __m128i ctrl_bytes =
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(ctrl));
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl_bytes, _mm_set1_epi8(h2)));
+#else
+  uint32_t mask = 0;
+  for (size_t i = 0; i < kGroupWidth; ++i) {
+    if (ctrl[i] == h2) mask |= 1u << i;
+  }
+  return mask;
+#endif
+}
+
+size_t ValueMap::FindSlot(int64_t key, uint8_t tag, uint64_t hash,
+                          bool &found) const {
+  size_t num_groups = slots_.size() / kGroupWidth;
+  size_t group_mask = num_groups - 1;
+  int8_t h2 = H2(hash);
+
+  // Triangular probing over whole groups visits every group once since the
+  // number of groups is a power of 2.
+  size_t group = (hash >> 7) & group_mask;
+  for (size_t step = 1;; ++step) {
+    size_t start = group * kGroupWidth;
+    for (uint32_t match = MatchGroup(start, h2); match; match &= match - 1) {
+      size_t idx = start + __builtin_ctz(match);
+      const Slot &slot = slots_[idx];
+      if (slot.key == key && slot.tag == tag) {
+        found = true;
+        return idx;
+      }
+    }
+
+    // Nothing is ever removed, so an empty slot means the key is not in the
+    // table and this is where it would go.
+    if (uint32_t empty = MatchEmpty(start)) {
+      found = false;
+      return start + __builtin_ctz(empty);
+    }
+
+    assert(step <= num_groups && "Probed every group without an empty slot");
+    group = (group + step) & group_mask;
+  }
+}
+
+const int64_t *ValueMap::Find(int64_t key, uint8_t tag) const {
+  bool found;
+  size_t idx = FindSlot(key, tag, Hash(key, tag), found);
+  return found ? &slots_[idx].val : nullptr;
+}
+
+void ValueMap::Put(int64_t key, uint8_t tag, int64_t val) {
+  uint64_t hash = Hash(key, tag);
+  bool found;
+  size_t idx = FindSlot(key, tag, hash, found);
+  if (found) {
+    slots_[idx].val = val;
+    return;
+  }
+
+  // Keep the load factor under 7/8 so probe sequences stay short.
+  if ((size_ + 1) * 8 > slots_.size() * 7) {
+    Rehash(slots_.size() * 2);
+    idx = FindSlot(key, tag, hash, found);
+  }
+
+  ctrl_[idx] = H2(hash);
+  slots_[idx] = {key, val, tag};
+  ++size_;
+}
+
+void ValueMap::Rehash(size_t new_capacity) {
+  std::vector<int8_t> old_ctrl(new_capacity, kEmpty);
+  std::vector<Slot> old_slots(new_capacity);
+  old_ctrl.swap(ctrl_);
+  old_slots.swap(slots_);
+  size_ = 0;
+
+  for (size_t i = 0; i < old_slots.size(); ++i) {
+    if (old_ctrl[i] == kEmpty) continue;
+    const Slot &slot = old_slots[i];
+    uint64_t hash = Hash(slot.key, slot.tag);
+    bool found;
+    size_t idx = FindSlot(slot.key, slot.tag, hash, found);
+    ctrl_[idx] = H2(hash);
+    slots_[idx] = slot;
+    ++size_;
+  }
+}
+
+}  // namespace lang
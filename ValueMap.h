@@ -0,0 +1,70 @@
+#ifndef VALUE_MAP_H
+#define VALUE_MAP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace lang {
+
+/**
+ * An open addressing hash table from tagged 64-bit keys to 64-bit values.
+ *
+ * This follows the layout of a Swiss table. Alongside the slots, we keep one
+ * control byte per slot which is either kEmpty or the low 7 bits of the key's
+ * hash. Slots are probed in groups of kGroupWidth control bytes so a single
+ * SIMD compare checks every candidate in a group at once, and we only touch a
+ * slot when its control byte already matches.
+ *
+ * The tag lets keys of different kinds (ex. ints and interned strings) that
+ * share the same 64-bit representation live in the same table without
+ * colliding.
+ */
+class ValueMap {
+ public:
+  static constexpr size_t kGroupWidth = 16;
+
+  ValueMap() { Rehash(kGroupWidth); }
+
+  // Insert the key or overwrite the value already stored at it.
+  void Put(int64_t key, uint8_t tag, int64_t val);
+
+  // Returns a pointer to the value stored at the key or nullptr if the key is
+  // not in the table. The pointer is invalidated by the next Put().
+  const int64_t *Find(int64_t key, uint8_t tag) const;
+
+  size_t size() const { return size_; }
+  size_t capacity() const { return slots_.size(); }
+
+ private:
+  static constexpr int8_t kEmpty = -128;
+
+  struct Slot {
+    int64_t key;
+    int64_t val;
+    uint8_t tag;
+  };
+
+  static uint64_t Hash(int64_t key, uint8_t tag);
+  static int8_t H2(uint64_t hash) { return hash & 0x7f; }
+
+  // Bitmasks of the positions in the group starting at slot `start` whose
+  // control bytes match `h2` or are empty.
+  uint32_t MatchGroup(size_t start, int8_t h2) const;
+  uint32_t MatchEmpty(size_t start) const { return MatchGroup(start, kEmpty); }
+
+  // Returns the index of the slot holding the key or of the empty slot it
+  // should be inserted into.
+  size_t FindSlot(int64_t key, uint8_t tag, uint64_t hash, bool &found) const;
+
+  void Rehash(size_t new_capacity);
+
+  // The number of slots is always a power of 2 and a multiple of kGroupWidth.
+  std::vector<int8_t> ctrl_;
+  std::vector<Slot> slots_;
+  size_t size_ = 0;
+};
+
+}  // namespace lang
+
+#endif
@@ -0,0 +1,495 @@
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include "ArrayKernels.h"
+#include "BatchLoader.h"
+#include "ByteCodeArchive.h"
+#include "Compiler.h"
+#include "Lexer.h"
+#include "Parser.h"
+#include "Server.h"
+#include "ValueMap.h"
+
+using lang::Token;
+using lang::unique;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+double ElapsedMs(Clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(Clock::now() - start)
+      .count();
+}
+
+void Report(const std::string &name, double ms, size_t bytes) {
+  double mb_per_sec = (bytes / (1024.0 * 1024.0)) / (ms / 1000.0);
+  std::cout << name << ": " << ms << " ms (" << mb_per_sec << " MB/s)\n";
+}
+
+// A script made almost entirely of integer literals.
+std::string MakeNumberHeavyInput(unsigned num_stmts) {
+  std::string input;
+  srand(0);
+  for (unsigned i = 0; i < num_stmts; ++i) {
+    input += "(add ";
+    input += std::to_string(rand() % 2147483647);
+    input += " (sub ";
+    input += std::to_string(rand() % 100000);
+    input += " ";
+    input += std::to_string(rand() % 2147483647);
+    input += "));";
+  }
+  return input;
+}
+
+// What integer literals used to cost: building the digits one character at a
+// time then converting them with std::stol.
+int64_t ReferenceDigitsToInts(const std::string &input) {
+  int64_t checksum = 0;
+  size_t current = 0;
+  while (current < input.size()) {
+    if (!isdigit(input[current])) {
+      ++current;
+      continue;
+    }
+    std::string str;
+    while (isdigit(input[current])) str.push_back(input[current++]);
+    checksum += std::stol(str);
+  }
+  return checksum;
+}
+
+void BenchIntLiterals() {
+  const std::string input = MakeNumberHeavyInput(200000);
+
+  auto start = Clock::now();
+  int64_t expected = ReferenceDigitsToInts(input);
+  Report("int literals (push_back + std::stol)", ElapsedMs(start),
+         input.size());
+
+  start = Clock::now();
+  std::vector<Token> tokens;
+  assert(lang::ReadTokens(input, tokens).isSuccessful());
+  Report("int literals (lexer)", ElapsedMs(start), input.size());
+
+  int64_t checksum = 0;
+  for (const Token &tok : tokens) checksum += tok.int_val;
+  assert(checksum == expected);
+
+  start = Clock::now();
+  lang::Module *module_ptr;
+  assert(lang::ReadModule(tokens, &module_ptr).isSuccessful());
+  unique<lang::Module> module(module_ptr);
+  Report("int literals (parser)", ElapsedMs(start), input.size());
+}
+
+void BenchArrayKernels() {
+  const size_t kLen = 1 << 20;
+  const unsigned kIters = 100;
+  std::vector<int64_t> lhs(kLen), rhs(kLen), dst(kLen);
+  for (size_t i = 0; i < kLen; ++i) {
+    lhs[i] = i;
+    rhs[i] = kLen - i;
+  }
+  size_t bytes = kLen * sizeof(int64_t) * kIters;
+
+  auto start = Clock::now();
+  int64_t sum = 0;
+  for (unsigned i = 0; i < kIters; ++i) sum += lang::SumInts(lhs.data(), kLen);
+  Report("array sum", ElapsedMs(start), bytes);
+
+  start = Clock::now();
+  for (unsigned i = 0; i < kIters; ++i)
+    lang::AddInts(lhs.data(), rhs.data(), dst.data(), kLen);
+  Report("array vadd", ElapsedMs(start), bytes * 2);
+
+  assert(sum == kIters * static_cast<int64_t>(kLen * (kLen - 1) / 2));
+  assert(dst[kLen / 2] == kLen);
+}
+
+void BenchMaps() {
+  const int64_t kNumKeys = 1 << 20;
+  size_t bytes = kNumKeys * sizeof(int64_t) * 2;
+
+  // std::hash on ints is the identity, so use scattered keys to not favor it
+  // with sequential bucket accesses.
+  std::vector<int64_t> keys(kNumKeys);
+  srand(0);
+  for (int64_t &key : keys) key = (int64_t(rand()) << 31) ^ rand();
+
+  auto start = Clock::now();
+  lang::ValueMap map;
+  for (int64_t i = 0; i < kNumKeys; ++i) map.Put(keys[i], 0, i);
+  int64_t sum = 0;
+  for (int64_t i = 0; i < kNumKeys; ++i) sum += *map.Find(keys[i], 0);
+  Report("ValueMap put + find", ElapsedMs(start), bytes);
+
+  start = Clock::now();
+  std::unordered_map<int64_t, int64_t> std_map;
+  for (int64_t i = 0; i < kNumKeys; ++i) std_map[keys[i]] = i;
+  int64_t std_sum = 0;
+  for (int64_t i = 0; i < kNumKeys; ++i) std_sum += std_map.at(keys[i]);
+  Report("std::unordered_map put + find", ElapsedMs(start), bytes);
+
+  assert(sum == std_sum);
+}
+
+// A host injecting an input and reading an output around every run.
+void BenchSymbolAccess() {
+  const std::string input = "def out (add in 1);";
+  const unsigned kRuns = 1000000;
+  lang::Compiler compiler;
+  assert(compiler.Lex(input).isSuccessful());
+  assert(compiler.Parse().isSuccessful());
+  compiler.getEmitter().DeclareSymbol("in", lang::TYPE_INT);
+  compiler.GenerateByteCode();
+  const lang::ByteCodeEmitter &emitter = compiler.getEmitter();
+  lang::ByteCodeEvaluator eval(emitter.getConstants(), emitter.getSymbols());
+
+  auto start = Clock::now();
+  int64_t by_name = 0;
+  for (unsigned i = 0; i < kRuns; ++i) {
+    eval.setValue(lang::SymbolHandle(emitter.getSymbolID("in")), i);
+    eval.Interpret(emitter.getByteCode());
+    by_name += eval.getValue(lang::SymbolHandle(emitter.getSymbolID("out")));
+  }
+  std::cout << "runs resolving names each time: " << ElapsedMs(start)
+            << " ms\n";
+
+  start = Clock::now();
+  int64_t by_handle = 0;
+  lang::SymbolHandle in = emitter.ResolveSymbol("in");
+  lang::SymbolHandle out = emitter.ResolveSymbol("out");
+  for (unsigned i = 0; i < kRuns; ++i) {
+    eval.setValue(in, i);
+    eval.Interpret(emitter.getByteCode());
+    by_handle += eval.getValue(out);
+  }
+  std::cout << "runs with pre-resolved handles: " << ElapsedMs(start)
+            << " ms\n";
+
+  assert(by_name == by_handle);
+}
+
+// Time from spawning the driver on a small script to reading the first byte of
+// its result, which is what a caller running one script per process waits for.
+void BenchStartup(const char *driver) {
+  if (access(driver, X_OK)) {
+    std::cout << "startup: skipped, " << driver << " not built\n";
+    return;
+  }
+
+  const unsigned kRuns = 200;
+  std::vector<double> times;
+  for (unsigned i = 0; i < kRuns; ++i) {
+    int fds[2];
+    assert(!pipe(fds));
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addclose(&actions, fds[0]);
+    char *args[] = {const_cast<char *>(driver),
+                    const_cast<char *>("def x 2; (add x 3);"), nullptr};
+
+    auto start = Clock::now();
+    pid_t pid;
+    assert(!posix_spawn(&pid, driver, &actions, nullptr, args, environ));
+    close(fds[1]);
+    char c;
+    assert(read(fds[0], &c, 1) == 1 && c == '5');
+    times.push_back(ElapsedMs(start));
+
+    close(fds[0]);
+    waitpid(pid, nullptr, 0);
+    posix_spawn_file_actions_destroy(&actions);
+  }
+
+  std::sort(times.begin(), times.end());
+  std::cout << "startup to first result: p50 " << times[kRuns / 2] * 1000
+            << " us, p99 " << times[kRuns * 99 / 100] * 1000 << " us\n";
+}
+
+// Send `source` to the server at `path` from `num_clients` connections at once
+// and report the latency of each request and the total throughput.
+void RunLoad(const std::string &path, const std::string &source,
+             unsigned num_clients, unsigned requests_per_client) {
+  std::vector<std::vector<double>> latencies(num_clients);
+  std::vector<std::thread> clients;
+  auto start = Clock::now();
+  for (unsigned i = 0; i < num_clients; ++i) {
+    clients.emplace_back([&, i] {
+      lang::ScriptClient client;
+      assert(client.Connect(path));
+      lang::ServerStatus status;
+      std::string output;
+      for (unsigned j = 0; j < requests_per_client; ++j) {
+        auto sent = Clock::now();
+        assert(client.Run(source, status, output));
+        assert(status == lang::SERVER_OK);
+        latencies[i].push_back(ElapsedMs(sent));
+      }
+    });
+  }
+  for (std::thread &client : clients) client.join();
+  double total_ms = ElapsedMs(start);
+
+  std::vector<double> all;
+  for (const auto &client_latencies : latencies)
+    all.insert(all.end(), client_latencies.begin(), client_latencies.end());
+  std::sort(all.begin(), all.end());
+  std::cout << "server with " << num_clients << " clients: p50 "
+            << all[all.size() / 2] * 1000 << " us, p99 "
+            << all[all.size() * 99 / 100] * 1000 << " us, "
+            << all.size() / (total_ms / 1000) << " requests/sec\n";
+}
+
+const char kServerScript[] = "def x 2; (add x 3);";
+
+void BenchServer() {
+  const std::string path = "/tmp/short_bench_" + std::to_string(getpid());
+  lang::ScriptServer server(std::max(std::thread::hardware_concurrency(), 1u));
+  assert(server.Listen(path));
+  std::thread serving(&lang::ScriptServer::Serve, &server);
+  RunLoad(path, kServerScript, 1, 20000);
+  RunLoad(path, kServerScript, 8, 5000);
+  server.Stop();
+  serving.join();
+}
+
+// Compile and run many small script files, reading them one blocking read at a
+// time and then through each BatchLoader backend.
+void BenchBatchLoading() {
+  const unsigned kNumFiles = 20000;
+  const std::string prefix = "/tmp/short_bench_" + std::to_string(getpid());
+  std::vector<std::string> paths;
+  std::string script = MakeNumberHeavyInput(20);
+  for (unsigned i = 0; i < kNumFiles; ++i) {
+    paths.push_back(prefix + "_" + std::to_string(i) + ".sh");
+    std::ofstream(paths.back()) << script;
+  }
+  size_t bytes = script.size() * kNumFiles;
+
+  // Drop the files from the page cache between runs where we are allowed to, so
+  // the reads actually wait on the disk.
+  auto drop_caches = [&] {
+    for (const std::string &path : paths) {
+      int fd = open(path.c_str(), O_RDONLY);
+      fdatasync(fd);
+      posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+      close(fd);
+    }
+  };
+
+  lang::Compiler compiler;
+  int64_t expected = 0;
+  drop_caches();
+  auto start = Clock::now();
+  for (const std::string &path : paths) {
+    std::ifstream in(path);
+    std::string contents((std::istreambuf_iterator<char>(in)),
+                         std::istreambuf_iterator<char>());
+    compiler.ResetComponents();
+    assert(compiler.Lex(contents).isSuccessful());
+    expected += compiler.getTokens().size();
+  }
+  Report("batch files (blocking reads)", ElapsedMs(start), bytes);
+
+  for (auto backend : {lang::BatchLoader::BACKEND_IO_URING,
+                       lang::BatchLoader::BACKEND_THREAD_POOL}) {
+    drop_caches();
+    start = Clock::now();
+    lang::BatchLoader loader(64, backend);
+    int64_t checksum = 0;
+    loader.Load(paths, [&](size_t, bool ok, std::string &contents) {
+      assert(ok);
+      compiler.ResetComponents();
+      assert(compiler.Lex(contents).isSuccessful());
+      checksum += compiler.getTokens().size();
+    });
+    Report(loader.getBackend() == lang::BatchLoader::BACKEND_IO_URING
+               ? "batch files (io_uring)"
+               : "batch files (pread thread pool)",
+           ElapsedMs(start), bytes);
+    assert(checksum == expected);
+  }
+
+  for (const std::string &path : paths) remove(path.c_str());
+}
+
+// A chain of temporaries that are each read once, where every statement
+// computes the same subexpression twice and spreads constants across adds and
+// subs, like scripts generated from templates do.
+std::string MakeRedundantInput(unsigned num_stmts) {
+  auto get_temp = [](unsigned i) {
+    std::string name = "t";
+    for (; i; i /= 26) name.push_back('a' + i % 26);
+    return name;
+  };
+  std::string input = "def " + get_temp(0) + " (add in 1);";
+  for (unsigned i = 1; i < num_stmts; ++i) {
+    std::string prev = get_temp(i - 1);
+    input += " def " + get_temp(i) + " (sub (add (add " + prev + " 3) in)";
+    input += " (sub (add " + prev + " 3) 2));";
+  }
+  return input + " " + get_temp(num_stmts - 1) + ";";
+}
+
+// What each optimization level costs to compile and saves when the program
+// runs.
+void BenchOptLevels() {
+  const std::string input = MakeRedundantInput(200);
+  const unsigned kCompiles = 200, kRuns = 20000;
+  int64_t expected = 0;
+  for (unsigned level = 0; level <= lang::kMaxOptLevel; ++level) {
+    lang::Compiler compiler;
+    auto start = Clock::now();
+    for (unsigned i = 0; i < kCompiles; ++i) {
+      compiler.ResetComponents();
+      compiler.getEmitter().DeclareSymbol("in", lang::TYPE_INT);
+      assert(compiler.Lex(input).isSuccessful());
+      assert(compiler.Parse().isSuccessful());
+      if (!level) {
+        compiler.GenerateByteCode();
+        continue;
+      }
+      lang::PassManager passes;
+      lang::AddOptimizationPasses(passes, level);
+      compiler.GenerateByteCode(passes);
+    }
+    double compile_ms = ElapsedMs(start) / kCompiles;
+
+    const lang::ByteCodeEmitter &emitter = compiler.getEmitter();
+    lang::ByteCodeEvaluator eval(emitter.getConstants(), emitter.getSymbols(),
+                                 emitter.getNumLocals());
+    lang::SymbolHandle in = emitter.ResolveSymbol("in");
+    start = Clock::now();
+    int64_t sum = 0;
+    for (unsigned i = 0; i < kRuns; ++i) {
+      eval.setValue(in, i);
+      eval.Interpret(emitter.getByteCode());
+      sum += eval.getEvalStack().back();
+      eval.ResetRunState();
+    }
+    std::cout << "-O" << level << ": " << compile_ms << " ms to compile, "
+              << ElapsedMs(start) * 1000 / kRuns << " us per run, "
+              << emitter.getByteCode().size() << " words of byte code\n";
+
+    if (!level) expected = sum;
+    assert(sum == expected);
+  }
+}
+
+// Runs of a script of pure statements over inputs that often repeat, with and
+// without memoizing them.
+void BenchMemoization() {
+  std::string expr = "in";
+  for (int i = 0; i < 30; ++i)
+    expr = "(add (sub " + expr + " " + std::to_string(i) + ") in)";
+  std::string input;
+  for (int i = 0; i < 10; ++i)
+    input += "(add " + expr + " " + std::to_string(i) + ");";
+  const unsigned kRuns = 100000, kNumInputs = 16;
+
+  lang::Compiler compiler;
+  compiler.getEmitter().DeclareSymbol("in", lang::TYPE_INT);
+  assert(compiler.Lex(input).isSuccessful());
+  assert(compiler.Parse().isSuccessful());
+  compiler.GenerateByteCode();
+  const lang::ByteCodeEmitter &emitter = compiler.getEmitter();
+  std::vector<lang::MemoizableStmt> stmts = emitter.FindMemoizableStmts();
+  lang::SymbolHandle in = emitter.ResolveSymbol("in");
+
+  int64_t sums[2] = {0, 0};
+  for (int memoize = 0; memoize < 2; ++memoize) {
+    lang::ByteCodeEvaluator eval(emitter.getConstants(), emitter.getSymbols(),
+                                 emitter.getNumLocals());
+    eval.setMemoCapacity(memoize ? 1024 : 0);
+    auto start = Clock::now();
+    for (unsigned i = 0; i < kRuns; ++i) {
+      eval.ResetRunState();
+      eval.setValue(in, i % kNumInputs);
+      eval.InterpretMemoized(emitter.getByteCode(), stmts);
+      sums[memoize] += eval.getEvalStack().back();
+    }
+    std::cout << (memoize ? "runs memoized: " : "runs not memoized: ")
+              << ElapsedMs(start) << " ms";
+    if (memoize) {
+      std::cout << " (" << eval.getNumMemoHits() << " hits, "
+                << eval.getNumMemoMisses() << " misses)";
+    }
+    std::cout << "\n";
+  }
+  assert(sums[0] == sums[1]);
+}
+
+// How much smaller an archive is than the program images in it, and how fast
+// programs come back out of it.
+void BenchByteCodeArchive() {
+  const unsigned kNumPrograms = 5000;
+  const std::string path =
+      "/tmp/short_bench_" + std::to_string(getpid()) + ".shba";
+  lang::ByteCodeArchiveWriter writer;
+  assert(writer.Open(path));
+  lang::Compiler compiler;
+  size_t image_bytes = 0;
+  srand(0);
+  for (unsigned i = 0; i < kNumPrograms; ++i) {
+    std::string input = MakeNumberHeavyInput(20);
+    compiler.ResetComponents();
+    assert(compiler.Lex(input).isSuccessful());
+    assert(compiler.Parse().isSuccessful());
+    compiler.GenerateByteCode();
+    writer.Add(lang::HashSource(input), compiler.getEmitter());
+    image_bytes += lang::BuildProgramImage(0, compiler.getEmitter()).size();
+  }
+  assert(writer.Finish());
+
+  lang::ByteCodeArchive archive;
+  assert(archive.Map(path));
+  size_t archive_bytes = 0;
+  for (uint64_t id = 0; id < kNumPrograms; ++id)
+    archive_bytes += archive.getEntry(id).compressed_size;
+  std::cout << "archive: " << image_bytes << " bytes of images in "
+            << archive_bytes << " compressed\n";
+
+  auto start = Clock::now();
+  lang::ProgramImageBuffer image;
+  for (uint64_t id = 0; id < kNumPrograms; ++id)
+    assert(archive.Load(id, image));
+  Report("archive load", ElapsedMs(start), image_bytes);
+  remove(path.c_str());
+}
+
+}  // namespace
+
+// bench.out
+// bench.out --load SOCKET [SOURCE]  (against a running a.out --serve SOCKET)
+int main(int argc, char **argv) {
+  if (argc >= 3 && std::string(argv[1]) == "--load") {
+    RunLoad(argv[2], argc >= 4 ? argv[3] : kServerScript, 8, 5000);
+    return 0;
+  }
+
+  BenchIntLiterals();
+  BenchArrayKernels();
+  BenchMaps();
+  BenchSymbolAccess();
+  BenchOptLevels();
+  BenchMemoization();
+  BenchStartup("./a.out");
+  BenchServer();
+  BenchBatchLoading();
+  BenchByteCodeArchive();
+  return 0;
+}
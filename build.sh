@@ -12,6 +12,10 @@ case $key in
     shift # past argument
     shift # past value
     ;;
+    --bench)
+    BENCH=1
+    shift # past argument
+    ;;
     *)    # unknown option
     POSITIONAL+=("$1") # save it in an array for later
     shift # past argument
@@ -21,9 +25,30 @@ done
 set -- "${POSITIONAL[@]}" # restore positional parameters
 
 CXX=clang++
-CXXFLAGS="-std=c++14 -fno-rtti $EXTRA_CXXFLAGS"
+CXXFLAGS="-std=c++14 -fno-rtti -pthread $EXTRA_CXXFLAGS"
 
 echo "CXX: $CXX"
 echo "CXXFLAGS: $CXXFLAGS"
 
-$CXX $CXXFLAGS lang.cpp Lexer.cpp Parser.cpp Interpret.cpp
+SRCS="Lexer.cpp Parser.cpp Interpret.cpp ArrayKernels.cpp ValueMap.cpp"
+SRCS="$SRCS ByteCodeFile.cpp Compiler.cpp Embed.cpp ResultWriter.cpp"
+SRCS="$SRCS Server.cpp BatchLoader.cpp Compress.cpp ByteCodeArchive.cpp"
+SRCS="$SRCS IR.cpp IRPasses.cpp IRLowering.cpp Specializer.cpp Disassembler.cpp"
+
+$CXX $CXXFLAGS lang.cpp $SRCS
+
+# Static and shared libraries for embedding through Embed.h.
+mkdir -p obj
+OBJS=()
+for src in $SRCS; do
+  obj="obj/${src%.cpp}.o"
+  $CXX $CXXFLAGS -fPIC -c $src -o $obj
+  OBJS+=("$obj")
+done
+rm -f libshort.a
+ar rcs libshort.a "${OBJS[@]}"
+$CXX $CXXFLAGS -shared "${OBJS[@]}" -o libshort.so
+
+if [[ -n "$BENCH" ]]; then
+  $CXX $CXXFLAGS -O2 bench.cpp $SRCS -o bench.out
+fi
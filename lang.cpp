@@ -1,8 +1,33 @@
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+#include "ArrayKernels.h"
+#include "BatchLoader.h"
+#include "ByteCodeArchive.h"
+#include "Compress.h"
+#include "ByteCodeFile.h"
+#include "Compiler.h"
+#include "Disassembler.h"
+#include "Embed.h"
+#include "IR.h"
+#include "IRPasses.h"
 #include "Interpret.h"
 #include "Lexer.h"
 #include "Parser.h"
+#include "ResultWriter.h"
+#include "Server.h"
+#include "Specializer.h"
+#include "ValueMap.h"
 
 using lang::ByteCode;
+using lang::Compiler;
 using lang::LexStatus;
 using lang::Node;
 using lang::ParseStatus;
@@ -11,90 +36,6 @@ using lang::unique;
 
 namespace {
 
-class Compiler {
- public:
-  ~Compiler() {
-    if (module_ptr_) delete module_ptr_;
-  }
-
-  const std::vector<Token> &getTokens() const { return tokens_; }
-
-  const lang::Module &getModule() const { return *module_ptr_; }
-
-  const lang::ByteCodeEmitter &getEmitter() const { return emitter_; }
-
-  const lang::ByteCodeEvaluator &getEvaluator() const { return eval_; }
-
-  // Perform a standalone lexing of input into a vector of tokens attainable
-  // with getTokens(). Repeated calls to this overrides the previous value of
-  // getTokens() instead of appending.
-  LexStatus Lex(const std::string &input) {
-    ResetTokens();
-    return ReadTokens(input, tokens_);
-  }
-
-  // Perform a standalone parsing of input into a lang::Module * attainable with
-  // getModule(). Repeated calls to this overrides the previous value of
-  // getModule().
-  ParseStatus Parse() {
-    ResetModule();
-    return lang::ReadModule(tokens_, &module_ptr_);
-  }
-
-  void GenerateByteCode() { emitter_.ConvertToByteCode(*module_ptr_); }
-
-  void EvaluateByteCode() {
-    eval_.InitializeConstants(emitter_.getConstants());
-    eval_.InitializeSymbolTable(emitter_.getSymbols());
-    eval_.Interpret(emitter_.getByteCode());
-  }
-
-  int64_t ResetAndCompile(const std::string &input) {
-    ResetComponents();
-    return Compile(input);
-  }
-
- private:
-  int64_t Compile(const std::string &input) {
-    Run(input);
-    return getOnlyEvalResult();
-  }
-
-  int64_t getOnlyEvalResult() const {
-    assert(eval_.getEvalStack().size() == 1);
-    return eval_.getEvalStack().back();
-  }
-
-  void ResetComponents() {
-    tokens_.clear();
-    delete module_ptr_;
-    module_ptr_ = nullptr;
-    emitter_.ResetComponents();
-    eval_.ResetComponents();
-  }
-
-  void Run(const std::string &input) {
-    assert(Lex(input).isSuccessful());
-    assert(Parse().isSuccessful());
-    GenerateByteCode();
-    EvaluateByteCode();
-  }
-
-  void ResetTokens() { tokens_.clear(); }
-
-  void ResetModule() {
-    if (module_ptr_) {
-      delete module_ptr_;
-      module_ptr_ = nullptr;
-    }
-  }
-
-  std::vector<Token> tokens_;
-  lang::Module *module_ptr_ = nullptr;
-  lang::ByteCodeEmitter emitter_;
-  lang::ByteCodeEvaluator eval_;
-};
-
 template <typename T>
 void CompareVectors(const std::vector<T> &expected,
                     const std::vector<T> &found) {
@@ -260,15 +201,1618 @@ void ShortTestCompileBackToBack() {
   assert(result == 7);
 }
 
-int main(int argc, char **argv) {
+void ShortTestIntLiterals() {
+  // Long enough to go through the 8-digits-at-a-time path, with a tail.
+  const std::string input = "(add 1234567890123 0042);";
+  std::vector<Token> tokens;
+  assert(ReadTokens(input, tokens).isSuccessful());
+  assert(tokens.size() == 6);
+  assert(tokens[2].int_val == 1234567890123);
+  assert(tokens[2].chars == "1234567890123");
+  assert(tokens[3].int_val == 42);
+
+  // Does not fit in an int64_t.
+  tokens.clear();
+  LexStatus lex_status = ReadTokens("99999999999999999999;", tokens);
+  assert(lex_status.getKind() == lang::LEX_FAIL_INT_OVERFLOW);
+
+  // Fits in the token, but not in an Int node.
+  tokens.clear();
+  assert(ReadTokens("2147483648;", tokens).isSuccessful());
+  lang::Module *module_ptr = nullptr;
+  ParseStatus parse_status = lang::ReadModule(tokens, &module_ptr);
+  assert(parse_status.getKind() == lang::PARSE_FAIL_INT_OUT_OF_RANGE);
+
+  assert(Compiler().ResetAndCompile("(sub 2147483647 47);") == 2147483600);
+}
+
+void ShortTestArrays() {
+  // Odd lengths so we go through both the vector and the scalar tails.
+  std::vector<int64_t> lhs, rhs;
+  for (int64_t i = 0; i < 13; ++i) {
+    lhs.push_back(i);
+    rhs.push_back(100 * i);
+  }
+  assert(lang::SumInts(lhs.data(), lhs.size()) == 78);
+  std::vector<int64_t> dst(lhs.size());
+  lang::AddInts(lhs.data(), rhs.data(), dst.data(), dst.size());
+  for (int64_t i = 0; i < 13; ++i) assert(dst[i] == 101 * i);
+
+  const std::string input =
+      "def a (make 10); (set a 3 5); (set a 9 7); def b (vadd a a);"
+      "(add (sum b) (get a 3));";
+  assert(Compiler().ResetAndCompile(input) == 29);
+}
+
+void ShortTestMaps() {
+  // Enough keys to go through a few rehashes.
+  lang::ValueMap map;
+  for (int64_t i = 0; i < 10000; ++i) map.Put(i * 7919, lang::TYPE_INT, i);
+  map.Put(0, lang::TYPE_STR, -1);
+  assert(map.size() == 10001);
+  for (int64_t i = 0; i < 10000; ++i)
+    assert(*map.Find(i * 7919, lang::TYPE_INT) == i);
+  assert(*map.Find(0, lang::TYPE_STR) == -1);
+  assert(!map.Find(1, lang::TYPE_INT));
+
+  // "a" is the first constant so its ID is 0, but it's still a different key
+  // from the int 0.
+  const std::string input =
+      "def m (map); (put m 0 10); (put m \"a\" 20); (put m \"a\" 21);"
+      "(add (lookup m 0) (lookup m \"a\"));";
+  Compiler compiler;
+  assert(compiler.ResetAndCompile(input) == 31);
+  assert(compiler.getEmitter().getConstants().size() == 1);
+}
+
+void ShortTestFloats() {
+  const std::vector<Token> expected_tokens = {
+      Token(lang::TOK_LPAR, "("),    Token(lang::TOK_ID, "sub"),
+      Token(lang::TOK_FLOAT, "2.5"), Token(lang::TOK_INT, "1"),
+      Token(lang::TOK_RPAR, ")"),    Token(lang::TOK_SEMICOL, ";"),
+  };
+  std::vector<Token> tokens;
+  assert(ReadTokens("(sub 2.5 1);", tokens).isSuccessful());
+  CompareVectors(expected_tokens, tokens);
+  assert(tokens[2].float_val == 2.5);
+
+  Compiler compiler;
+  compiler.ResetAndCompile("(sub 2.5 1);");
+  assert(compiler.getEmitter().getResultTypes().back() == lang::TYPE_FLOAT);
+
+  // The int on the LHS gets promoted.
+  const std::vector<lang::ByteCode> expected_bytecode = {
+      ByteCode::GetInstr(lang::INSTR_PUSH),
+      ByteCode::GetValue(1),
+      ByteCode::GetInstr(lang::INSTR_PUSH),
+      ByteCode::GetValue(lang::FloatToBits(0.25)),
+      ByteCode::GetInstr(lang::INSTR_INT_TO_FLOAT),
+      ByteCode::GetValue(1),
+      ByteCode::GetInstr(lang::INSTR_ADD_F),
+  };
+  int64_t result = compiler.ResetAndCompile("(add 1 0.25);");
+  CompareVectors(expected_bytecode, compiler.getEmitter().getByteCode());
+  assert(lang::BitsToFloat(result) == 1.25);
+
+  result = compiler.ResetAndCompile("def x 0.5; (sub (add x x) (add 2 3));");
+  assert(lang::BitsToFloat(result) == -4);
+}
+
+void ShortTestLet() {
+  const std::string input = "def x 1; (let x 10 (let y (add x 5) (sub y x)));";
+  Compiler compiler;
+  assert(compiler.ResetAndCompile(input) == 5);
+
+  // Only the global x gets a symbol. The locals are resolved to slots.
+  assert(compiler.getEmitter().getSymbols().size() == 1);
+  assert(compiler.getEmitter().getNumLocals() == 2);
+
+  const std::vector<lang::ByteCode> expected_bytecode = {
+      ByteCode::GetInstr(lang::INSTR_PUSH),
+      ByteCode::GetValue(0),
+      ByteCode::GetInstr(lang::INSTR_PUSH),
+      ByteCode::GetValue(1),
+      ByteCode::GetInstr(lang::INSTR_STORE),
+
+      ByteCode::GetInstr(lang::INSTR_PUSH),
+      ByteCode::GetValue(10),
+      ByteCode::GetInstr(lang::INSTR_STORE_LOCAL),
+      ByteCode::GetValue(0),
+      ByteCode::GetInstr(lang::INSTR_LOAD_LOCAL),
+      ByteCode::GetValue(0),
+      ByteCode::GetInstr(lang::INSTR_PUSH),
+      ByteCode::GetValue(5),
+      ByteCode::GetInstr(lang::INSTR_ADD_OP),
+      ByteCode::GetInstr(lang::INSTR_STORE_LOCAL),
+      ByteCode::GetValue(1),
+      ByteCode::GetInstr(lang::INSTR_LOAD_LOCAL),
+      ByteCode::GetValue(1),
+      ByteCode::GetInstr(lang::INSTR_LOAD_LOCAL),
+      ByteCode::GetValue(0),
+      ByteCode::GetInstr(lang::INSTR_SUB_OP),
+  };
+  CompareVectors(expected_bytecode, compiler.getEmitter().getByteCode());
+
+  // Slots are reused by sibling scopes, and the global is untouched by a local
+  // with the same name.
+  const std::string siblings =
+      "def x 1; (add (let x 2 x) (let y 3 (add x y)));";
+  assert(compiler.ResetAndCompile(siblings) == 6);
+  assert(compiler.getEmitter().getNumLocals() == 1);
+}
+
+void ShortTestByteCodeFile() {
+  const std::string input = "def x 2.5; (add x (let y \"s\" 1));";
+  const std::string path =
+      "/tmp/short_test_" + std::to_string(getpid()) + ".shbc";
+  uint64_t hash = lang::HashSource(input);
+  assert(hash != lang::HashSource("def x 2.5; (add x (let y \"t\" 1));"));
+
+  Compiler compiler;
+  int64_t expected = compiler.ResetAndCompile(input);
+  const lang::ByteCodeEmitter &emitter = compiler.getEmitter();
+  assert(lang::WriteByteCodeFile(path, hash, emitter));
+
+  lang::ByteCodeFile file;
+  assert(file.Map(path));
+  assert(file.getSourceHash() == hash);
+  assert(file.getNumLocals() == 1);
+  assert(file.getNumSymbols() == 1);
+  assert(file.getSymbols()[0].id == emitter.getSymbolID("x"));
+  assert(file.getStr(file.getSymbols()[0].name_offset,
+                     file.getSymbols()[0].name_len) == "x");
+  assert(file.getNumResultTypes() == 1);
+  assert(file.getResultTypes()[0] == lang::TYPE_FLOAT);
+
+  std::vector<ByteCode> codes(file.getByteCode(),
+                              file.getByteCode() + file.getNumByteCodes());
+  CompareVectors(emitter.getByteCode(), codes);
+
+  assert(file.getNumConstants() == 1);
+  assert(std::string(file.getConstantChars(0), file.getConstantLen(0)) == "s");
+
+  assert(Compiler().EvaluateImage(file) == expected);
+  file.Unmap();
+  remove(path.c_str());
+
+  // Files that are not .shbc files are rejected.
+  assert(!file.Map(path));
+  std::ofstream(path) << "def x 2;";
+  assert(!file.Map(path));
+  remove(path.c_str());
+
+  // So are images with strs that run past the end of the strs.
+  std::string image = lang::BuildProgramImage(hash, emitter);
+  lang::ProgramImage view;
+  assert(view.Attach(image.data(), image.size()));
+  const lang::ByteCodeFileHeader header = view.getHeader();
+  for (size_t len_offset :
+       {header.constants_offset + offsetof(lang::ByteCodeFileConstant, str_len),
+        header.symbols_offset + offsetof(lang::ByteCodeFileSymbol, name_len)}) {
+    std::string corrupt = image;
+    uint64_t len = header.strs_size + 1;
+    memcpy(&corrupt[len_offset], &len, sizeof(len));
+    assert(!view.Attach(corrupt.data(), corrupt.size()));
+  }
+}
+
+void ShortTestSharedByteCode() {
+  const std::string input = "def x 40; (let s \"hi\" s); (add x 2);";
+  Compiler compiler;
+  compiler.ResetAndCompile("def x 40; (add x 2);");
+  const lang::ByteCodeEmitter &emitter = compiler.getEmitter();
+  uint64_t hash = lang::HashSource(input);
+
+  // The image does not depend on where it is placed in memory.
+  std::string image = lang::BuildProgramImage(hash, emitter);
+  std::vector<int64_t> moved((image.size() + 7) / 8);
+  memcpy(moved.data(), image.data(), image.size());
+  lang::ProgramImage view;
+  assert(view.Attach(moved.data(), image.size()));
+  assert(Compiler().EvaluateImage(view) == 42);
+
+  // Two "workers" execute the same shared memory object.
+  const std::string name = "/short_test_" + std::to_string(getpid());
+  assert(lang::PublishSharedByteCode(name, hash, emitter));
+  lang::ByteCodeFile worker1, worker2;
+  assert(worker1.MapShared(name));
+  assert(worker2.MapShared(name));
+  assert(worker1.getSourceHash() == hash);
+
+  lang::ByteCodeEvaluator eval1, eval2;
+  eval1.InitializeImage(worker1);
+  eval2.InitializeImage(worker2);
+  eval1.InterpretImage();
+  eval2.InterpretImage();
+  eval1.InterpretImage();
+  assert(eval1.getEvalStack().size() == 2);
+  assert(eval1.getEvalStack().back() == 42);
+  assert(eval2.getEvalStack().size() == 1);
+  assert(eval2.getEvalStack().back() == 42);
+
+  // Publishing a smaller program under the same name does not touch the one
+  // the workers already mapped.
+  Compiler other;
+  other.ResetAndCompile("7;");
+  assert(lang::PublishSharedByteCode(name, hash + 1, other.getEmitter()));
+  eval1.ResetRunState();
+  eval1.InterpretImage();
+  assert(eval1.getEvalStack().back() == 42);
+  assert(worker1.getSourceHash() == hash);
+  lang::ByteCodeFile worker3;
+  assert(worker3.MapShared(name));
+  assert(worker3.getSourceHash() == hash + 1);
+  assert(Compiler().EvaluateImage(worker3) == 7);
+  assert(lang::UnlinkSharedByteCode(name));
+
+  // Str constants are read out of the image.
+  Compiler str_compiler;
+  assert(str_compiler.Lex(input).isSuccessful());
+  assert(str_compiler.Parse().isSuccessful());
+  str_compiler.GenerateByteCode();
+  std::string str_image =
+      lang::BuildProgramImage(hash, str_compiler.getEmitter());
+  assert(view.Attach(str_image.data(), str_image.size()));
+  lang::ByteCodeEvaluator eval;
+  eval.InitializeImage(view);
+  eval.InterpretImage();
+  std::ostringstream out;
+  eval.DumpValue(out, eval.getEvalStack()[0], lang::TYPE_STR);
+  assert(out.str() == "hi");
+}
+
+void ShortTestStream() {
+  // Statements are split on `;` outside of strs and may span lines.
+  const std::string input =
+      "def x 1;\n(add x\n 1);def m (map);\n"
+      "def y \"a;b\"; y; (put m y 3); (sub (lookup m \"a;b\") 5);\n"
+      "(add 1234567 0.5);\n";
+  int fds[2];
+  assert(!pipe(fds));
+  assert(write(fds[1], input.data(), input.size()) == input.size());
+  close(fds[1]);
+
+  std::ostringstream out;
+  Compiler().RunStream(fds[0], out);
+  close(fds[0]);
+  assert(out.str() == "2\na;b\n-2\n1234567.5\n");
+
+  // Arrays and maps no global holds are freed between statements, and the
+  // ones still held keep their contents.
+  std::string garbage = "def a (make 3); (set a 1 7); def m (map); def b a;";
+  for (int i = 0; i < 200; ++i)
+    garbage += "(sum (make 2)); def t (map); def d (vadd a a); def c (make 1);";
+  garbage += "(put m 5 9); (get a 1); (get b 1); (get d 1); (lookup m 5);";
+  assert(!pipe(fds));
+  assert(write(fds[1], garbage.data(), garbage.size()) == garbage.size());
+  close(fds[1]);
+
+  Compiler compiler;
+  std::ostringstream garbage_out;
+  compiler.RunStream(fds[0], garbage_out);
+  close(fds[0]);
+  const std::string results = garbage_out.str();
+  assert(results.size() == 2 * 200 + 9);
+  assert(results.substr(2 * 200) == "7\n7\n14\n9\n");
+  const lang::ByteCodeEvaluator &eval = compiler.getEvaluator();
+  assert(eval.getNumArrays() + eval.getNumMaps() < 16);
+}
+
+void ShortTestEmbed() {
+  assert(!sh_compile("(add 1 2"));
+
+  // Programs that could not be emitted are rejected instead of aborting.
+  assert(!sh_compile("y;"));
+  assert(!sh_compile("(add \"a\" 1);"));
+  assert(!sh_compile("(make 1 2);"));
+  assert(!sh_compile("(get 1 2);"));
+  assert(!sh_compile("(x 1);"));
+  assert(!sh_compile("def 1 2;"));
+  assert(!sh_compile("(add (def x 1) 2);"));
+  sh_program *checked = sh_compile(
+      "def m (map); (put m \"a\" 1); (let v (lookup m \"a\") (add v 1.5));");
+  assert(checked);
+  sh_program_free(checked);
+
+  const char *inputs[] = {"x", "y"};
+  sh_program *program =
+      sh_compile_with_inputs("def z (add x y); (sub z 1);", inputs, 2);
+  assert(program);
+  sh_slot x = sh_resolve(program, "x");
+  sh_slot y = sh_resolve(program, "y");
+  sh_slot z = sh_resolve(program, "z");
+  assert(x >= 0 && y >= 0 && z >= 0);
+  assert(sh_resolve(program, "w") < 0);
+
+  // One compiled program run many times from two contexts.
+  sh_context *ctx1 = sh_context_new(program);
+  sh_context *ctx2 = sh_context_new(program);
+  sh_set_var(ctx2, y, 100);
+  for (int64_t i = 0; i < 10; ++i) {
+    sh_set_var(ctx1, x, i);
+    sh_set_var(ctx1, y, i * 2);
+    sh_run(program, ctx1);
+    int64_t val;
+    assert(sh_num_results(ctx1) == 1);
+    assert(!sh_get_result(ctx1, 0, &val) && val == i * 3 - 1);
+    assert(!sh_get_var(ctx1, z, &val) && val == i * 3);
+
+    sh_set_var(ctx2, x, i);
+    sh_run(program, ctx2);
+    assert(!sh_get_result(ctx2, 0, &val) && val == 99 + i);
+  }
+
+  // Slots and results that do not exist are reported, not read.
+  int64_t val = 5;
+  assert(sh_set_var(ctx1, sh_resolve(program, "w"), 1) < 0);
+  assert(sh_set_var(ctx1, 100, 1) < 0);
+  assert(sh_get_var(ctx1, -1, &val) < 0);
+  assert(sh_get_result(ctx1, 1, &val) < 0 && val == 5);
+
+  // Programs that stop early are reported until they run to the end.
+  assert(!sh_error(ctx1));
+  sh_program *failing =
+      sh_compile_with_inputs("def a (make 2); (get a x);", inputs, 1);
+  sh_context *failing_ctx = sh_context_new(failing);
+  sh_set_var(failing_ctx, sh_resolve(failing, "x"), 2);
+  assert(sh_run(failing, failing_ctx) < 0);
+  assert(!strcmp(sh_error(failing_ctx), "Array index 2 out of range"));
+  sh_set_var(failing_ctx, sh_resolve(failing, "x"), 1);
+  assert(!sh_run(failing, failing_ctx) && !sh_error(failing_ctx));
+  assert(!sh_get_result(failing_ctx, 0, &val) && val == 0);
+  sh_context_free(failing_ctx);
+  sh_program_free(failing);
+  sh_context_free(ctx1);
+  sh_context_free(ctx2);
+  sh_program_free(program);
+
+  // Runs with inputs seen before skip statements that only read them.
+  program = sh_compile_with_inputs(
+      "(add (sub (add x 3) x) (add x (sub y 7)));", inputs, 2);
+  assert(program);
+  sh_context *ctx = sh_context_new(program);
+  sh_set_memo_capacity(ctx, 8);
+  for (int64_t i = 0; i < 6; ++i) {
+    sh_set_var(ctx, sh_resolve(program, "x"), i % 2);
+    sh_run(program, ctx);
+    assert(!sh_get_result(ctx, 0, &val) && val == i % 2 - 4);
+  }
+  assert(sh_num_memo_hits(ctx) == 4);
+  sh_context_free(ctx);
+  sh_program_free(program);
+}
+
+void ShortTestSymbolHandles() {
+  const std::string input = "def out (add in 1);";
+  Compiler compiler;
+  assert(compiler.Lex(input).isSuccessful());
+  assert(compiler.Parse().isSuccessful());
+  compiler.getEmitter().DeclareSymbol("in", lang::TYPE_INT);
+  compiler.GenerateByteCode();
+
+  const lang::ByteCodeEmitter &emitter = compiler.getEmitter();
+  lang::SymbolHandle in = emitter.ResolveSymbol("in");
+  lang::SymbolHandle out = emitter.ResolveSymbol("out");
+  assert(in.isValid() && out.isValid());
+  assert(out.getSlot() == emitter.getSymbolID("out"));
+  assert(!emitter.ResolveSymbol("missing").isValid());
+  assert(!lang::SymbolHandle().isValid());
+
+  lang::ByteCodeEvaluator eval(emitter.getConstants(), emitter.getSymbols());
+  for (int64_t i = 0; i < 5; ++i) {
+    eval.setValue(in, i);
+    eval.Interpret(emitter.getByteCode());
+    assert(eval.getValue(out) == i + 1);
+  }
+
+  // Images resolve to the same handles.
+  std::string image = lang::BuildProgramImage(0, emitter);
+  lang::ProgramImage view;
+  assert(view.Attach(image.data(), image.size()));
+  assert(view.ResolveSymbol("out").getSlot() == out.getSlot());
+  assert(!view.ResolveSymbol("missing").isValid());
+}
+
+void ShortTestResultWriter() {
+  const std::string input =
+      "def x 2.5; def a (make 2); (set a 1 7); (let s \"hi\" s); (add 1 2);"
+      "a;";
+  Compiler compiler;
+  compiler.ResetAndRun(input);
+  const lang::ByteCodeEmitter &emitter = compiler.getEmitter();
+  lang::SymbolHandle x = emitter.ResolveSymbol("x");
+  assert(emitter.getSymbolType(x) == lang::TYPE_FLOAT);
+
+  lang::ResultWriter text(compiler.getEvaluator(),
+                          lang::ResultWriter::FORMAT_TEXT);
+  text.WriteEvalStack(emitter.getResultTypes());
+  text.WriteNamed("x", compiler.getEvaluator().getValue(x),
+                  emitter.getSymbolType(x));
+  assert(text.getBuffer() == "hi\n3\n[0, 7]\nx=2.5\n");
+
+  // Floats are written with as many digits as it takes to read them back.
+  lang::ResultWriter floats(compiler.getEvaluator(),
+                            lang::ResultWriter::FORMAT_TEXT);
+  for (double val : {1234567.5, 1.23456789, 0.1, 1e300})
+    floats.Write(lang::FloatToBits(val), lang::TYPE_FLOAT);
+  assert(floats.getBuffer() == "1234567.5\n1.23456789\n0.1\n1e+300\n");
+
+  lang::ResultWriter binary(compiler.getEvaluator(),
+                            lang::ResultWriter::FORMAT_BINARY);
+  binary.WriteEvalStack(emitter.getResultTypes());
+  const std::string &buf = binary.getBuffer();
+  // name_len, kind, str len, chars
+  assert(buf.size() == (4 + 1 + 4 + 2) + (4 + 1 + 8) + (4 + 1 + 4 + 16));
+  assert(buf[4] == lang::TYPE_STR && buf.compare(9, 2, "hi") == 0);
+  int64_t sum;
+  memcpy(&sum, buf.data() + 11 + 5, sizeof(sum));
+  assert(sum == 3);
+  int fd = open("/dev/null", O_WRONLY);
+  assert(binary.Flush(fd));
+  close(fd);
+  assert(binary.getBuffer().empty());
+
+  // Symbol types survive a round trip through an image.
+  std::string image = lang::BuildProgramImage(0, emitter);
+  lang::ProgramImage view;
+  assert(view.Attach(image.data(), image.size()));
+  assert(view.getSymbolType(view.ResolveSymbol("x")) == lang::TYPE_FLOAT);
+  assert(view.getSymbolType(view.ResolveSymbol("a")) == lang::TYPE_ARRAY);
+}
+
+void ShortTestServer() {
+  const std::string path = "/tmp/short_test_" + std::to_string(getpid());
+  lang::ScriptServer server(2, 1024, 64);
+  server.setMemoCapacity(16);
+  assert(server.Listen(path));
+  std::thread serving(&lang::ScriptServer::Serve, &server);
+
+  {
+    // Idle connections do not hold the two workers.
+    lang::ScriptClient idle[4];
+    for (lang::ScriptClient &conn : idle) assert(conn.Connect(path));
+
+    lang::ScriptClient client, other;
+    assert(client.Connect(path) && other.Connect(path));
+    lang::ServerStatus status;
+    std::string output;
+    const std::string input = "def x 2; (add x 1); (let s \"hi\" s);";
+    for (int i = 0; i < 3; ++i) {
+      assert(client.Run(input, status, output));
+      assert(status == lang::SERVER_OK && output == "3\nhi\n");
+    }
+    assert(other.Run("(sub 5 2.5);", status, output));
+    assert(status == lang::SERVER_OK && output == "2.5\n");
+    assert(other.Run("(add 1 2", status, output));
+    assert(status == lang::SERVER_PARSE_FAILED);
+    assert(client.Run("(add 1 2);", status, output) && output == "3\n");
+
+    // Memoized statements give the same values as running them.
+    for (int i = 0; i < 3; ++i) {
+      assert(client.Run("def a " + std::to_string(i % 2) +
+                            "; (add (sub (add a 3) a) (add a (sub a 7)));",
+                        status, output));
+      assert(status == lang::SERVER_OK &&
+             output == std::to_string(i % 2 * 2 - 4) + "\n");
+    }
+
+    // Programs that cannot be emitted are reported, and the server keeps going.
+    assert(other.Run("def x 1; y;", status, output));
+    assert(status == lang::SERVER_COMPILE_FAILED &&
+           output == "1:10: Unknown name y");
+    assert(other.Run("(get 1 2);", status, output));
+    assert(status == lang::SERVER_COMPILE_FAILED);
+
+    // So are programs that stop early when they run.
+    const std::pair<const char *, const char *> failures[] = {
+        {"(get (make 1) 5);", "Array index 5 out of range"},
+        {"(set (make 1) (sub 0 1) 2);", "Array index -1 out of range"},
+        {"(make (sub 0 2));", "Cannot make an array of length -2"},
+        {"(vadd (make 1) (make 2));", "Cannot add arrays of lengths 1 and 2"},
+        {"(lookup (map) 1);", "Key not found in map"},
+    };
+    for (const auto &failure : failures) {
+      assert(other.Run(failure.first, status, output));
+      assert(status == lang::SERVER_RUNTIME_FAILED &&
+             output == failure.second);
+    }
+
+    // Requests over the maximum size close the connection.
+    lang::ScriptClient large;
+    assert(large.Connect(path));
+    assert(!large.Run(std::string(100, ' ') + "1;", status, output));
+    assert(idle[0].Run("(add 2 2);", status, output) && output == "4\n");
+
+    // Every run of the same source after the first used the cache.
+    assert(server.getCache().getNumHits() == 3);
+  }
+
+  server.Stop();
+  serving.join();
+  assert(access(path.c_str(), F_OK));
+}
+
+void ShortTestBatchLoader() {
+  const std::string dir = "/tmp/short_batch_" + std::to_string(getpid());
+  std::vector<std::string> paths;
+  for (int i = 0; i < 100; ++i) {
+    paths.push_back(dir + "_" + std::to_string(i) + ".sh");
+    std::ofstream(paths.back()) << "(add " << i << " 1);";
+  }
+  std::ofstream(dir + "_empty.sh");
+  paths.push_back(dir + "_empty.sh");
+  paths.push_back(dir + "_missing.sh");
+
+  for (auto backend : {lang::BatchLoader::BACKEND_IO_URING,
+                       lang::BatchLoader::BACKEND_THREAD_POOL}) {
+    lang::BatchLoader loader(8, backend);
+    std::vector<int> seen(paths.size());
+    loader.Load(paths, [&](size_t index, bool ok, std::string &contents) {
+      ++seen[index];
+      if (index == paths.size() - 1) {
+        assert(!ok);
+      } else if (index == paths.size() - 2) {
+        assert(ok && contents.empty());
+      } else {
+        assert(ok);
+        assert(Compiler().ResetAndCompile(contents) == index + 1);
+      }
+    });
+    for (int count : seen) assert(count == 1);
+  }
+
+  for (size_t i = 0; i + 1 < paths.size(); ++i) remove(paths[i].c_str());
+}
+
+// Run every script in `paths`, compiling each one as soon as it is read. Each
+// result is written with the path of the script it came from.
+int RunBatch(const std::vector<std::string> &paths,
+             lang::ResultWriter::Format format) {
+  Compiler compiler;
+  lang::ResultWriter writer(compiler.getEvaluator(), format);
+  int exit_code = 0;
+  lang::BatchLoader().Load(paths, [&](size_t index, bool ok,
+                                      std::string &contents) {
+    const std::string &path = paths[index];
+    compiler.ResetComponents();
+    if (!ok || !compiler.Lex(contents).isSuccessful() ||
+        !compiler.Parse().isSuccessful() ||
+        !compiler.Check().isSuccessful()) {
+      std::cerr << "Unable to " << (ok ? "compile " : "read ") << path << "\n";
+      exit_code = 1;
+      return;
+    }
+    compiler.GenerateByteCode();
+    if (!compiler.EvaluateByteCode()) {
+      std::cerr << "Unable to run " << path << ": "
+                << compiler.getEvaluator().getStatus().getMessage() << "\n";
+      exit_code = 1;
+      return;
+    }
+
+    const std::vector<int64_t> &results =
+        compiler.getEvaluator().getEvalStack();
+    for (size_t i = 0; i < results.size(); ++i)
+      writer.WriteNamed(path, results[i],
+                        compiler.getEmitter().getResultTypes()[i]);
+  });
+  return writer.Flush(STDOUT_FILENO) ? exit_code : 1;
+}
+
+void ShortTestByteCodeArchive() {
+  // Blocks with long literal runs, long matches, and overlapping matches.
+  std::string random, repeated(1000, 'a');
+  srand(0);
+  for (int i = 0; i < 5000; ++i) random.push_back(rand());
+  for (const std::string &block :
+       {std::string(), std::string("abc"), random, repeated,
+        random + repeated + random.substr(100, 300) + "abcabcabcabc"}) {
+    std::string compressed = lang::CompressBlock(block.data(), block.size());
+    std::string decompressed(block.size(), '\0');
+    assert(lang::DecompressBlock(compressed.data(), compressed.size(),
+                                 &decompressed[0], decompressed.size()));
+    assert(decompressed == block);
+    if (!block.empty()) {
+      assert(!lang::DecompressBlock(compressed.data(), compressed.size(),
+                                    &decompressed[0], block.size() - 1));
+    }
+  }
+  assert(lang::CompressBlock(repeated.data(), repeated.size()).size() < 20);
+
+  const std::string path = "/tmp/short_test_" + std::to_string(getpid()) +
+                           ".shba";
+  const std::vector<std::string> inputs = {
+      "(add 1 2);", "def x 2; (add x (let s \"s\" 1));",
+      "def a (make 4); (set a 2 5); (sum a);"};
+  lang::ByteCodeArchiveWriter writer;
+  assert(writer.Open(path));
+  Compiler compiler;
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    compiler.ResetComponents();
+    assert(compiler.Lex(inputs[i]).isSuccessful());
+    assert(compiler.Parse().isSuccessful());
+    compiler.GenerateByteCode();
+    assert(writer.Add(lang::HashSource(inputs[i]), compiler.getEmitter()) ==
+           i);
+  }
+  assert(writer.Finish());
+
+  lang::ByteCodeArchive archive;
+  assert(archive.Map(path));
+  assert(archive.getNumPrograms() == inputs.size());
+
+  // Load out of order.
+  const int64_t expected[] = {3, 3, 5};
+  for (uint64_t id : {2, 0, 1}) {
+    lang::ProgramImageBuffer image;
+    assert(archive.Load(id, image));
+    assert(image.getSourceHash() == lang::HashSource(inputs[id]));
+    assert(compiler.EvaluateImage(image) == expected[id]);
+  }
+
+  // An image size no block could decompress to is rejected before anything
+  // that large is allocated.
+  archive.Unmap();
+  std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+  lang::ByteCodeArchiveHeader header;
+  file.read(reinterpret_cast<char *>(&header), sizeof(header));
+  lang::ByteCodeArchiveEntry entry;
+  file.seekg(header.index_offset);
+  file.read(reinterpret_cast<char *>(&entry), sizeof(entry));
+  entry.image_size = entry.compressed_size * lang::kMaxExpansionRatio + 1;
+  file.seekp(header.index_offset);
+  file.write(reinterpret_cast<const char *>(&entry), sizeof(entry));
+  file.close();
+  assert(!archive.Map(path));
+  remove(path.c_str());
+}
+
+// Evaluate `input` emitted straight from the AST and emitted through the IR
+// with `passes`, and check both leave the same results and globals.
+void CheckSameThroughIR(const std::string &input, lang::PassManager &passes) {
+  Compiler direct, through_ir;
+  direct.ResetAndRun(input);
+
+  assert(through_ir.Lex(input).isSuccessful());
+  assert(through_ir.Parse().isSuccessful());
+  through_ir.GenerateByteCode(passes);
+  through_ir.EvaluateByteCode();
+
+  const lang::ByteCodeEmitter &emitter = through_ir.getEmitter();
+  assert(emitter.getResultTypes() == direct.getEmitter().getResultTypes());
+  const std::vector<int64_t> &results =
+      through_ir.getEvaluator().getEvalStack();
+  const std::vector<int64_t> &expected = direct.getEvaluator().getEvalStack();
+  assert(results.size() == expected.size());
+  for (size_t i = 0; i < results.size(); ++i) {
+    // Array and map handles may differ, but not what they hold.
+    std::ostringstream result, expected_result;
+    through_ir.getEvaluator().DumpValue(result, results[i],
+                                        emitter.getResultTypes()[i]);
+    direct.getEvaluator().DumpValue(expected_result, expected[i],
+                                    emitter.getResultTypes()[i]);
+    assert(result.str() == expected_result.str());
+  }
+  for (const auto &symbol : direct.getEmitter().getSymbols()) {
+    lang::SymbolHandle handle = emitter.ResolveSymbol(symbol.first);
+    if (!handle.isValid()) continue;
+    lang::SymbolHandle expected_handle(symbol.second);
+    assert(emitter.getSymbolType(handle) ==
+           direct.getEmitter().getSymbolType(expected_handle));
+  }
+}
+
+void ShortTestIR() {
+  const std::string input = "def x 2; (add x (let y 3 (sub y 1)));";
+  Compiler compiler;
+  assert(compiler.Lex(input).isSuccessful());
+  assert(compiler.Parse().isSuccessful());
+  unique<lang::IRFunction> func =
+      lang::BuildIR(compiler.getModule(), compiler.getEmitter());
+  std::ostringstream dump;
+  func->Dump(dump);
+  assert(dump.str() ==
+         "%0 = int 2\n"
+         "store x %0\n"
+         "%2 = load.int x\n"
+         "%3 = int 3\n"
+         "%4 = int 1\n"
+         "%5 = sub.int %3 %4\n"
+         "%6 = add.int %2 %5\n"
+         "result %6\n");
+
+  // Without lets, lowering gives back what the emitter makes.
+  lang::PassManager no_passes;
+  const std::string no_lets = "def x 2; (add x (sub 5 x)); def y (add x 1.5);";
+  Compiler direct;
+  direct.ResetAndRun(no_lets);
+  compiler.ResetComponents();
+  assert(compiler.Lex(no_lets).isSuccessful());
+  assert(compiler.Parse().isSuccessful());
+  compiler.GenerateByteCode(no_passes);
+  assert(compiler.getEmitter().getByteCode() ==
+         direct.getEmitter().getByteCode());
+  assert(compiler.getEmitter().getNumLocals() == 0);
+
+  lang::PassManager passes;
+  passes.AddPass(std::make_unique<lang::ConstantFoldingPass>());
+  passes.AddPass(std::make_unique<lang::DeadCodeEliminationPass>());
+  for (lang::PassManager *pm : {&no_passes, &passes}) {
+    CheckSameThroughIR(input, *pm);
+    CheckSameThroughIR(no_lets, *pm);
+    CheckSameThroughIR("(add 1 (sub 2.5 (let z 4 z)));", *pm);
+    CheckSameThroughIR(
+        "def a (make 10); (set a 3 5); (set a 9 7); def b (vadd a a);"
+        "(add (sum b) (get a 3));",
+        *pm);
+    CheckSameThroughIR(
+        "def m (map); (put m 0 10); (put m \"a\" 20); (put m \"a\" 21);"
+        "(add (lookup m 0) (lookup m \"a\"));",
+        *pm);
+
+    // Values used more than once.
+    CheckSameThroughIR(
+        "def x 5; (let y (add x 1) (add (sub y x) (let z y (add z y))));"
+        "(let s \"hi\" s); def x (add x x); x;",
+        *pm);
+  }
+
+  // Folding leaves a single push.
+  compiler.ResetComponents();
+  assert(compiler.Lex("(add 1 (sub 5.5 2));").isSuccessful());
+  assert(compiler.Parse().isSuccessful());
+  compiler.GenerateByteCode(passes);
+  assert(compiler.getEmitter().getByteCode().size() == 2);
+  compiler.EvaluateByteCode();
+  assert(lang::BitsToFloat(compiler.getEvaluator().getEvalStack()[0]) == 4.5);
+}
+
+void ShortTestCommonSubexpressions() {
+  const std::string input =
+      "def x (sum (make 3)); def a (sub x 1); def b (sub x 1);"
+      "(add (sub x 1) (add a b)); def x 7; (sub x 1); (add x (sub x 1));";
+  lang::PassManager passes;
+  lang::AddOptimizationPasses(passes);
+  CheckSameThroughIR(input, passes);
+
+  // (sub x 1) is computed once before x is reassigned, and folded once x is a
+  // known constant. The loads left over are dead.
+  Compiler compiler;
+  assert(compiler.Lex(input).isSuccessful());
+  assert(compiler.Parse().isSuccessful());
+  unique<lang::IRFunction> func =
+      lang::BuildIR(compiler.getModule(), compiler.getEmitter());
+  lang::CommonSubexpressionEliminationPass cse;
+  assert(cse.Run(*func));
+  std::ostringstream dump;
+  func->Dump(dump);
+  assert(dump.str() ==
+         "%0 = int 3\n"
+         "%1 = builtin.11 %0\n"
+         "%2 = builtin.14 %1\n"
+         "store x %2\n"
+         "%4 = load.int x\n"
+         "%5 = int 1\n"
+         "%6 = sub.int %4 %5\n"
+         "store a %6\n"
+         "%8 = load.int x\n"
+         "store b %6\n"
+         "%12 = load.int x\n"
+         "%15 = load.int a\n"
+         "%16 = load.int b\n"
+         "%17 = add.int %15 %16\n"
+         "%18 = add.int %6 %17\n"
+         "result %18\n"
+         "%20 = int 7\n"
+         "store x %20\n"
+         "%24 = int 6\n"
+         "result %24\n"
+         "%30 = int 13\n"
+         "result %30\n");
+  assert(cse.getNumEliminated() == 10);
+  assert(cse.getNumForwarded() == 3);
+  assert(cse.getNumFolded() == 3);
+
+  // The reused (sub x 1) lives in a temporary local.
+  compiler.ResetAndRun(input, passes);
+  assert(compiler.getEmitter().getNumLocals() == 1);
+  Compiler direct;
+  direct.ResetAndRun(input);
+  assert(compiler.getEmitter().getByteCode().size() <
+         direct.getEmitter().getByteCode().size());
+  assert(compiler.getEvaluator().getEvalStack() ==
+         direct.getEvaluator().getEvalStack());
+
+  // Builtins are never reused since the arrays they read can change.
+  CheckSameThroughIR(
+      "def a (make 4); (set a 0 1); def s (sum a); (set a 0 2); (sum a);"
+      "(add s (sum a));",
+      passes);
+  CheckSameThroughIR(
+      "def x 1; def y (add x 0.5); def x 2.5; (add x (add x 1));", passes);
+  CheckSameThroughIR("def s \"hi\"; (let t \"hi\" s); \"hi\";", passes);
+
+  std::ostringstream stats;
+  passes.DumpStats(stats);
+  assert(stats.str().find("common-subexpression-elimination: ") !=
+         std::string::npos);
+}
+
+void ShortTestAlgebraicSimplification() {
+  const std::string input =
+      "def x (sum (make 3)); def y (sum (make 4));"
+      "(sub (add x 5) 3); (sub (add x y) (sub x 4)); (sub x x);"
+      "(add 1 (add 2 (add x (add 3 y)))); (sub 0 (add x 1));"
+      "(add (add x x) (sub x 1)); (sub (sub x 2000000000) 2000000000);"
+      "(add (sub x y) 0.5);";
+  lang::PassManager passes;
+  lang::AddOptimizationPasses(passes);
+  CheckSameThroughIR(input, passes);
+
+  // Constants are folded across the tree and x cancels out.
+  Compiler compiler;
+  assert(compiler.Lex("(sub (add x 5) 3); (sub (add x y) (sub x 4));"
+                      "(sub x x); (sub 0 (add x 1));")
+             .isSuccessful());
+  assert(compiler.Parse().isSuccessful());
+  unique<lang::IRFunction> func =
+      lang::BuildIR(compiler.getModule(), compiler.getEmitter(),
+                    {{"x", lang::TYPE_INT}, {"y", lang::TYPE_INT}});
+  lang::AlgebraicSimplificationPass simplification;
+  assert(simplification.Run(*func));
+  lang::DeadCodeEliminationPass dce;
+  assert(dce.Run(*func));
+  std::ostringstream dump;
+  func->Dump(dump);
+  assert(dump.str() ==
+         "%0 = load.int x\n"
+         "%24 = int 2\n"
+         "%25 = add.int %0 %24\n"
+         "result %25\n"
+         "%7 = load.int y\n"
+         "%26 = int 4\n"
+         "%27 = add.int %7 %26\n"
+         "result %27\n"
+         "%28 = int 0\n"
+         "result %28\n"
+         "%19 = load.int x\n"
+         "%29 = int -1\n"
+         "%30 = sub.int %29 %19\n"
+         "result %30\n");
+  assert(simplification.getNumSimplified() == 4);
+  assert(simplification.getNumOpsRemoved() == 5);
+
+  // Trees that are already minimal are left alone.
+  assert(compiler.Lex("(add (add x x) (sub x 1)); (add (sub x y) 0.5);")
+             .isSuccessful());
+  assert(compiler.Parse().isSuccessful());
+  func = lang::BuildIR(compiler.getModule(), compiler.getEmitter(),
+                       {{"x", lang::TYPE_INT}, {"y", lang::TYPE_INT}});
+  assert(!simplification.Run(*func));
+}
+
+void ShortTestDeadStores() {
+  // a is stored again before it is read, c and e are never read once their
+  // values are known, and only d is read by a builtin.
+  const std::string input =
+      "def a (sum (make 2)); def b (make 3); def a 3; def c (add a 1);"
+      "def d (make 5); (set d 0 c); def e (map); (add c (sum d));";
+  Compiler direct;
+  direct.ResetAndRun(input);
+  assert(direct.getEmitter().getSymbols().size() == 5);
+
+  lang::PassManager passes;
+  lang::AddOptimizationPasses(passes);
+  Compiler compiler;
+  compiler.ResetAndRun(input, passes);
+  const lang::ByteCodeEmitter &emitter = compiler.getEmitter();
+  assert(emitter.getSymbols().size() == 1);
+  assert(emitter.ResolveSymbol("d").getSlot() == 0);
+  assert(emitter.getByteCode().size() <
+         direct.getEmitter().getByteCode().size());
+  assert(compiler.getEvaluator().getEvalStack().back() == 8);
+
+  const auto &dse = static_cast<const lang::DeadStoreEliminationPass &>(
+      *passes.getPasses()[2]);
+  assert(std::string(dse.getName()) == "dead-store-elimination");
+  assert(dse.getNumStoresRemoved() == 5);
+  assert(dse.getNumGlobalsRemoved() == 4);
+  CheckSameThroughIR(input, passes);
+
+  // Globals read after the program runs keep their last store, and the IDs
+  // stay dense.
+  lang::PassManager keep_a;
+  lang::AddOptimizationPasses(keep_a, {"a", "e"});
+  compiler.ResetAndRun(input, keep_a);
+  assert(compiler.getEmitter().getSymbols().size() == 3);
+  for (const auto &symbol : compiler.getEmitter().getSymbols())
+    assert(symbol.second < 3);
+  lang::SymbolHandle a = compiler.getEmitter().ResolveSymbol("a");
+  assert(compiler.getEvaluator().getValue(a) == 3);
+}
+
+void ShortTestGlobalCoalescing() {
+  // Each t is last read when the next one is stored, and u is read after tc
+  // is stored again. s is kept.
+  const std::string input =
+      "def ta (sum (make 1)); def tb (add ta 1); def u (add tb 2);"
+      "def tc (add tb ta); def s (add tc u); def tc (sub s 1);"
+      "def td (add tc 1); (add td u);";
+  lang::PassManager passes;
+  lang::AddOptimizationPasses(passes, {"s"});
+  CheckSameThroughIR(input, passes);
+
+  Compiler direct, compiler;
+  direct.ResetAndRun(input);
+  compiler.ResetAndRun(input, passes);
+  assert(direct.getEmitter().getSymbols().size() == 6);
+  assert(compiler.getEmitter().getSymbols().size() == 4);
+  assert(compiler.getEvaluator().getEvalStack() ==
+         direct.getEvaluator().getEvalStack());
+  lang::SymbolHandle s = compiler.getEmitter().ResolveSymbol("s");
+  lang::SymbolHandle expected_s = direct.getEmitter().ResolveSymbol("s");
+  assert(compiler.getEvaluator().getValue(s) ==
+         direct.getEvaluator().getValue(expected_s));
+
+  const auto &coalescing = static_cast<const lang::GlobalCoalescingPass &>(
+      *passes.getPasses().back());
+  assert(std::string(coalescing.getName()) == "global-coalescing");
+
+  // y takes the slot of the first x, so the second x needs a slot of its own
+  // that is not also named x.
+  const std::string renamed =
+      "def a (make 3); (set a 1 7); (set a 2 9); def x (get a 0); x;"
+      "def y (get a 1); def x (get a 2); y; x; (sum a);";
+  lang::PassManager renamed_passes;
+  lang::AddOptimizationPasses(renamed_passes);
+  CheckSameThroughIR(renamed, renamed_passes);
+  compiler.ResetAndRun(renamed, renamed_passes);
+  assert(compiler.getEmitter().getSymbols().size() == 3);
+
+  // A long chain of temporaries needs one slot, and inputs keep theirs.
+  auto get_temp = [](int i) {
+    std::string name = "t";
+    for (; i; i /= 26) name.push_back('a' + i % 26);
+    return name;
+  };
+  std::string chain = "def " + get_temp(0) + " (add n 1);";
+  for (int i = 1; i < 1000; ++i) {
+    chain += " def " + get_temp(i) + " (add " + get_temp(i - 1) + " n);";
+  }
+  chain += get_temp(999) + ";";
+  compiler.ResetComponents();
+  compiler.getEmitter().DeclareSymbol("n", lang::TYPE_INT);
+  assert(compiler.Lex(chain).isSuccessful());
+  assert(compiler.Parse().isSuccessful());
+  lang::PassManager chain_passes;
+  lang::AddOptimizationPasses(chain_passes);
+  compiler.GenerateByteCode(chain_passes);
+  assert(compiler.getEmitter().getSymbols().size() == 2);
+  const auto &chain_coalescing =
+      static_cast<const lang::GlobalCoalescingPass &>(
+          *chain_passes.getPasses().back());
+  assert(chain_coalescing.getNumRanges() == 1000);
+  assert(chain_coalescing.getNumSlots() == 1);
+  compiler.EvaluateByteCode();
+  assert(compiler.getEvaluator().getEvalStack().back() == 1);
+}
+
+void ShortTestOptLevels() {
+  const std::string input =
+      "def x (sum (make 3)); def a (add x 1); def b (add x 1);"
+      "def t (add a (sub 5 3)); (sub (add t b) (sub t 3)); def x 4;"
+      "(add x (sub x 1));";
+  const size_t num_passes[] = {0, 2, 4, 5};
+  Compiler direct;
+  direct.ResetAndRun(input);
+  std::vector<size_t> sizes = {direct.getEmitter().getByteCode().size()};
+  std::vector<size_t> num_symbols = {direct.getEmitter().getSymbols().size()};
+  for (unsigned level = 1; level <= lang::kMaxOptLevel; ++level) {
+    Compiler compiler;
+    compiler.setOptLevel(level);
+    assert(compiler.getOptLevel() == level);
+    assert(compiler.getPasses()->getPasses().size() == num_passes[level]);
+    compiler.ResetAndRun(input);
+    assert(compiler.getEvaluator().getEvalStack() ==
+           direct.getEvaluator().getEvalStack());
+    sizes.push_back(compiler.getEmitter().getByteCode().size());
+    num_symbols.push_back(compiler.getEmitter().getSymbols().size());
+  }
+
+  // Folding shrinks the code, then reusing values does, then the globals
+  // share slots.
+  assert(sizes[1] < sizes[0]);
+  assert(sizes[2] < sizes[1]);
+  assert(sizes[3] == sizes[2]);
+  assert(num_symbols[3] < num_symbols[2]);
+
+  // Kept globals can still be read, and level 0 goes back to emitting
+  // straight from the AST.
+  Compiler compiler;
+  compiler.setOptLevel(lang::kMaxOptLevel, {"t"});
+  compiler.ResetAndRun(input);
+  lang::SymbolHandle t = compiler.getEmitter().ResolveSymbol("t");
+  assert(t.isValid() && compiler.getEvaluator().getValue(t) == 3);
+  assert(!compiler.getEmitter().ResolveSymbol("a").isValid());
+  compiler.setOptLevel(0);
+  assert(!compiler.getPasses());
+  compiler.ResetAndRun(input);
+  assert(compiler.getEmitter().getByteCode() ==
+         direct.getEmitter().getByteCode());
+
+  // Programs that do not check are reported at every level instead of
+  // asserting or running with the wrong objects.
+  for (unsigned level = 0; level <= lang::kMaxOptLevel; ++level) {
+    compiler.setOptLevel(level);
+    std::string error;
+    assert(!compiler.ResetAndTryRun("(5);", error));
+    assert(error == "1:1: Only builtins can be called");
+    assert(!compiler.ResetAndTryRun(
+        "def a (make 3); (set a 0 9); def m (map); (sum m);", error));
+    assert(error == "1:48: Argument 1 of sum cannot be a map");
+    assert(!compiler.ResetAndTryRun("(add 1", error));
+    assert(compiler.ResetAndTryRun(input, error));
+    assert(compiler.getEvaluator().getEvalStack() ==
+           direct.getEvaluator().getEvalStack());
+  }
+}
+
+void ShortTestDisassembler() {
+  Compiler compiler;
+  compiler.ResetAndRun(
+      "def x 2.5; def s \"a long str that gets cut short\";\n"
+      "(add x 1); (let y 3 (add y 1)); (put (map) s 1);");
+  std::vector<std::string> texts;
+  for (const auto &instr : lang::DisassembleByteCode(compiler.getEmitter()))
+    texts.push_back(instr.text);
+  const std::vector<std::string> expected = {
+      "push symbol x",
+      "push float 2.5",
+      "store x",
+      "push symbol s",
+      "push str \"a long str that gets cut\"...",
+      "store s",
+      "load x",
+      "push int 1",
+      "int_to_float 0",
+      "add.f",
+      "push int 3",
+      "store_local 0",
+      "load_local 0",
+      "push int 1",
+      "add",
+      "map",
+      "load s",
+      "push 1",
+      "put str",
+  };
+  assert(texts == expected);
+
+  std::ostringstream dump;
+  lang::DumpDisassembly(compiler.getEmitter(), dump);
+  assert(dump.str().find("; line 1, col 1\n     0: push symbol x\n") == 0);
+  assert(dump.str().find("; line 2, col 12\n    17: push int 3\n") !=
+         std::string::npos);
+
+  // Only the instructions that changed are shown.
+  const std::string input =
+      "def x (sum (make 3)); def a (add x 1); (sub (add a 5) (sub a 3));";
+  Compiler optimized;
+  optimized.setOptLevel(2);
+  optimized.ResetAndRun(input);
+  compiler.ResetAndRun(input);
+  std::ostringstream diff;
+  assert(lang::DumpByteCodeDiff(compiler.getEmitter(), optimized.getEmitter(),
+                                diff) == 8);
+  assert(diff.str().find("before: 17 instrs, 26 codes, 2 globals") == 0);
+  assert(diff.str().find("+    15: push int 8\n") != std::string::npos);
+  std::ostringstream same;
+  assert(!lang::DumpByteCodeDiff(compiler.getEmitter(), compiler.getEmitter(),
+                                 same));
+}
+
+void ShortTestMemoization() {
+  // Only the first and third statements are pure and long enough to be worth
+  // remembering. The second stores to a global, the fourth is too short, and
+  // the last reads an array.
+  Compiler compiler;
+  lang::ByteCodeEmitter &emitter = compiler.getEmitter();
+  uint64_t a = emitter.DeclareSymbol("a", lang::TYPE_INT);
+  uint64_t b = emitter.DeclareSymbol("b", lang::TYPE_INT);
+  assert(compiler
+             .Lex("(add (sub (add a 3) b) (add a (sub b 7))); def c (add a 1);"
+                  "(let y (add c 3) (sub (add y b) (add y 1))); (add a 1);"
+                  "(add (sum (make 2)) (add a (add b 1)));")
+             .isSuccessful());
+  assert(compiler.Parse().isSuccessful());
+  compiler.GenerateByteCode();
+  std::vector<lang::MemoizableStmt> stmts = emitter.FindMemoizableStmts();
+  assert(stmts.size() == 2);
+  assert(stmts[0].symbols == std::vector<uint64_t>({a, b}));
+  assert(stmts[1].symbols ==
+         std::vector<uint64_t>({b, emitter.getSymbolID("c")}));
+
+  lang::ByteCodeEvaluator eval(emitter.getConstants(), emitter.getSymbols(),
+                               emitter.getNumLocals());
+  lang::ByteCodeEvaluator expected(
+      emitter.getConstants(), emitter.getSymbols(), emitter.getNumLocals());
+  eval.setMemoCapacity(3);
+  auto run = [&](int64_t a_val, int64_t b_val) {
+    for (lang::ByteCodeEvaluator *e : {&eval, &expected}) {
+      e->ResetRunState();
+      e->setValue(lang::SymbolHandle(a), a_val);
+      e->setValue(lang::SymbolHandle(b), b_val);
+    }
+    eval.InterpretMemoized(emitter.getByteCode(), stmts);
+    expected.Interpret(emitter.getByteCode());
+    assert(eval.getEvalStack() == expected.getEvalStack());
+  };
+  run(1, 2);
+  run(3, 4);
+  assert(eval.getNumMemoHits() == 0 && eval.getNumMemoMisses() == 4);
+  assert(eval.getNumMemoEntries() == 1);  // Dropped once it had 3.
+  run(3, 4);
+  assert(eval.getNumMemoHits() == 1 && eval.getNumMemoMisses() == 5);
+  run(3, 5);
+  assert(eval.getNumMemoHits() == 1 && eval.getNumMemoMisses() == 7);
+
+  // Turned off, nothing is remembered.
+  eval.setMemoCapacity(0);
+  assert(eval.getNumMemoEntries() == 0);
+  run(3, 5);
+  assert(eval.getNumMemoMisses() == 7);
+
+  // Through the compiler, values are remembered across programs.
+  compiler.ResetComponents();
+  compiler.setMemoCapacity(16);
+  const std::string input =
+      "def a 4; (add (sub (add a 3) a) (add a (sub a 7)));";
+  compiler.ResetAndRun(input);
+  compiler.ResetAndRun(input);
+  assert(compiler.getEvaluator().getNumMemoHits() == 1);
+  assert(compiler.getEvaluator().getEvalStack().back() == 4);
+
+  // Statements whose hashes collide do not share values.
+  compiler.ResetComponents();
+  assert(compiler.Lex("def a 4; (add (sub (add a 3) a) (add a (sub a 7))); "
+                      "(add (sub (add a 5) a) (add a (sub a 7)));")
+             .isSuccessful());
+  assert(compiler.Parse().isSuccessful());
+  compiler.GenerateByteCode();
+  stmts = compiler.getEmitter().FindMemoizableStmts();
+  assert(stmts.size() == 2);
+  stmts[1].code_hash = stmts[0].code_hash;
+  lang::ByteCodeEvaluator colliding(compiler.getEmitter().getConstants(),
+                                    compiler.getEmitter().getSymbols(),
+                                    compiler.getEmitter().getNumLocals());
+  colliding.setMemoCapacity(16);
+  colliding.InterpretMemoized(compiler.getEmitter().getByteCode(), stmts);
+  assert(colliding.getNumMemoHits() == 0);
+  assert(colliding.getEvalStack() == std::vector<int64_t>({4, 6}));
+}
+
+void ShortTestInlining() {
+  lang::IRFunctionTable functions;
+  assert(lang::DefineFunction(functions, "inc", {{"v", lang::TYPE_INT}},
+                              "(add v 1);"));
+  assert(lang::DefineFunction(functions, "dist",
+                              {{"a", lang::TYPE_INT}, {"b", lang::TYPE_INT}},
+                              "(sub (inc a) (inc b));"));
+  assert(!lang::DefineFunction(functions, "bad", {}, "(add 1"));
+  std::ostringstream dump;
+  functions.at("dist")->Dump(dump);
+  assert(dump.str() ==
+         "%0 = param.int 0\n"
+         "%1 = call inc %0\n"
+         "%2 = param.int 1\n"
+         "%3 = call inc %2\n"
+         "%4 = sub.int %1 %3\n");
+
+  // Every call is inlined, so the whole program folds to one push.
+  lang::PassManager passes;
+  passes.AddPass(std::make_unique<lang::InliningPass>(functions));
+  lang::AddOptimizationPasses(passes);
+  Compiler compiler;
+  assert(compiler.Lex("def x 5; (add (inc x) (dist (inc 2) x));")
+             .isSuccessful());
+  assert(compiler.Parse().isSuccessful());
+  assert(compiler.GenerateByteCode(passes, &functions));
+  compiler.EvaluateByteCode();
+  assert(compiler.getEvaluator().getEvalStack().back() == 4);
+  assert(compiler.getEmitter().getByteCode().size() == 2);
+  const auto &inlining =
+      static_cast<const lang::InliningPass &>(*passes.getPasses().front());
+  assert(inlining.getNumInlined() == 5);
+  assert(inlining.getNumNotInlined() == 0);
+
+  // Large functions are only inlined when constant arguments make up for it.
+  assert(lang::DefineFunction(functions, "big", {{"a", lang::TYPE_INT}},
+                              "(add (add a 1) (add a 2));"));
+  assert(functions.at("big")->getNumInstrs() == 7);
+  lang::InliningPass small(functions, 3);
+  assert(compiler.Lex("def x 5; (add (big x) (big 3));").isSuccessful());
+  assert(compiler.Parse().isSuccessful());
+  unique<lang::IRFunction> func = lang::BuildIR(
+      compiler.getModule(), compiler.getEmitter(), {}, &functions);
+  assert(small.Run(*func));
+  assert(small.getNumInlined() == 1 && small.getNumNotInlined() == 1);
+
+  // A call left behind fails compilation instead of reaching lowering.
+  lang::PassManager small_passes;
+  small_passes.AddPass(std::make_unique<lang::InliningPass>(functions, 3));
+  size_t num_codes = compiler.getEmitter().getByteCode().size();
+  assert(!compiler.GenerateByteCode(small_passes, &functions));
+  assert(compiler.getEmitter().getByteCode().size() == num_codes);
+
+  // Recursive calls are inlined once and then left alone.
+  auto loop = std::make_unique<lang::IRFunction>();
+  loop->AddParam(lang::TYPE_INT);
+  lang::IRInstr *param = loop->AppendInstr(lang::IR_PARAM, lang::TYPE_INT);
+  lang::IRInstr *call = loop->AppendInstr(lang::IR_CALL, lang::TYPE_INT);
+  call->setName("loop");
+  call->AddOperand(param);
+  loop->setReturnValue(call);
+  functions["loop"] = std::move(loop);
+  assert(compiler.Lex("(loop 1);").isSuccessful());
+  assert(compiler.Parse().isSuccessful());
+  func = lang::BuildIR(compiler.getModule(), compiler.getEmitter(), {},
+                       &functions);
+  lang::InliningPass recursive(functions);
+  assert(recursive.Run(*func));
+  assert(recursive.getNumInlined() == 1 && recursive.getNumNotInlined() == 1);
+  dump.str("");
+  func->Dump(dump);
+  assert(dump.str() ==
+         "%0 = int 1\n"
+         "%3 = call loop %0\n"
+         "result %3\n");
+  lang::PassManager recursive_passes;
+  recursive_passes.AddPass(std::make_unique<lang::InliningPass>(functions));
+  assert(!compiler.GenerateByteCode(recursive_passes, &functions));
+
+  // Globals a function assigns are private to each call.
+  assert(lang::DefineFunction(functions, "twice", {{"v", lang::TYPE_INT}},
+                              "def t (add v v); def t (add t 1); t;"));
+  lang::PassManager twice_passes;
+  twice_passes.AddPass(std::make_unique<lang::InliningPass>(functions));
+  lang::AddOptimizationPasses(twice_passes);
+  compiler.ResetComponents();
+  assert(compiler.Lex("def t 100; (add (twice 2) (twice t)); t;")
+             .isSuccessful());
+  assert(compiler.Parse().isSuccessful());
+  assert(compiler.GenerateByteCode(twice_passes, &functions));
+  compiler.EvaluateByteCode();
+  assert(compiler.getEvaluator().getEvalStack() ==
+         std::vector<int64_t>({206, 100}));
+}
+
+void ShortTestSpecializer() {
+  const std::string source =
+      "def scale (add rate 2); def total (add base scale);"
+      "(add total (sub rate 1)); (add total n); def rate 0; rate;";
+  lang::KnownValues known = {{"rate", lang::KnownValue::Int(3)},
+                             {"base", lang::KnownValue::Int(10)}};
+  lang::ProgramImageBuffer program;
+  assert(lang::CompileSpecialized(source, known, {"n"}, program));
+
+  // Everything but (add total n) is precomputed. The known globals are never
+  // loaded, so only rate gets a symbol, since the script assigns it.
+  assert(!program.ResolveSymbol("base").isValid());
+  lang::SymbolHandle n = program.ResolveSymbol("n");
+  assert(n.isValid());
+  size_t num_loads = 0;
+  for (uint64_t i = 0; i < program.getNumByteCodes(); ++i) {
+    if (program.getByteCode()[i].instr == lang::INSTR_LOAD) {
+      assert(program.getByteCode()[i + 1].value == n.getSlot());
+      ++num_loads;
+    }
+  }
+  assert(num_loads == 1);
+
+  lang::ByteCodeEvaluator eval;
+  eval.InitializeImage(program);
+  eval.setValue(n, 100);
+  eval.InterpretImage();
+  assert((eval.getEvalStack() == std::vector<int64_t>{17, 115, 0}));
+  assert(eval.getValue(program.ResolveSymbol("total")) == 15);
+
+  // Other known types.
+  assert(lang::CompileSpecialized(
+      "(add x 0.5);", {{"x", lang::KnownValue::Float(2)}}, {}, program));
+  eval.ResetRunState();
+  eval.InitializeImage(program);
+  eval.InterpretImage();
+  assert(lang::BitsToFloat(eval.getEvalStack()[0]) == 2.5);
+  assert(lang::CompileSpecialized(
+      "s;", {{"s", lang::KnownValue::Str("hi")}}, {}, program));
+  eval.ResetRunState();
+  eval.InitializeImage(program);
+  eval.InterpretImage();
+  std::ostringstream str;
+  eval.DumpValue(str, eval.getEvalStack()[0], lang::TYPE_STR);
+  assert(str.str() == "hi");
+
+  assert(!lang::CompileSpecialized("(add 1", known, {}, program));
+
+  // Scripts that do not check with the inputs and known values declared.
+  assert(!lang::CompileSpecialized("(add n 1);", known, {}, program));
+  assert(!lang::CompileSpecialized(
+      "(add s 1);", {{"s", lang::KnownValue::Str("hi")}}, {}, program));
+  assert(!lang::CompileSpecialized(
+      "(sum n);", {{"n", lang::KnownValue::Int(1)}}, {"n"}, program));
+  assert(lang::CompileSpecialized("(add n 1);", {}, {"n"}, program));
+
+  // Programs are cached by source and known values.
+  lang::SpecializationCache cache(2);
+  auto first = cache.Get(source, known, {"n"});
+  assert(first && cache.Get(source, known, {"n"}) == first);
+  known["base"] = lang::KnownValue::Int(20);
+  auto second = cache.Get(source, known, {"n"});
+  assert(second && second != first);
+  assert(cache.getNumHits() == 1 && cache.getNumMisses() == 2);
+  assert(!cache.Get("(add 1", known));
+  assert(!cache.Get("y;", known));
+}
+
+// Compile every script in `paths` into an archive. Each one's ID is its
+// position in `paths`.
+int MakeArchive(const std::string &archive_path,
+                const std::vector<std::string> &paths) {
+  lang::ByteCodeArchiveWriter writer;
+  if (!writer.Open(archive_path)) {
+    std::cerr << "Unable to create " << archive_path << "\n";
+    return 1;
+  }
+  Compiler compiler;
+  for (const std::string &path : paths) {
+    std::ifstream in(path);
+    std::string source((std::istreambuf_iterator<char>(in)),
+                       std::istreambuf_iterator<char>());
+    compiler.ResetComponents();
+    if (!in || !compiler.Lex(source).isSuccessful() ||
+        !compiler.Parse().isSuccessful() ||
+        !compiler.Check().isSuccessful()) {
+      std::cerr << "Unable to compile " << path << "\n";
+      return 1;
+    }
+    compiler.GenerateByteCode();
+    writer.Add(lang::HashSource(source), compiler.getEmitter());
+  }
+  if (!writer.Finish()) {
+    std::cerr << "Unable to write " << archive_path << "\n";
+    return 1;
+  }
+  return 0;
+}
+
+void RunSelfTests() {
   ShortTest();
   ShortTestExample();
   ShortTestAssign();
   ShortTestCompileBackToBack();
-  if (argc < 2) return 0;
+  ShortTestIntLiterals();
+  ShortTestArrays();
+  ShortTestMaps();
+  ShortTestFloats();
+  ShortTestLet();
+  ShortTestByteCodeFile();
+  ShortTestSharedByteCode();
+  ShortTestStream();
+  ShortTestEmbed();
+  ShortTestSymbolHandles();
+  ShortTestResultWriter();
+  ShortTestServer();
+  ShortTestBatchLoader();
+  ShortTestByteCodeArchive();
+  ShortTestIR();
+  ShortTestCommonSubexpressions();
+  ShortTestAlgebraicSimplification();
+  ShortTestDeadStores();
+  ShortTestGlobalCoalescing();
+  ShortTestOptLevels();
+  ShortTestDisassembler();
+  ShortTestMemoization();
+  ShortTestInlining();
+  ShortTestSpecializer();
+}
 
-  std::string input(argv[1]);
-  std::cout << Compiler().ResetAndCompile(input) << std::endl;
+int main(int argc, char **argv) {
+  // The self-tests run with no arguments or with --test, so running a program
+  // does not pay for them.
+  //
+  // a.out [--test]
+  // a.out [--cache FILE.shbc] [--all-results] [--var NAME]... [--binary]
+  //       [-O0|-O1|-O2|-O3|--optimize] [--opt-stats] [--disassemble]
+  //       [--diff-bytecode] SOURCE
+  // a.out --stream < SOURCE
+  // a.out --serve SOCKET [--workers N] [--memo N]
+  // a.out --batch [--binary] FILE...
+  // a.out --make-archive FILE.shba FILE...
+  // a.out --archive FILE.shba --program ID [--all-results] [--var NAME]...
+  std::string input, cache_path, socket_path, archive_path, new_archive_path;
+  uint64_t program_id = 0;
+  std::vector<std::string> script_paths;
+  unsigned num_workers = std::thread::hardware_concurrency();
+  size_t memo_capacity = 0;
+  std::vector<std::string> var_names;
+  bool run_tests = argc == 1, stream = false, all_results = false,
+       batch = false, opt_stats = false, disassemble = false,
+       diff_bytecode = false;
+  unsigned opt_level = 0;
+  lang::ResultWriter::Format format = lang::ResultWriter::FORMAT_TEXT;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg == "--cache" && i + 1 < argc)
+      cache_path = argv[++i];
+    else if (arg == "--archive" && i + 1 < argc)
+      archive_path = argv[++i];
+    else if (arg == "--make-archive" && i + 1 < argc)
+      new_archive_path = argv[++i];
+    else if (arg == "--program" && i + 1 < argc)
+      program_id = std::stoull(argv[++i]);
+    else if (arg == "--serve" && i + 1 < argc)
+      socket_path = argv[++i];
+    else if (arg == "--workers" && i + 1 < argc)
+      num_workers = std::stoul(argv[++i]);
+    else if (arg == "--memo" && i + 1 < argc)
+      memo_capacity = std::stoull(argv[++i]);
+    else if (arg == "--var" && i + 1 < argc)
+      var_names.push_back(argv[++i]);
+    else if (arg == "--test")
+      run_tests = true;
+    else if (arg == "--stream")
+      stream = true;
+    else if (arg == "--batch")
+      batch = true;
+    else if (arg == "--all-results")
+      all_results = true;
+    else if (arg.size() == 3 && arg.compare(0, 2, "-O") == 0 &&
+             arg[2] >= '0' && arg[2] <= '0' + lang::kMaxOptLevel)
+      opt_level = arg[2] - '0';
+    else if (arg == "--optimize")
+      opt_level = lang::kMaxOptLevel;
+    else if (arg == "--opt-stats")
+      opt_stats = true;
+    else if (arg == "--disassemble")
+      disassemble = true;
+    else if (arg == "--diff-bytecode")
+      diff_bytecode = true;
+    else if (arg == "--binary")
+      format = lang::ResultWriter::FORMAT_BINARY;
+    else if (batch || !new_archive_path.empty())
+      script_paths.push_back(arg);
+    else
+      input = arg;
+  }
 
-  return 0;
+  if (run_tests) RunSelfTests();
+  if (batch) return RunBatch(script_paths, format);
+  if (!new_archive_path.empty())
+    return MakeArchive(new_archive_path, script_paths);
+  if (!socket_path.empty()) {
+    // Block these before any threads are started so only the thread waiting
+    // for them ever sees them.
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, nullptr);
+
+    lang::ScriptServer server(std::max(num_workers, 1u));
+    server.setMemoCapacity(memo_capacity);
+    if (!server.Listen(socket_path)) {
+      std::cerr << "Unable to listen on " << socket_path << "\n";
+      return 1;
+    }
+    std::thread stopper([&] {
+      int sig;
+      sigwait(&stop_signals, &sig);
+      server.Stop();
+    });
+    server.Serve();
+
+    // Serve() can also return because accepting failed.
+    pthread_kill(stopper.native_handle(), SIGTERM);
+    stopper.join();
+    return 0;
+  }
+  if (stream) {
+    Compiler().RunStream(STDIN_FILENO, std::cout);
+    return 0;
+  }
+  if (input.empty() && archive_path.empty()) return 0;
+
+  Compiler compiler;
+  std::vector<lang::TypeKind> result_types;
+  std::vector<lang::SymbolHandle> vars;
+  std::vector<lang::TypeKind> var_types;
+  auto run_image = [&](const lang::ProgramImage &image) {
+    if (!compiler.RunImage(image)) {
+      std::cerr << compiler.getEvaluator().getStatus().getMessage() << "\n";
+      return false;
+    }
+    for (uint64_t i = 0; i < image.getNumResultTypes(); ++i)
+      result_types.push_back(
+          static_cast<lang::TypeKind>(image.getResultTypes()[i]));
+    for (const std::string &name : var_names) {
+      vars.push_back(image.ResolveSymbol(name));
+      var_types.push_back(vars.back().isValid()
+                              ? image.getSymbolType(vars.back())
+                              : lang::TYPE_INT);
+    }
+    return true;
+  };
+
+  // Reuse the compiled program in the cache file if it was compiled from this
+  // same source, the same way. Otherwise, compile it and refresh the cache.
+  // Optimizations can drop globals that are not printed with --var, so the
+  // level and those globals are hashed along with the source.
+  std::vector<std::string> kept_names = var_names;
+  std::sort(kept_names.begin(), kept_names.end());
+  std::string cache_key = input + '\0' + std::to_string(opt_level);
+  for (const std::string &name : kept_names) cache_key += '\0' + name;
+  uint64_t hash = lang::HashSource(cache_key);
+  lang::ByteCodeFile cache;
+  lang::ProgramImageBuffer archived;
+  if (!archive_path.empty()) {
+    lang::ByteCodeArchive archive;
+    if (!archive.Map(archive_path) || program_id >= archive.getNumPrograms() ||
+        !archive.Load(program_id, archived)) {
+      std::cerr << "Unable to load program " << program_id << " from "
+                << archive_path << "\n";
+      return 1;
+    }
+    if (!run_image(archived)) return 1;
+  } else if (!cache_path.empty() && cache.Map(cache_path) &&
+             cache.getSourceHash() == hash) {
+    if (!run_image(cache)) return 1;
+  } else {
+    compiler.setOptLevel(opt_level, {var_names.begin(), var_names.end()});
+    std::string error;
+    if (!compiler.ResetAndTryRun(input, error)) {
+      std::cerr << error << "\n";
+      return 1;
+    }
+    if (opt_stats && compiler.getPasses())
+      compiler.getPasses()->DumpStats(std::cerr);
+    if (disassemble) lang::DumpDisassembly(compiler.getEmitter(), std::cerr);
+    if (diff_bytecode) {
+      // Compared to what the same script compiles to at -O0.
+      Compiler direct;
+      if (direct.Lex(input).isSuccessful() && direct.Parse().isSuccessful()) {
+        direct.GenerateByteCode();
+        lang::DumpByteCodeDiff(direct.getEmitter(), compiler.getEmitter(),
+                               std::cerr);
+      }
+    }
+    result_types = compiler.getEmitter().getResultTypes();
+    for (const std::string &name : var_names) {
+      vars.push_back(compiler.getEmitter().ResolveSymbol(name));
+      var_types.push_back(vars.back().isValid()
+                              ? compiler.getEmitter().getSymbolType(vars.back())
+                              : lang::TYPE_INT);
+    }
+    if (!cache_path.empty() &&
+        !lang::WriteByteCodeFile(cache_path, hash, compiler.getEmitter()))
+      std::cerr << "Unable to write bytecode cache " << cache_path << "\n";
+  }
+
+  // Without --all-results or --var, only the last result is written like
+  // before, but it must be the only one.
+  const lang::ByteCodeEvaluator &eval = compiler.getEvaluator();
+  lang::ResultWriter writer(eval, format);
+  if (all_results) {
+    writer.WriteEvalStack(result_types);
+  } else if (var_names.empty()) {
+    assert(eval.getEvalStack().size() == 1);
+    writer.Write(eval.getEvalStack().back(), result_types.back());
+  }
+  for (size_t i = 0; i < vars.size(); ++i) {
+    if (!vars[i].isValid()) {
+      std::cerr << "Unknown variable " << var_names[i] << "\n";
+      return 1;
+    }
+    writer.WriteNamed(var_names[i], eval.getValue(vars[i]), var_types[i]);
+  }
+  return writer.Flush(STDOUT_FILENO) ? 0 : 1;
 }